@@ -1059,6 +1059,8 @@ void MapNWRAM_B(u32 num, u8 val)
     u8 oldval = (MBK[0][mbkn] >> mbks) & 0xFF;
     if (oldval == val) return;
 
+    DSi_DSP::WaitForThread();
+
 #ifdef JIT_ENABLED
     ARMJIT_Memory::RemapNWRAM(1);
 #endif
@@ -1089,6 +1091,9 @@ void MapNWRAM_B(u32 num, u8 val)
             NWRAMMap_B[mVal & 0x03][(mVal >> 2) & 0x7] = ptr;
         }
     }
+
+    // the DSP's view of its program memory may have changed
+    DSi_DSP::InvalidateProgramCache();
 }
 
 void MapNWRAM_C(u32 num, u8 val)
@@ -1108,6 +1113,8 @@ void MapNWRAM_C(u32 num, u8 val)
     u8 oldval = (MBK[0][mbkn] >> mbks) & 0xFF;
     if (oldval == val) return;
 
+    DSi_DSP::WaitForThread();
+
 #ifdef JIT_ENABLED
     ARMJIT_Memory::RemapNWRAM(2);
 #endif
@@ -0,0 +1,499 @@
+/*
+    Copyright 2016-2022 melonDS team
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <string.h>
+#include "DSi_AESKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AESKERNELS_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+// unlike SSE/AVX, there is no portable way to enable these per function,
+// so they are only used when the build targets them
+#define AESKERNELS_ARMV8
+#include <arm_neon.h>
+#endif
+
+namespace DSi_AES
+{
+namespace Kernels
+{
+
+int Impl;
+
+
+// reference implementation, on top of tiny-AES
+
+static inline void Reverse16(u8* dst, const u8* src)
+{
+    for (int i = 0; i < 16; i++)
+        dst[i] = src[15-i];
+}
+
+void CTRCrypt_Scalar(AES_ctx* ctx, u8* dst, const u8* src, u32 len)
+{
+    for (u32 i = 0; i < len; i += 16)
+    {
+        u8 tmp[16];
+        Reverse16(tmp, &src[i]);
+        AES_CTR_xcrypt_buffer(ctx, tmp, 16);
+        Reverse16(&dst[i], tmp);
+    }
+}
+
+void CCMEncrypt_Scalar(AES_ctx* ctx, u8* mac, u8* dst, const u8* src, u32 len)
+{
+    for (u32 i = 0; i < len; i += 16)
+    {
+        u8 tmp[16];
+        Reverse16(tmp, &src[i]);
+
+        for (int j = 0; j < 16; j++) mac[j] ^= tmp[j];
+        AES_CTR_xcrypt_buffer(ctx, tmp, 16);
+        AES_ECB_encrypt(ctx, mac);
+
+        Reverse16(&dst[i], tmp);
+    }
+}
+
+void CCMDecrypt_Scalar(AES_ctx* ctx, u8* mac, u8* dst, const u8* src, u32 len)
+{
+    for (u32 i = 0; i < len; i += 16)
+    {
+        u8 tmp[16];
+        Reverse16(tmp, &src[i]);
+
+        AES_CTR_xcrypt_buffer(ctx, tmp, 16);
+        for (int j = 0; j < 16; j++) mac[j] ^= tmp[j];
+        AES_ECB_encrypt(ctx, mac);
+
+        Reverse16(&dst[i], tmp);
+    }
+}
+
+void CBCMAC_Scalar(AES_ctx* ctx, u8* mac, const u8* src, u32 len)
+{
+    for (u32 i = 0; i < len; i += 16)
+    {
+        u8 tmp[16];
+        Reverse16(tmp, &src[i]);
+
+        for (int j = 0; j < 16; j++) mac[j] ^= tmp[j];
+        AES_ECB_encrypt(ctx, mac);
+    }
+}
+
+void (*CTRCrypt)(AES_ctx* ctx, u8* dst, const u8* src, u32 len) = CTRCrypt_Scalar;
+void (*CCMEncrypt)(AES_ctx* ctx, u8* mac, u8* dst, const u8* src, u32 len) = CCMEncrypt_Scalar;
+void (*CCMDecrypt)(AES_ctx* ctx, u8* mac, u8* dst, const u8* src, u32 len) = CCMDecrypt_Scalar;
+void (*CBCMAC)(AES_ctx* ctx, u8* mac, const u8* src, u32 len) = CBCMAC_Scalar;
+
+
+// the counter is the IV as a 128-bit big-endian number
+
+static inline void LoadCounter(const AES_ctx* ctx, u64& hi, u64& lo)
+{
+    hi = 0; lo = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        hi = (hi << 8) | ctx->Iv[i];
+        lo = (lo << 8) | ctx->Iv[8+i];
+    }
+}
+
+static inline void StoreCounter(AES_ctx* ctx, u64 hi, u64 lo)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        ctx->Iv[i] = hi & 0xFF; hi >>= 8;
+        ctx->Iv[8+i] = lo & 0xFF; lo >>= 8;
+    }
+}
+
+static inline void IncCounter(u64& hi, u64& lo)
+{
+    if (++lo == 0) hi++;
+}
+
+
+#ifdef AESKERNELS_X86
+
+// byte-reverses a whole block, which both converts the counter to the
+// big-endian layout AES expects and does the DSi's block swap
+#define REVERSE_MASK _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+
+__attribute__((target("aes,ssse3")))
+static inline void LoadKeys_AESNI(const AES_ctx* ctx, __m128i* rk)
+{
+    for (int i = 0; i < 11; i++)
+        rk[i] = _mm_loadu_si128((const __m128i*)&ctx->RoundKey[i*16]);
+}
+
+__attribute__((target("aes,ssse3")))
+static inline __m128i Encrypt_AESNI(__m128i b, const __m128i* rk)
+{
+    b = _mm_xor_si128(b, rk[0]);
+    for (int r = 1; r < 10; r++)
+        b = _mm_aesenc_si128(b, rk[r]);
+    return _mm_aesenclast_si128(b, rk[10]);
+}
+
+// two independent blocks, interleaved to hide the AESENC latency
+__attribute__((target("aes,ssse3")))
+static inline void Encrypt2_AESNI(__m128i& a, __m128i& b, const __m128i* rk)
+{
+    a = _mm_xor_si128(a, rk[0]);
+    b = _mm_xor_si128(b, rk[0]);
+    for (int r = 1; r < 10; r++)
+    {
+        a = _mm_aesenc_si128(a, rk[r]);
+        b = _mm_aesenc_si128(b, rk[r]);
+    }
+    a = _mm_aesenclast_si128(a, rk[10]);
+    b = _mm_aesenclast_si128(b, rk[10]);
+}
+
+__attribute__((target("aes,ssse3")))
+static inline __m128i CounterBlock_AESNI(u64 hi, u64 lo)
+{
+    return _mm_shuffle_epi8(_mm_set_epi64x((s64)hi, (s64)lo), REVERSE_MASK);
+}
+
+__attribute__((target("aes,ssse3")))
+void CTRCrypt_AESNI(AES_ctx* ctx, u8* dst, const u8* src, u32 len)
+{
+    __m128i rk[11];
+    LoadKeys_AESNI(ctx, rk);
+    const __m128i rev = REVERSE_MASK;
+
+    u64 hi, lo;
+    LoadCounter(ctx, hi, lo);
+
+    u32 i = 0;
+    for (; (i + 64) <= len; i += 64)
+    {
+        __m128i k[4];
+        for (int j = 0; j < 4; j++)
+        {
+            k[j] = _mm_xor_si128(CounterBlock_AESNI(hi, lo), rk[0]);
+            IncCounter(hi, lo);
+        }
+
+        for (int r = 1; r < 10; r++)
+            for (int j = 0; j < 4; j++)
+                k[j] = _mm_aesenc_si128(k[j], rk[r]);
+
+        for (int j = 0; j < 4; j++)
+        {
+            k[j] = _mm_aesenclast_si128(k[j], rk[10]);
+
+            __m128i s = _mm_loadu_si128((const __m128i*)&src[i + j*16]);
+            _mm_storeu_si128((__m128i*)&dst[i + j*16], _mm_xor_si128(s, _mm_shuffle_epi8(k[j], rev)));
+        }
+    }
+
+    for (; i < len; i += 16)
+    {
+        __m128i k = Encrypt_AESNI(CounterBlock_AESNI(hi, lo), rk);
+        IncCounter(hi, lo);
+
+        __m128i s = _mm_loadu_si128((const __m128i*)&src[i]);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_xor_si128(s, _mm_shuffle_epi8(k, rev)));
+    }
+
+    StoreCounter(ctx, hi, lo);
+}
+
+// the MAC chain is serial, but each step can run alongside a keystream block
+
+__attribute__((target("aes,ssse3")))
+void CCMEncrypt_AESNI(AES_ctx* ctx, u8* mac, u8* dst, const u8* src, u32 len)
+{
+    __m128i rk[11];
+    LoadKeys_AESNI(ctx, rk);
+    const __m128i rev = REVERSE_MASK;
+
+    u64 hi, lo;
+    LoadCounter(ctx, hi, lo);
+
+    __m128i m = _mm_loadu_si128((const __m128i*)mac);
+
+    for (u32 i = 0; i < len; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)&src[i]);
+
+        __m128i k = CounterBlock_AESNI(hi, lo);
+        IncCounter(hi, lo);
+
+        m = _mm_xor_si128(m, _mm_shuffle_epi8(s, rev));
+        Encrypt2_AESNI(k, m, rk);
+
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_xor_si128(s, _mm_shuffle_epi8(k, rev)));
+    }
+
+    _mm_storeu_si128((__m128i*)mac, m);
+    StoreCounter(ctx, hi, lo);
+}
+
+__attribute__((target("aes,ssse3")))
+void CCMDecrypt_AESNI(AES_ctx* ctx, u8* mac, u8* dst, const u8* src, u32 len)
+{
+    __m128i rk[11];
+    LoadKeys_AESNI(ctx, rk);
+    const __m128i rev = REVERSE_MASK;
+
+    u64 hi, lo;
+    LoadCounter(ctx, hi, lo);
+
+    __m128i m = _mm_loadu_si128((const __m128i*)mac);
+
+    // the plaintext is only known after the keystream, so the MAC step
+    // for each block runs together with the keystream for the next one
+    for (u32 i = 0; i < len; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)&src[i]);
+
+        __m128i k = CounterBlock_AESNI(hi, lo);
+        IncCounter(hi, lo);
+
+        if (i == 0)
+            k = Encrypt_AESNI(k, rk);
+        else
+            Encrypt2_AESNI(k, m, rk);
+
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(s, rev), k);
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_shuffle_epi8(p, rev));
+
+        m = _mm_xor_si128(m, p);
+    }
+
+    if (len)
+        m = Encrypt_AESNI(m, rk);
+
+    _mm_storeu_si128((__m128i*)mac, m);
+    StoreCounter(ctx, hi, lo);
+}
+
+__attribute__((target("aes,ssse3")))
+void CBCMAC_AESNI(AES_ctx* ctx, u8* mac, const u8* src, u32 len)
+{
+    __m128i rk[11];
+    LoadKeys_AESNI(ctx, rk);
+    const __m128i rev = REVERSE_MASK;
+
+    __m128i m = _mm_loadu_si128((const __m128i*)mac);
+
+    for (u32 i = 0; i < len; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)&src[i]);
+        m = Encrypt_AESNI(_mm_xor_si128(m, _mm_shuffle_epi8(s, rev)), rk);
+    }
+
+    _mm_storeu_si128((__m128i*)mac, m);
+}
+
+#undef REVERSE_MASK
+
+#endif // AESKERNELS_X86
+
+
+#ifdef AESKERNELS_ARMV8
+
+static inline void LoadKeys_ARMv8(const AES_ctx* ctx, uint8x16_t* rk)
+{
+    for (int i = 0; i < 11; i++)
+        rk[i] = vld1q_u8(&ctx->RoundKey[i*16]);
+}
+
+// AESE does AddRoundKey before SubBytes/ShiftRows, so the rounds are shifted by one
+// compared to AES-NI, and the last round key is XORed separately
+static inline uint8x16_t Encrypt_ARMv8(uint8x16_t b, const uint8x16_t* rk)
+{
+    for (int r = 0; r < 9; r++)
+        b = vaesmcq_u8(vaeseq_u8(b, rk[r]));
+    b = vaeseq_u8(b, rk[9]);
+    return veorq_u8(b, rk[10]);
+}
+
+static inline void Encrypt2_ARMv8(uint8x16_t& a, uint8x16_t& b, const uint8x16_t* rk)
+{
+    for (int r = 0; r < 9; r++)
+    {
+        a = vaesmcq_u8(vaeseq_u8(a, rk[r]));
+        b = vaesmcq_u8(vaeseq_u8(b, rk[r]));
+    }
+    a = veorq_u8(vaeseq_u8(a, rk[9]), rk[10]);
+    b = veorq_u8(vaeseq_u8(b, rk[9]), rk[10]);
+}
+
+static inline uint8x16_t Reverse_ARMv8(uint8x16_t v)
+{
+    v = vrev64q_u8(v);
+    return vextq_u8(v, v, 8);
+}
+
+static inline uint8x16_t CounterBlock_ARMv8(u64 hi, u64 lo)
+{
+    return Reverse_ARMv8(vreinterpretq_u8_u64(vcombine_u64(vcreate_u64(lo), vcreate_u64(hi))));
+}
+
+void CTRCrypt_ARMv8(AES_ctx* ctx, u8* dst, const u8* src, u32 len)
+{
+    uint8x16_t rk[11];
+    LoadKeys_ARMv8(ctx, rk);
+
+    u64 hi, lo;
+    LoadCounter(ctx, hi, lo);
+
+    u32 i = 0;
+    for (; (i + 32) <= len; i += 32)
+    {
+        uint8x16_t k0 = CounterBlock_ARMv8(hi, lo);
+        IncCounter(hi, lo);
+        uint8x16_t k1 = CounterBlock_ARMv8(hi, lo);
+        IncCounter(hi, lo);
+
+        Encrypt2_ARMv8(k0, k1, rk);
+
+        vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&src[i]), Reverse_ARMv8(k0)));
+        vst1q_u8(&dst[i+16], veorq_u8(vld1q_u8(&src[i+16]), Reverse_ARMv8(k1)));
+    }
+
+    for (; i < len; i += 16)
+    {
+        uint8x16_t k = Encrypt_ARMv8(CounterBlock_ARMv8(hi, lo), rk);
+        IncCounter(hi, lo);
+
+        vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&src[i]), Reverse_ARMv8(k)));
+    }
+
+    StoreCounter(ctx, hi, lo);
+}
+
+void CCMEncrypt_ARMv8(AES_ctx* ctx, u8* mac, u8* dst, const u8* src, u32 len)
+{
+    uint8x16_t rk[11];
+    LoadKeys_ARMv8(ctx, rk);
+
+    u64 hi, lo;
+    LoadCounter(ctx, hi, lo);
+
+    uint8x16_t m = vld1q_u8(mac);
+
+    for (u32 i = 0; i < len; i += 16)
+    {
+        uint8x16_t s = vld1q_u8(&src[i]);
+
+        uint8x16_t k = CounterBlock_ARMv8(hi, lo);
+        IncCounter(hi, lo);
+
+        m = veorq_u8(m, Reverse_ARMv8(s));
+        Encrypt2_ARMv8(k, m, rk);
+
+        vst1q_u8(&dst[i], veorq_u8(s, Reverse_ARMv8(k)));
+    }
+
+    vst1q_u8(mac, m);
+    StoreCounter(ctx, hi, lo);
+}
+
+void CCMDecrypt_ARMv8(AES_ctx* ctx, u8* mac, u8* dst, const u8* src, u32 len)
+{
+    uint8x16_t rk[11];
+    LoadKeys_ARMv8(ctx, rk);
+
+    u64 hi, lo;
+    LoadCounter(ctx, hi, lo);
+
+    uint8x16_t m = vld1q_u8(mac);
+
+    for (u32 i = 0; i < len; i += 16)
+    {
+        uint8x16_t s = vld1q_u8(&src[i]);
+
+        uint8x16_t k = CounterBlock_ARMv8(hi, lo);
+        IncCounter(hi, lo);
+
+        if (i == 0)
+            k = Encrypt_ARMv8(k, rk);
+        else
+            Encrypt2_ARMv8(k, m, rk);
+
+        uint8x16_t p = veorq_u8(Reverse_ARMv8(s), k);
+        vst1q_u8(&dst[i], Reverse_ARMv8(p));
+
+        m = veorq_u8(m, p);
+    }
+
+    if (len)
+        m = Encrypt_ARMv8(m, rk);
+
+    vst1q_u8(mac, m);
+    StoreCounter(ctx, hi, lo);
+}
+
+void CBCMAC_ARMv8(AES_ctx* ctx, u8* mac, const u8* src, u32 len)
+{
+    uint8x16_t rk[11];
+    LoadKeys_ARMv8(ctx, rk);
+
+    uint8x16_t m = vld1q_u8(mac);
+
+    for (u32 i = 0; i < len; i += 16)
+        m = Encrypt_ARMv8(veorq_u8(m, Reverse_ARMv8(vld1q_u8(&src[i]))), rk);
+
+    vst1q_u8(mac, m);
+}
+
+#endif // AESKERNELS_ARMV8
+
+
+void Init()
+{
+    Impl = Impl_Scalar;
+    CTRCrypt = CTRCrypt_Scalar;
+    CCMEncrypt = CCMEncrypt_Scalar;
+    CCMDecrypt = CCMDecrypt_Scalar;
+    CBCMAC = CBCMAC_Scalar;
+
+#if defined(AESKERNELS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3"))
+    {
+        Impl = Impl_AESNI;
+        CTRCrypt = CTRCrypt_AESNI;
+        CCMEncrypt = CCMEncrypt_AESNI;
+        CCMDecrypt = CCMDecrypt_AESNI;
+        CBCMAC = CBCMAC_AESNI;
+    }
+#elif defined(AESKERNELS_ARMV8)
+    Impl = Impl_ARMv8;
+    CTRCrypt = CTRCrypt_ARMv8;
+    CCMEncrypt = CCMEncrypt_ARMv8;
+    CCMDecrypt = CCMDecrypt_ARMv8;
+    CBCMAC = CBCMAC_ARMv8;
+#endif
+}
+
+int GetImpl()
+{
+    return Impl;
+}
+
+}
+}
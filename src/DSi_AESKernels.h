@@ -0,0 +1,62 @@
+/*
+    Copyright 2016-2022 melonDS team
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef DSI_AESKERNELS_H
+#define DSI_AESKERNELS_H
+
+#include "types.h"
+#include "tiny-AES-c/aes.hpp"
+
+// bulk AES-CTR/CCM for the AES engine and the NAND
+//
+// data is taken as the DSi stores it, with each 16-byte block byte-reversed
+// (what DSi_AES::Swap16() undoes), the swapping is done as part of the kernel
+// the MAC is kept in normal AES byte order
+// ctx->Iv is advanced by one per block, like AES_CTR_xcrypt_buffer() would
+// len must be a multiple of 16
+
+namespace DSi_AES
+{
+namespace Kernels
+{
+
+enum
+{
+    Impl_Scalar = 0,
+    Impl_AESNI,
+    Impl_ARMv8,
+};
+
+// picks the fastest implementation supported by the host CPU
+void Init();
+int GetImpl();
+
+// CTR encrypt/decrypt
+extern void (*CTRCrypt)(AES_ctx* ctx, u8* dst, const u8* src, u32 len);
+
+// CTR plus CBC-MAC over the plaintext
+extern void (*CCMEncrypt)(AES_ctx* ctx, u8* mac, u8* dst, const u8* src, u32 len);
+extern void (*CCMDecrypt)(AES_ctx* ctx, u8* mac, u8* dst, const u8* src, u32 len);
+
+// CBC-MAC only (CCM associated data)
+extern void (*CBCMAC)(AES_ctx* ctx, u8* mac, const u8* src, u32 len);
+
+}
+}
+
+#endif // DSI_AESKERNELS_H
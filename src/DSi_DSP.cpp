@@ -16,12 +16,22 @@
     with melonDS. If not, see http://www.gnu.org/licenses/.
 */
 
+#include <string.h>
+#include <atomic>
+#include <vector>
+
 #include "teakra/include/teakra/teakra.h"
 
 #include "DSi.h"
 #include "DSi_DSP.h"
 #include "FIFO.h"
 #include "NDS.h"
+#include "Platform.h"
+
+#ifdef JIT_ENABLED
+#include "ARMJIT.h"
+#include "ARMJIT_Memory.h"
+#endif
 
 
 namespace DSi_DSP
@@ -51,6 +61,69 @@ int PDataDMALen = 0;
 constexpr u32 DataMemoryOffset = 0x20000; // from Teakra memory_interface.h
 // NOTE: ^ IS IN DSP WORDS, NOT IN BYTES!
 
+// threaded mode: the Teakra core runs its slices on a thread of its own, and
+// the emulation thread only waits for it at sync points (DSP I/O register
+// accesses, which includes PDATA DMA, and NWRAM remapping)
+//
+// things the DSP does to the rest of the system from that thread are either
+// deferred (IRQs, main RAM writes, JIT invalidation) or handed over to the
+// emulation thread (AHBM accesses outside of main RAM)
+//
+// main RAM writes are buffered and only applied when the slice is collected
+// (or when the DSP thread hands over a bus access), so the ARM side never runs
+// JIT blocks over memory the DSP has changed without them being invalidated.
+// main RAM reads however are done directly: the DSP can see ARM writes that
+// happen later in emulated time than the slice it is running, depending on
+// host thread timing. this makes threaded mode nondeterministic, which is why
+// it's off by default
+bool Threaded;
+Platform::Thread* DSPThread;
+Platform::Semaphore* ThreadStart;   // emu thread -> DSP thread: run ThreadCycles
+Platform::Semaphore* ThreadSignal;  // DSP thread -> emu thread: see ThreadPending
+Platform::Semaphore* BusReply;      // emu thread -> DSP thread: BusRequest serviced
+std::atomic_bool ThreadQuit;
+bool ThreadBusy; // emu thread side: a slice has been started and not collected yet
+u32 ThreadCycles;
+thread_local bool OnDSPThread = false;
+
+enum
+{
+    Pending_Done       = (1<<0),
+    Pending_BusRequest = (1<<1),
+    Pending_IRQ        = (1<<2),
+    Pending_SemIRQ     = (1<<3),
+};
+std::atomic_uint32_t ThreadPending;
+
+struct
+{
+    u32 Size;
+    bool Write;
+    u32 Addr;
+    u32 Val;
+} BusRequest;
+bool ServicingBus;
+// program cache invalidation that came in while the DSP thread was mid-slice
+bool ProgramCacheStale;
+
+// main RAM writes done by the DSP thread during the current slice, in order
+// along with which 512-byte chunks they touch
+// only accessed by the DSP thread while a slice runs, and by the emulation
+// thread while the DSP thread waits (slice done, or bus access handed over)
+struct MainRAMWrite
+{
+    u32 Addr;
+    u32 Size;
+    u32 Val;
+};
+std::vector<MainRAMWrite> MainRAMWrites;
+u32 MainRAMWritten[0x1000000 / 512 / 32];
+
+// how many sync points found the DSP thread with a slice started,
+// and how many of those actually had to wait for it
+u64 SyncPoints;
+u64 SyncStalls;
+
 u16 GetPSTS()
 {
     u16 r = DSP_PSTS & (1<<9); // this is the only sticky bit
@@ -70,20 +143,34 @@ u16 GetPSTS()
     return r;
 }
 
+void SetDSPIRQ()
+{
+    if (OnDSPThread)
+        ThreadPending.fetch_or(Pending_IRQ);
+    else
+        NDS::SetIRQ(0, NDS::IRQ_DSi_DSP);
+}
+
 void IrqRep0()
 {
-    if (DSP_PCFG & (1<< 9)) NDS::SetIRQ(0, NDS::IRQ_DSi_DSP);
+    if (DSP_PCFG & (1<< 9)) SetDSPIRQ();
 }
 void IrqRep1()
 {
-    if (DSP_PCFG & (1<<10)) NDS::SetIRQ(0, NDS::IRQ_DSi_DSP);
+    if (DSP_PCFG & (1<<10)) SetDSPIRQ();
 }
 void IrqRep2()
 {
-    if (DSP_PCFG & (1<<11)) NDS::SetIRQ(0, NDS::IRQ_DSi_DSP);
+    if (DSP_PCFG & (1<<11)) SetDSPIRQ();
 }
 void IrqSem()
 {
+    if (OnDSPThread)
+    {
+        ThreadPending.fetch_or(Pending_SemIRQ);
+        return;
+    }
+
     DSP_PSTS |= 1<<9;
     // apparently these are always fired?
     NDS::SetIRQ(0, NDS::IRQ_DSi_DSP);
@@ -119,11 +206,270 @@ void DSPWrite16(u32 addr, u16 val)
     }
 }
 
+u32 BusAccess(u32 size, bool write, u32 addr, u32 val)
+{
+    if (write)
+    {
+        switch (size)
+        {
+        case 1: DSi::ARM9Write8 (addr, (u8)val); break;
+        case 2: DSi::ARM9Write16(addr, (u16)val); break;
+        case 4: DSi::ARM9Write32(addr, val); break;
+        }
+        return 0;
+    }
+
+    switch (size)
+    {
+    case 1: return DSi::ARM9Read8 (addr);
+    case 2: return DSi::ARM9Read16(addr);
+    case 4: return DSi::ARM9Read32(addr);
+    }
+    return 0;
+}
+
+// called from the DSP thread, blocks until the emulation thread gets to it
+u32 ThreadBusAccess(u32 size, bool write, u32 addr, u32 val)
+{
+    BusRequest.Size = size;
+    BusRequest.Write = write;
+    BusRequest.Addr = addr;
+    BusRequest.Val = val;
+
+    ThreadPending.fetch_or(Pending_BusRequest);
+    Platform::Semaphore_Post(ThreadSignal);
+    Platform::Semaphore_Wait(BusReply);
+
+    return BusRequest.Val;
+}
+
+void ApplyMainRAMWrites();
+
+void ServiceBusRequest()
+{
+    // keep the DSP's writes in order with whatever it accesses now
+    ApplyMainRAMWrites();
+
+    // the DSP thread is stuck until this is done, so anything this ends up
+    // syncing with (ie. the DSP's own registers) must not wait for it
+    ServicingBus = true;
+    BusRequest.Val = BusAccess(BusRequest.Size, BusRequest.Write, BusRequest.Addr, BusRequest.Val);
+    ServicingBus = false;
+
+    ThreadPending.fetch_and(~Pending_BusRequest);
+    Platform::Semaphore_Post(BusReply);
+}
+
+inline bool IsDirectMainRAM(u32 addr)
+{
+    // DSi::ARM9Read32 patches this word
+    return (addr & 0xFF000000) == 0x02000000 && (addr & ~0x3) != 0x02FE71B0;
+}
+
+// DSP thread side
+template <typename T>
+T ReadMainRAM(u32 addr)
+{
+    T val = *(T*)&NDS::MainRAM[addr];
+
+    // see through what this slice wrote and hasn't been applied yet
+    u32 chunk = addr >> 9;
+    if (!(MainRAMWritten[chunk >> 5] & (1 << (chunk & 0x1F))))
+        return val;
+
+    u8* bytes = (u8*)&val;
+    for (const MainRAMWrite& w : MainRAMWrites)
+    {
+        if ((w.Addr + w.Size) <= addr || w.Addr >= (addr + sizeof(T)))
+            continue;
+
+        for (u32 i = 0; i < w.Size; i++)
+        {
+            u32 a = w.Addr + i;
+            if (a >= addr && a < (addr + sizeof(T)))
+                bytes[a - addr] = ((u8*)&w.Val)[i];
+        }
+    }
+
+    return val;
+}
+
+// emulation thread side, the DSP thread must be waiting
+void ApplyMainRAMWrites()
+{
+    if (MainRAMWrites.empty()) return;
+
+    for (const MainRAMWrite& w : MainRAMWrites)
+        memcpy(&NDS::MainRAM[w.Addr], &w.Val, w.Size);
+    MainRAMWrites.clear();
+
+    for (u32 i = 0; i < sizeof(MainRAMWritten) / sizeof(MainRAMWritten[0]); i++)
+    {
+        u32 written = MainRAMWritten[i];
+        if (!written) continue;
+        MainRAMWritten[i] = 0;
+
+#ifdef JIT_ENABLED
+        while (written)
+        {
+            u32 chunk = (i << 5) | __builtin_ctz(written);
+            written &= written - 1;
+
+            for (u32 j = 0; j < 512; j += 16)
+                ARMJIT::CheckAndInvalidate<0, ARMJIT_Memory::memregion_MainRAM>(0x02000000 | (chunk << 9) | j);
+        }
+#endif
+    }
+}
+
+template <typename T>
+T AHBMRead(u32 addr)
+{
+    if (!OnDSPThread)
+        return (T)BusAccess(sizeof(T), false, addr, 0);
+
+    addr &= ~(sizeof(T)-1);
+    if (IsDirectMainRAM(addr))
+        return ReadMainRAM<T>(addr & NDS::MainRAMMask);
+
+    return (T)ThreadBusAccess(sizeof(T), false, addr, 0);
+}
+
+template <typename T>
+void AHBMWrite(u32 addr, T val)
+{
+    if (!OnDSPThread)
+    {
+        BusAccess(sizeof(T), true, addr, val);
+        return;
+    }
+
+    addr &= ~(sizeof(T)-1);
+    if (IsDirectMainRAM(addr))
+    {
+        addr &= NDS::MainRAMMask;
+        MainRAMWrites.push_back({addr, (u32)sizeof(T), (u32)val});
+
+        u32 chunk = addr >> 9;
+        MainRAMWritten[chunk >> 5] |= (1 << (chunk & 0x1F));
+        return;
+    }
+
+    ThreadBusAccess(sizeof(T), true, addr, val);
+}
+
 void AudioCb(std::array<s16, 2> frame)
 {
     // TODO
 }
 
+void ThreadFunc()
+{
+    OnDSPThread = true;
+
+    for (;;)
+    {
+        Platform::Semaphore_Wait(ThreadStart);
+        if (ThreadQuit) break;
+
+        TeakraCore->Run(ThreadCycles);
+
+        ThreadPending.fetch_or(Pending_Done);
+        Platform::Semaphore_Post(ThreadSignal);
+    }
+}
+
+void FlushThreadEffects()
+{
+    u32 pending = ThreadPending.fetch_and(~(Pending_IRQ | Pending_SemIRQ));
+    if (pending & Pending_SemIRQ)
+        DSP_PSTS |= 1<<9;
+    if (pending & (Pending_IRQ | Pending_SemIRQ))
+        NDS::SetIRQ(0, NDS::IRQ_DSi_DSP);
+
+    ApplyMainRAMWrites();
+}
+
+// services the DSP thread, returns whether it is idle
+// if wait is set, doesn't return until it is
+bool PollThread(bool wait)
+{
+    if (!ThreadBusy) return true;
+
+    for (;;)
+    {
+        if (!(ThreadPending & (Pending_Done | Pending_BusRequest)))
+        {
+            if (!wait) return false;
+        }
+
+        Platform::Semaphore_Wait(ThreadSignal);
+
+        u32 pending = ThreadPending;
+        if (pending & Pending_BusRequest)
+        {
+            ServiceBusRequest();
+            continue;
+        }
+        if (pending & Pending_Done)
+        {
+            ThreadPending.fetch_and(~Pending_Done);
+            ThreadBusy = false;
+            FlushThreadEffects();
+
+            if (ProgramCacheStale)
+            {
+                ProgramCacheStale = false;
+                TeakraCore->InvalidateProgramCache();
+            }
+            return true;
+        }
+    }
+}
+
+void WaitForThread()
+{
+    if (!ThreadBusy || ServicingBus) return;
+
+    SyncPoints++;
+    if (!(ThreadPending & Pending_Done))
+        SyncStalls++;
+
+    PollThread(true);
+}
+
+void StartThread()
+{
+    if (DSPThread) return;
+
+    ThreadStart = Platform::Semaphore_Create();
+    ThreadSignal = Platform::Semaphore_Create();
+    BusReply = Platform::Semaphore_Create();
+    ThreadQuit = false;
+    ThreadBusy = false;
+    ThreadPending = 0;
+    ProgramCacheStale = false;
+
+    DSPThread = Platform::Thread_Create(ThreadFunc);
+}
+
+void StopThread()
+{
+    if (!DSPThread) return;
+
+    WaitForThread();
+
+    ThreadQuit = true;
+    Platform::Semaphore_Post(ThreadStart);
+    Platform::Thread_Wait(DSPThread);
+    Platform::Thread_Free(DSPThread);
+    DSPThread = nullptr;
+
+    Platform::Semaphore_Free(ThreadStart);
+    Platform::Semaphore_Free(ThreadSignal);
+    Platform::Semaphore_Free(BusReply);
+}
+
 bool Init()
 {
     TeakraCore = new Teakra::Teakra();
@@ -145,12 +491,12 @@ bool Init()
     // these happen instantaneously and without too much regard for bus aribtration
     // rules, so, this might have to be changed later on
     Teakra::AHBMCallback cb;
-    cb.read8 = DSi::ARM9Read8;
-    cb.write8 = DSi::ARM9Write8;
-    cb.read16 = DSi::ARM9Read16;
-    cb.write16 = DSi::ARM9Write16;
-    cb.read32 = DSi::ARM9Read32;
-    cb.write32 = DSi::ARM9Write32;
+    cb.read8 = AHBMRead<u8>;
+    cb.write8 = AHBMWrite<u8>;
+    cb.read16 = AHBMRead<u16>;
+    cb.write16 = AHBMWrite<u16>;
+    cb.read32 = AHBMRead<u32>;
+    cb.write32 = AHBMWrite<u32>;
     TeakraCore->SetAHBMCallback(cb);
 
     TeakraCore->SetAudioCallback(AudioCb);
@@ -158,10 +504,16 @@ bool Init()
     //PDATAReadFifo = new FIFO<u16>(16);
     //PDATAWriteFifo = new FIFO<u16>(16);
 
+    Threaded = false;
+    DSPThread = nullptr;
+    ThreadBusy = false;
+
     return true;
 }
 void DeInit()
 {
+    StopThread();
+
     //if (PDATAWriteFifo) delete PDATAWriteFifo;
     if (TeakraCore) delete TeakraCore;
 
@@ -172,6 +524,17 @@ void DeInit()
 
 void Reset()
 {
+    WaitForThread();
+
+    Threaded = Platform::GetConfigBool(Platform::DSi_DSPThreaded);
+    if (Threaded)
+        StartThread();
+    else
+        StopThread();
+
+    SyncPoints = 0;
+    SyncStalls = 0;
+
     DSPTimestamp = 0;
 
     DSP_PADR = 0;
@@ -187,6 +550,7 @@ void Reset()
     PDATAReadFifo.Clear();
     //PDATAWriteFifo->Clear();
     TeakraCore->Reset();
+    TeakraCore->InvalidateProgramCache();
 
     NDS::CancelEvent(NDS::Event_DSi_DSP);
 
@@ -217,6 +581,16 @@ inline bool IsDSPIOEnabled()
 bool DSPCatchUp()
 {
     //asm volatile("int3");
+    // the DSP itself is accessing its I/O through the bus: its thread is suspended
+    // in the middle of its slice, so the core can't be run from here, the access
+    // just happens at the point the DSP is at
+    if (ServicingBus)
+        return IsDSPCoreEnabled();
+
+    // whatever the DSP thread is running is behind the current time anyway,
+    // the rest is caught up with here
+    WaitForThread();
+
     if (!IsDSPCoreEnabled())
     {
         // nothing to do, but advance the current time so that we don't do an
@@ -242,7 +616,77 @@ bool DSPCatchUp()
 
     return true;
 }
-void DSPCatchUpU32(u32 _) { DSPCatchUp(); }
+
+void ScheduleDSPEvent()
+{
+    NDS::CancelEvent(NDS::Event_DSi_DSP);
+    NDS::ScheduleEvent(NDS::Event_DSi_DSP, false,
+            16384/*from citra (TeakraSlice)*/, DSPCatchUpU32, 0);
+}
+
+// threaded counterpart to DSPCatchUp: hands the backlog to the DSP thread
+// and lets the emulation thread go on
+void KickThread()
+{
+    if (!PollThread(false))
+    {
+        // still busy with the previous slice
+        ScheduleDSPEvent();
+        return;
+    }
+
+    if (!IsDSPCoreEnabled())
+    {
+        DSPCatchUp();
+        return;
+    }
+
+    u64 curtime = NDS::ARM9Timestamp;
+    if (DSPTimestamp < curtime)
+    {
+        u64 backlog = curtime - DSPTimestamp;
+        if (backlog > 0xFFFFFFFF) backlog = 0xFFFFFFFF;
+
+        ThreadCycles = (u32)backlog;
+        DSPTimestamp += backlog;
+        ThreadBusy = true;
+        Platform::Semaphore_Post(ThreadStart);
+    }
+
+    ScheduleDSPEvent();
+}
+
+void DSPCatchUpU32(u32 _)
+{
+    if (Threaded)
+        KickThread();
+    else
+        DSPCatchUp();
+}
+
+void InvalidateProgramCache()
+{
+    // can't pull the cache from under the interpreter while the DSP thread is
+    // suspended in it, do it once the slice is over
+    if (ServicingBus)
+    {
+        ProgramCacheStale = true;
+        return;
+    }
+
+    WaitForThread();
+    if (TeakraCore) TeakraCore->InvalidateProgramCache();
+}
+
+u64 GetSyncPoints()
+{
+    return SyncPoints;
+}
+
+u64 GetSyncStalls()
+{
+    return SyncStalls;
+}
 
 void PDataDMAWrite(u16 wrval)
 {
@@ -574,13 +1018,13 @@ void Run(u32 cycles)
 
     DSPTimestamp += cycles;
 
-    NDS::CancelEvent(NDS::Event_DSi_DSP);
-    NDS::ScheduleEvent(NDS::Event_DSi_DSP, false,
-            16384/*from citra (TeakraSlice)*/, DSPCatchUpU32, 0);
+    ScheduleDSPEvent();
 }
 
 void DoSavestate(Savestate* file)
 {
+    WaitForThread();
+
     file->Section("DSPi");
 
     PDATAReadFifo.DoSavestate(file);
@@ -602,6 +1046,10 @@ void DoSavestate(Savestate* file)
     file->Var16(&DSP_REP[2]);
     file->Var8((u8*)&SCFG_RST);
 
+    // NWRAM contents were restored behind the DSP's back
+    if (!file->Saving)
+        TeakraCore->InvalidateProgramCache();
+
     // TODO: save the Teakra state!!!
 }
 
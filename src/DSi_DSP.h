@@ -49,6 +49,18 @@ void DoSavestate(Savestate* file);
 
 void DSPCatchUpU32(u32 _);
 
+// to be called when the NWRAM mapped as DSP program memory changes
+void InvalidateProgramCache();
+
+// threaded mode: waits for the DSP thread to finish its current slice
+// to be called before changing anything it reads outside of the DSP I/O registers
+void WaitForThread();
+
+// threaded mode: how many sync points found the DSP thread running,
+// and how many of those had to wait for it
+u64 GetSyncPoints();
+u64 GetSyncStalls();
+
 // SCFG_RST bit0
 bool IsRstReleased();
 void SetRstLine(bool release);
@@ -18,9 +18,12 @@
 
 #include <stdio.h>
 #include <codecvt>
+#include <algorithm>
+#include <unordered_map>
 
 #include "DSi.h"
 #include "DSi_AES.h"
+#include "DSi_AESKernels.h"
 #include "DSi_NAND.h"
 #include "Platform.h"
 
@@ -45,13 +48,38 @@ u8 FATKey[16];
 u8 ESKey[16];
 
 
+// LRU cache of decrypted FAT sectors, sitting between FatFs and the NAND file
+// writes are kept in the cache and only written back on eviction or flush
+
+struct CacheEntry
+{
+    u32 Sector;
+    bool Dirty;
+    u32 Prev, Next; // LRU list, most recently used first
+    u8 Data[0x200];
+};
+
+const u32 kCacheNone = 0xFFFFFFFF;
+
+std::vector<CacheEntry> Cache;
+std::unordered_map<u32, u32> CacheMap;
+u32 CacheHead, CacheTail;
+u32 CacheUsed;
+u64 CacheHits, CacheMisses;
+
+
 UINT FF_ReadNAND(BYTE* buf, LBA_t sector, UINT num);
 UINT FF_WriteNAND(BYTE* buf, LBA_t sector, UINT num);
 
+void CacheInit(u32 size);
+void CacheFlush();
+void CacheDeInit();
+
 
 bool Init(u8* es_keyY)
 {
     CurFile = nullptr;
+    CacheInit(0);
 
     std::string nandpath = Platform::GetConfigString(Platform::DSi_NANDPath);
     std::string instnand = nandpath + Platform::InstanceFileSuffix();
@@ -97,7 +125,10 @@ bool Init(u8* es_keyY)
     fseek(nandfile, 0, SEEK_END);
     u64 nandlen = ftell(nandfile);
 
-    ff_disk_open(FF_ReadNAND, FF_WriteNAND, (LBA_t)(nandlen>>9));
+    CurFile = nandfile;
+    CacheInit((u32)std::max(Platform::GetConfigInt(Platform::DSi_NANDCacheSize), 0));
+
+    ff_disk_open(FF_ReadNAND, FF_WriteNAND, CacheFlush, (LBA_t)(nandlen>>9));
 
     FRESULT res;
     res = f_mount(&CurFS, "0:", 0);
@@ -106,6 +137,9 @@ bool Init(u8* es_keyY)
         printf("NAND mounting failed: %d\n", res);
         f_unmount("0:");
         ff_disk_close();
+        CacheDeInit();
+        fclose(nandfile);
+        CurFile = nullptr;
         return false;
     }
 
@@ -126,6 +160,11 @@ bool Init(u8* es_keyY)
         if (memcmp(nand_footer, nand_footer_ref, 16))
         {
             printf("ERROR: NAND missing nocash footer\n");
+            f_unmount("0:");
+            ff_disk_close();
+            CacheDeInit();
+            fclose(nandfile);
+            CurFile = nullptr;
             return false;
         }
     }
@@ -169,7 +208,6 @@ bool Init(u8* es_keyY)
     DSi_AES::DeriveNormalKey(keyX, keyY, tmp);
     DSi_AES::Swap16(ESKey, tmp);
 
-    CurFile = nandfile;
     return true;
 }
 
@@ -178,16 +216,38 @@ void DeInit()
     f_unmount("0:");
     ff_disk_close();
 
-    if (CurFile) fclose(CurFile);
+    if (CurFile)
+    {
+        CacheFlush();
+
+        u64 total = CacheHits + CacheMisses;
+        if (total)
+            printf("DSi NAND cache: %llu hits, %llu misses (%.1f%%)\n",
+                   (unsigned long long)CacheHits, (unsigned long long)CacheMisses,
+                   (CacheHits * 100.0) / total);
+
+        fclose(CurFile);
+    }
     CurFile = nullptr;
+
+    CacheDeInit();
 }
 
 
 FILE* GetFile()
 {
+    // the caller is going to access the raw image, so it needs to be up to date
+    if (CurFile) CacheFlush();
+
     return CurFile;
 }
 
+void GetCacheStats(u64& hits, u64& misses)
+{
+    hits = CacheHits;
+    misses = CacheMisses;
+}
+
 
 void GetIDs(u8* emmc_cid, u64& consoleid)
 {
@@ -231,13 +291,7 @@ u32 ReadFATBlock(u64 addr, u32 len, u8* buf)
     u32 res = fread(buf, len, 1, CurFile);
     if (!res) return 0;
 
-    for (u32 i = 0; i < len; i += 16)
-    {
-        u8 tmp[16];
-        DSi_AES::Swap16(tmp, &buf[i]);
-        AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-        DSi_AES::Swap16(&buf[i], tmp);
-    }
+    DSi_AES::Kernels::CTRCrypt(&ctx, buf, buf, len);
 
     return len;
 }
@@ -255,13 +309,7 @@ u32 WriteFATBlock(u64 addr, u32 len, u8* buf)
     {
         u8 tempbuf[0x200];
 
-        for (u32 i = 0; i < 0x200; i += 16)
-        {
-            u8 tmp[16];
-            DSi_AES::Swap16(tmp, &buf[s+i]);
-            AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-            DSi_AES::Swap16(&tempbuf[i], tmp);
-        }
+        DSi_AES::Kernels::CTRCrypt(&ctx, tempbuf, &buf[s], 0x200);
 
         u32 res = fwrite(tempbuf, 0x200, 1, CurFile);
         if (!res) return 0;
@@ -271,15 +319,167 @@ u32 WriteFATBlock(u64 addr, u32 len, u8* buf)
 }
 
 
+void CacheInit(u32 size)
+{
+    Cache.clear();
+    Cache.resize(size);
+    Cache.shrink_to_fit();
+    CacheMap.clear();
+    CacheMap.reserve(size);
+
+    CacheHead = kCacheNone;
+    CacheTail = kCacheNone;
+    CacheUsed = 0;
+    CacheHits = 0;
+    CacheMisses = 0;
+}
+
+void CacheDeInit()
+{
+    CacheInit(0);
+}
+
+void CacheUnlink(u32 idx)
+{
+    CacheEntry& entry = Cache[idx];
+
+    if (entry.Prev != kCacheNone) Cache[entry.Prev].Next = entry.Next;
+    else                          CacheHead = entry.Next;
+    if (entry.Next != kCacheNone) Cache[entry.Next].Prev = entry.Prev;
+    else                          CacheTail = entry.Prev;
+}
+
+void CacheMakeHead(u32 idx)
+{
+    CacheEntry& entry = Cache[idx];
+
+    entry.Prev = kCacheNone;
+    entry.Next = CacheHead;
+    if (CacheHead != kCacheNone) Cache[CacheHead].Prev = idx;
+    CacheHead = idx;
+    if (CacheTail == kCacheNone) CacheTail = idx;
+}
+
+u32 CacheLookup(u32 sector)
+{
+    auto it = CacheMap.find(sector);
+    if (it == CacheMap.end())
+        return kCacheNone;
+
+    u32 idx = it->second;
+    if (idx != CacheHead)
+    {
+        CacheUnlink(idx);
+        CacheMakeHead(idx);
+    }
+    return idx;
+}
+
+bool CacheWriteBack(CacheEntry& entry)
+{
+    if (!entry.Dirty) return true;
+
+    u64 addr = 0x10EE00 + (entry.Sector * 0x200ULL);
+    if (!WriteFATBlock(addr, 0x200, entry.Data))
+        return false;
+
+    entry.Dirty = false;
+    return true;
+}
+
+// returns a slot for the given sector, evicting the least recently used one if needed
+// the slot contents are left for the caller to fill
+u32 CacheAlloc(u32 sector)
+{
+    u32 idx;
+    if (CacheUsed < Cache.size())
+    {
+        idx = CacheUsed++;
+    }
+    else
+    {
+        idx = CacheTail;
+        if (!CacheWriteBack(Cache[idx]))
+            return kCacheNone;
+
+        CacheUnlink(idx);
+        CacheMap.erase(Cache[idx].Sector);
+    }
+
+    Cache[idx].Sector = sector;
+    Cache[idx].Dirty = false;
+    CacheMap[sector] = idx;
+    CacheMakeHead(idx);
+    return idx;
+}
+
+void CacheFlush()
+{
+    // write back in sector order to keep the file accesses sequential
+    std::vector<u32> dirty;
+    for (u32 i = 0; i < CacheUsed; i++)
+    {
+        if (Cache[i].Dirty) dirty.push_back(i);
+    }
+    if (dirty.empty()) return;
+
+    std::sort(dirty.begin(), dirty.end(), [](u32 a, u32 b) { return Cache[a].Sector < Cache[b].Sector; });
+
+    for (u32 idx : dirty)
+    {
+        if (!CacheWriteBack(Cache[idx]))
+            printf("DSi NAND: failed to write back sector %08X\n", Cache[idx].Sector);
+    }
+    fflush(CurFile);
+}
+
+
 UINT FF_ReadNAND(BYTE* buf, LBA_t sector, UINT num)
 {
     // TODO: allow selecting other partitions?
     u64 baseaddr = 0x10EE00;
 
-    u64 blockaddr = baseaddr + (sector * 0x200ULL);
+    if (Cache.empty())
+    {
+        u64 blockaddr = baseaddr + (sector * 0x200ULL);
+
+        u32 res = ReadFATBlock(blockaddr, num*0x200, buf);
+        return res >> 9;
+    }
+
+    UINT i = 0;
+    while (i < num)
+    {
+        u32 idx = CacheLookup((u32)(sector + i));
+        if (idx != kCacheNone)
+        {
+            memcpy(&buf[i*0x200], Cache[idx].Data, 0x200);
+            CacheHits++;
+            i++;
+            continue;
+        }
+
+        // read the whole run of missing sectors in one go
+        UINT runlen = 1;
+        while ((i + runlen) < num && CacheMap.find((u32)(sector + i + runlen)) == CacheMap.end())
+            runlen++;
+
+        u64 blockaddr = baseaddr + ((sector + i) * 0x200ULL);
+        if (!ReadFATBlock(blockaddr, runlen*0x200, &buf[i*0x200]))
+            return i;
 
-    u32 res = ReadFATBlock(blockaddr, num*0x200, buf);
-    return res >> 9;
+        CacheMisses += runlen;
+
+        for (UINT j = 0; j < runlen; j++, i++)
+        {
+            idx = CacheAlloc((u32)(sector + i));
+            if (idx == kCacheNone) continue;
+
+            memcpy(Cache[idx].Data, &buf[i*0x200], 0x200);
+        }
+    }
+
+    return num;
 }
 
 UINT FF_WriteNAND(BYTE* buf, LBA_t sector, UINT num)
@@ -287,10 +487,29 @@ UINT FF_WriteNAND(BYTE* buf, LBA_t sector, UINT num)
     // TODO: allow selecting other partitions?
     u64 baseaddr = 0x10EE00;
 
-    u64 blockaddr = baseaddr + (sector * 0x200ULL);
+    if (Cache.empty())
+    {
+        u64 blockaddr = baseaddr + (sector * 0x200ULL);
+
+        u32 res = WriteFATBlock(blockaddr, num*0x200, buf);
+        return res >> 9;
+    }
 
-    u32 res = WriteFATBlock(blockaddr, num*0x200, buf);
-    return res >> 9;
+    for (UINT i = 0; i < num; i++)
+    {
+        u32 idx = CacheLookup((u32)(sector + i));
+        if (idx == kCacheNone)
+        {
+            idx = CacheAlloc((u32)(sector + i));
+            if (idx == kCacheNone)
+                return i;
+        }
+
+        memcpy(Cache[idx].Data, &buf[i*0x200], 0x200);
+        Cache[idx].Dirty = true;
+    }
+
+    return num;
 }
 
 
@@ -318,18 +537,7 @@ bool ESEncrypt(u8* data, u32 len)
     AES_ECB_encrypt(&ctx, mac);
 
     u32 coarselen = len & ~0xF;
-    for (u32 i = 0; i < coarselen; i += 16)
-    {
-        u8 tmp[16];
-
-        DSi_AES::Swap16(tmp, &data[i]);
-
-        for (int i = 0; i < 16; i++) mac[i] ^= tmp[i];
-        AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-        AES_ECB_encrypt(&ctx, mac);
-
-        DSi_AES::Swap16(&data[i], tmp);
-    }
+    DSi_AES::Kernels::CCMEncrypt(&ctx, mac, data, data, coarselen);
 
     u32 remlen = len - coarselen;
     if (remlen)
@@ -405,18 +613,7 @@ bool ESDecrypt(u8* data, u32 len)
     AES_ECB_encrypt(&ctx, mac);
 
     u32 coarselen = len & ~0xF;
-    for (u32 i = 0; i < coarselen; i += 16)
-    {
-        u8 tmp[16];
-
-        DSi_AES::Swap16(tmp, &data[i]);
-
-        AES_CTR_xcrypt_buffer(&ctx, tmp, 16);
-        for (int i = 0; i < 16; i++) mac[i] ^= tmp[i];
-        AES_ECB_encrypt(&ctx, mac);
-
-        DSi_AES::Swap16(&data[i], tmp);
-    }
+    DSi_AES::Kernels::CCMDecrypt(&ctx, mac, data, data, coarselen);
 
     u32 remlen = len - coarselen;
     if (remlen)
@@ -39,6 +39,9 @@ void DeInit();
 
 FILE* GetFile();
 
+// hit/miss counters for the decrypted sector cache, since the last Init()
+void GetCacheStats(u64& hits, u64& misses);
+
 void GetIDs(u8* emmc_cid, u64& consoleid);
 
 void ReadHardwareInfo(u8* dataS, u8* dataN);
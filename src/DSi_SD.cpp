@@ -776,6 +776,7 @@ DSi_MMCStorage::DSi_MMCStorage(DSi_SDHost* host, bool internal, std::string file
     SD = nullptr;
 
     ReadOnly = false;
+    ReadAheadLen = 0;
 }
 
 DSi_MMCStorage::DSi_MMCStorage(DSi_SDHost* host, bool internal, std::string filename, u64 size, bool readonly, std::string sourcedir)
@@ -788,6 +789,7 @@ DSi_MMCStorage::DSi_MMCStorage(DSi_SDHost* host, bool internal, std::string file
     SD->Open();
 
     ReadOnly = readonly;
+    ReadAheadLen = 0;
 }
 
 DSi_MMCStorage::~DSi_MMCStorage()
@@ -826,6 +828,8 @@ void DSi_MMCStorage::Reset()
     BlockSize = 0;
     RWAddress = 0;
     RWCommand = 0;
+
+    ReadAheadLen = 0;
 }
 
 void DSi_MMCStorage::DoSavestate(Savestate* file)
@@ -845,6 +849,9 @@ void DSi_MMCStorage::DoSavestate(Savestate* file)
     file->Var64(&RWAddress);
     file->Var32(&RWCommand);
 
+    // the read-ahead buffer isn't saved, it just gets refilled
+    ReadAheadLen = 0;
+
     // TODO: what about the file contents?
 }
 
@@ -926,6 +933,7 @@ void DSi_MMCStorage::SendCMD(u8 cmd, u32 param)
         SetState(0x04);
         if (File) fflush(File);
         RWCommand = 0;
+        ReadAheadLen = 0;
         Host->SendResponse(CSR, true);
         return;
 
@@ -954,6 +962,7 @@ void DSi_MMCStorage::SendCMD(u8 cmd, u32 param)
             BlockSize = 512;
         }
         RWCommand = 18;
+        ReadAheadLen = 0;
         Host->SendResponse(CSR, true);
         RWAddress += ReadBlock(RWAddress);
         SetState(0x05);
@@ -968,6 +977,7 @@ void DSi_MMCStorage::SendCMD(u8 cmd, u32 param)
             BlockSize = 512;
         }
         RWCommand = 25;
+        ReadAheadLen = 0;
         Host->SendResponse(CSR, true);
         RWAddress += WriteBlock(RWAddress);
         SetState(0x04);
@@ -1041,11 +1051,42 @@ void DSi_MMCStorage::ContinueTransfer()
     RWAddress += len;
 }
 
+void DSi_MMCStorage::FillReadAhead(u64 addr)
+{
+    // fetch as many of the sectors the host is going to ask for as we can
+    // in one go, instead of doing one file access per block
+    u32 num = Host->GetRemainingBlocks();
+    if (num > kReadAheadSectors) num = kReadAheadSectors;
+
+    u32 res = 0;
+    if (SD)
+    {
+        res = SD->ReadSectors((u32)(addr >> 9), num, ReadAheadBuf);
+    }
+    else if (File)
+    {
+        fseek(File, addr, SEEK_SET);
+        res = fread(ReadAheadBuf, 0x200, num, File);
+    }
+
+    ReadAheadAddr = addr;
+    ReadAheadLen = res * 0x200;
+}
+
 u32 DSi_MMCStorage::ReadBlock(u64 addr)
 {
     u32 len = BlockSize;
     len = Host->GetTransferrableLen(len);
 
+    if (RWCommand == 18 && len == 0x200 && !(addr & 0x1FF))
+    {
+        if (addr < ReadAheadAddr || addr >= (ReadAheadAddr + ReadAheadLen))
+            FillReadAhead(addr);
+
+        if (ReadAheadLen)
+            return Host->DataRX(&ReadAheadBuf[addr - ReadAheadAddr], len);
+    }
+
     u8 data[0x200];
     if (SD)
     {
@@ -44,6 +44,7 @@ public:
     u32 DataRX(u8* data, u32 len);
     u32 DataTX(u8* data, u32 len);
     u32 GetTransferrableLen(u32 len);
+    u32 GetRemainingBlocks() { return BlockCountInternal ? BlockCountInternal : 1; }
 
     void CheckRX();
     void CheckTX();
@@ -158,8 +159,15 @@ private:
     u64 RWAddress;
     u32 RWCommand;
 
+    // sectors fetched ahead of the host during multi-block reads
+    static constexpr u32 kReadAheadSectors = 64;
+    u8 ReadAheadBuf[kReadAheadSectors * 0x200];
+    u64 ReadAheadAddr;
+    u32 ReadAheadLen;
+
     void SetState(u32 state) { CSR &= ~(0xF << 9); CSR |= (state << 9); }
 
+    void FillReadAhead(u64 addr);
     u32 ReadBlock(u64 addr);
     u32 WriteBlock(u64 addr);
 };
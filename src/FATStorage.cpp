@@ -19,8 +19,15 @@
 #include <string.h>
 #include <dirent.h>
 #include <inttypes.h>
+#include <set>
 #include <vector>
 
+#if !defined(_WIN32) && !defined(__SWITCH__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "FATStorage.h"
 #include "Platform.h"
 
@@ -42,7 +49,10 @@ FATStorage::FATStorage(std::string filename, u64 size, bool readonly, std::strin
     ReadOnly = readonly;
     Load(filename, size, sourcedir);
 
+    VolumeDirty = false;
     File = nullptr;
+    FileMap = nullptr;
+    FileMapSize = 0;
 }
 
 FATStorage::~FATStorage()
@@ -59,24 +69,86 @@ bool FATStorage::Open()
         return false;
     }
 
+    MapFile();
     return true;
 }
 
 void FATStorage::Close()
 {
+    UnmapFile();
+
     if (File) fclose(File);
     File = nullptr;
 }
 
 
+bool FATStorage::MapFile()
+{
+#if !defined(_WIN32) && !defined(__SWITCH__)
+    // touching mapped pages past the end of the file would fault
+    // formatting doesn't necessarily write up to the end of the image, so
+    // extend it (reads from the missing part return zeroes either way)
+    // if we can't, stick to the file functions
+    if (FileSize == 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fileno(File), &st) != 0)
+        return false;
+    if ((u64)st.st_size < FileSize)
+    {
+        if (ReadOnly) return false;
+
+        fflush(File);
+        if (ftruncate(fileno(File), FileSize) != 0)
+            return false;
+    }
+
+    int prot = ReadOnly ? PROT_READ : (PROT_READ | PROT_WRITE);
+    void* map = mmap(nullptr, FileSize, prot, MAP_SHARED, fileno(File), 0);
+    if (map == MAP_FAILED)
+    {
+        printf("FATStorage: failed to map %s, using file access\n", FilePath.c_str());
+        return false;
+    }
+
+    FileMap = (u8*)map;
+    FileMapSize = FileSize;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void FATStorage::UnmapFile()
+{
+#if !defined(_WIN32) && !defined(__SWITCH__)
+    if (FileMap)
+    {
+        if (!ReadOnly) msync(FileMap, FileMapSize, MS_SYNC);
+        munmap(FileMap, FileMapSize);
+    }
+#endif
+
+    FileMap = nullptr;
+    FileMapSize = 0;
+}
+
+
 bool FATStorage::InjectFile(std::string path, u8* data, u32 len)
 {
     if (!File) return false;
     if (FF_File) return false;
 
+    // this goes through the file functions even if the image is mapped
+    // (the mapping may be read-only), so make sure the stream doesn't hold
+    // stale data from before the mapped writes
+    fflush(File);
+    VolumeDirty = true;
+
     FF_File = File;
     FF_FileSize = FileSize;
-    ff_disk_open(FF_ReadStorage, FF_WriteStorage, (LBA_t)(FileSize>>9));
+    ff_disk_open(FF_ReadStorage, FF_WriteStorage, nullptr, (LBA_t)(FileSize>>9));
 
     FRESULT res;
     FATFS fs;
@@ -106,6 +178,7 @@ bool FATStorage::InjectFile(std::string path, u8* data, u32 len)
 
     f_unmount("0:");
     ff_disk_close();
+    fflush(File);
     FF_File = nullptr;
     return nwrite==len;
 }
@@ -113,12 +186,15 @@ bool FATStorage::InjectFile(std::string path, u8* data, u32 len)
 
 u32 FATStorage::ReadSectors(u32 start, u32 num, u8* data)
 {
+    if (FileMap) return ReadSectorsMapped(FileMap, FileMapSize, start, num, data);
     return ReadSectorsInternal(File, FileSize, start, num, data);
 }
 
 u32 FATStorage::WriteSectors(u32 start, u32 num, u8* data)
 {
     if (ReadOnly) return 0;
+    VolumeDirty = true;
+    if (FileMap) return WriteSectorsMapped(FileMap, FileMapSize, start, num, data);
     return WriteSectorsInternal(File, FileSize, start, num, data);
 }
 
@@ -186,11 +262,36 @@ u32 FATStorage::WriteSectorsInternal(FILE* file, u64 filelen, u32 start, u32 num
     return res;
 }
 
+u32 FATStorage::ReadSectorsMapped(u8* map, u64 maplen, u32 start, u32 num, u8* data)
+{
+    u64 addr = start * 0x200ULL;
+    if (addr >= maplen) return 0;
+
+    if ((addr + num * 0x200ULL) > maplen)
+        num = (maplen - addr) >> 9;
+
+    memcpy(data, &map[addr], num * 0x200);
+    return num;
+}
+
+u32 FATStorage::WriteSectorsMapped(u8* map, u64 maplen, u32 start, u32 num, u8* data)
+{
+    u64 addr = start * 0x200ULL;
+    if (addr >= maplen) return 0;
+
+    if ((addr + num * 0x200ULL) > maplen)
+        num = (maplen - addr) >> 9;
+
+    memcpy(&map[addr], data, num * 0x200);
+    return num;
+}
+
 
 void FATStorage::LoadIndex()
 {
     DirIndex.clear();
     FileIndex.clear();
+    ImageLastModified = 0;
 
     FILE* f = Platform::OpenLocalFile(IndexPath.c_str(), "r");
     if (!f) return;
@@ -209,6 +310,14 @@ void FATStorage::LoadIndex()
 
             FileSize = fsize;
         }
+        else if (linebuf[0] == 'I')
+        {
+            s64 lastmodified;
+            int ret = sscanf(linebuf, "IMAGE %" PRId64, &lastmodified);
+            if (ret < 1) continue;
+
+            ImageLastModified = lastmodified;
+        }
         else if (linebuf[0] == 'D')
         {
             u32 readonly;
@@ -322,12 +431,22 @@ void FATStorage::LoadIndex()
     }
 }
 
+s64 FATStorage::GetImageLastModified()
+{
+    std::error_code err;
+    fs::file_time_type modtime = fs::last_write_time(fs::u8path(FilePath), err);
+    if (err) return 0;
+
+    return modtime.time_since_epoch().count();
+}
+
 void FATStorage::SaveIndex()
 {
     FILE* f = Platform::OpenLocalFile(IndexPath.c_str(), "w");
     if (!f) return;
 
     fprintf(f, "SIZE %" PRIu64 "\r\n", FileSize);
+    fprintf(f, "IMAGE %" PRId64 "\r\n", ImageLastModified);
 
     for (const auto& [key, val] : DirIndex)
     {
@@ -825,12 +944,16 @@ bool FATStorage::ImportFile(std::string path, fs::path in)
     return true;
 }
 
-bool FATStorage::ImportDirectory(std::string sourcedir)
+bool FATStorage::ImportDirectory(std::string sourcedir, bool incremental)
 {
-    // remove whatever isn't in the index
-    CleanupDirectory(sourcedir, "", 0);
+    // if the volume is known to match the index (incremental mode), only the
+    // differences between the index and the host directory need to be applied
+    // otherwise, start by removing whatever isn't in the index
+    if (!incremental)
+        CleanupDirectory(sourcedir, "", 0);
 
     int srclen = sourcedir.length();
+    std::set<std::string> hostdirs, hostfiles;
 
     // iterate through the host directory:
     // * directories will be added if they aren't in the index
@@ -850,25 +973,35 @@ bool FATStorage::ImportDirectory(std::string sourcedir)
         }
 
         bool readonly = (entry.status().permissions() & fs::perms::owner_write) == fs::perms::none;
+        bool changed = !incremental;
 
         if (entry.is_directory())
         {
+            hostdirs.insert(innerpath);
+
             if (DirIndex.count(innerpath) < 1)
             {
                 DirIndexEntry ientry;
                 ientry.Path = innerpath;
                 ientry.IsReadOnly = readonly;
 
-                innerpath = "0:/" + innerpath;
-                FRESULT res = f_mkdir(innerpath.c_str());
+                FRESULT res = f_mkdir(("0:/" + innerpath).c_str());
                 if (res == FR_OK)
                 {
                     DirIndex[ientry.Path] = ientry;
                 }
+                changed = true;
+            }
+            else if (DirIndex[innerpath].IsReadOnly != readonly)
+            {
+                DirIndex[innerpath].IsReadOnly = readonly;
+                changed = true;
             }
         }
         else if (entry.is_regular_file())
         {
+            hostfiles.insert(innerpath);
+
             u64 filesize = entry.file_size();
 
             auto lastmodified = entry.last_write_time();
@@ -884,6 +1017,12 @@ bool FATStorage::ImportDirectory(std::string sourcedir)
                 FileIndexEntry& chk = FileIndex[innerpath];
                 if (chk.Size != filesize) import = true;
                 if (chk.LastModified != lastmodified_raw) import = true;
+
+                if (chk.IsReadOnly != readonly)
+                {
+                    chk.IsReadOnly = readonly;
+                    changed = true;
+                }
             }
 
             if (import)
@@ -894,20 +1033,73 @@ bool FATStorage::ImportDirectory(std::string sourcedir)
                 ientry.Size = filesize;
                 ientry.LastModified = lastmodified_raw;
 
-                innerpath = "0:/" + innerpath;
-                if (ImportFile(innerpath, entry.path()))
+                std::string volpath = "0:/" + innerpath;
+                if (incremental)
+                {
+                    // the file may have been marked read-only in the volume
+                    f_chmod(volpath.c_str(), 0, AM_RDO);
+                }
+                if (ImportFile(volpath, entry.path()))
                 {
                     FF_FILINFO finfo;
-                    f_stat(innerpath.c_str(), &finfo);
+                    f_stat(volpath.c_str(), &finfo);
 
                     ientry.LastModifiedInternal = (finfo.fdate << 16) | finfo.ftime;
 
                     FileIndex[ientry.Path] = ientry;
                 }
+                changed = true;
             }
         }
 
-        f_chmod(innerpath.c_str(), readonly?AM_RDO:0, AM_RDO);
+        if (changed)
+            f_chmod(("0:/" + innerpath).c_str(), readonly?AM_RDO:0, AM_RDO);
+    }
+
+    if (incremental)
+    {
+        // remove whatever disappeared from the host directory since the last sync
+        std::vector<std::string> deletelist;
+
+        for (const auto& [key, val] : FileIndex)
+        {
+            if (hostfiles.count(key) < 1)
+                deletelist.push_back(key);
+        }
+
+        for (const auto& key : deletelist)
+        {
+            std::string fullpath = "0:/" + key;
+            f_chmod(fullpath.c_str(), 0, AM_RDO);
+            f_unlink(fullpath.c_str());
+
+            FileIndex.erase(key);
+        }
+
+        deletelist.clear();
+
+        for (const auto& [key, val] : DirIndex)
+        {
+            if (hostdirs.count(key) < 1)
+                deletelist.push_back(key);
+        }
+
+        // the index is sorted, so parent directories come before their children
+        // deleting a parent takes care of its contents
+        for (const auto& key : deletelist)
+        {
+            if (DirIndex.count(key) < 1) continue;
+
+            DeleteDirectory(key+"/", 0);
+
+            std::string prefix = key + "/";
+            for (auto it = FileIndex.lower_bound(prefix); it != FileIndex.end() && it->first.compare(0, prefix.length(), prefix) == 0; )
+                it = FileIndex.erase(it);
+            for (auto it = DirIndex.lower_bound(prefix); it != DirIndex.end() && it->first.compare(0, prefix.length(), prefix) == 0; )
+                it = DirIndex.erase(it);
+
+            DirIndex.erase(key);
+        }
     }
 
     SaveIndex();
@@ -961,6 +1153,7 @@ bool FATStorage::Load(std::string filename, u64 size, std::string sourcedir)
     //   with a minimum 128MB extra, otherwise size is defaulted to 512MB
 
     bool isnew = false;
+    ImageLastModified = 0;
     FF_File = Platform::OpenLocalFile(filename.c_str(), "r+b");
     if (!FF_File)
     {
@@ -989,6 +1182,10 @@ bool FATStorage::Load(std::string filename, u64 size, std::string sourcedir)
         }
     }
 
+    // if the image hasn't been modified since the last sync, its contents
+    // match the index, and only host-side changes need to be imported
+    bool incremental = (ImageLastModified != 0) && (ImageLastModified == GetImageLastModified());
+
     bool needformat = false;
     FATFS fs;
     FRESULT res;
@@ -1000,7 +1197,7 @@ bool FATStorage::Load(std::string filename, u64 size, std::string sourcedir)
     else
     {
         FF_FileSize = FileSize;
-        ff_disk_open(FF_ReadStorage, FF_WriteStorage, (LBA_t)(FF_FileSize>>9));
+        ff_disk_open(FF_ReadStorage, FF_WriteStorage, nullptr, (LBA_t)(FF_FileSize>>9));
 
         res = f_mount(&fs, "0:", 1);
         if (res != FR_OK)
@@ -1038,10 +1235,11 @@ bool FATStorage::Load(std::string filename, u64 size, std::string sourcedir)
 
         FF_FileSize = FileSize;
         ff_disk_close();
-        ff_disk_open(FF_ReadStorage, FF_WriteStorage, (LBA_t)(FF_FileSize>>9));
+        ff_disk_open(FF_ReadStorage, FF_WriteStorage, nullptr, (LBA_t)(FF_FileSize>>9));
 
         DirIndex.clear();
         FileIndex.clear();
+        ImageLastModified = 0;
         SaveIndex();
 
         FF_MKFS_PARM fsopt;
@@ -1069,7 +1267,7 @@ bool FATStorage::Load(std::string filename, u64 size, std::string sourcedir)
     if (res == FR_OK)
     {
         if (hasdir)
-            ImportDirectory(sourcedir);
+            ImportDirectory(sourcedir, incremental && !needformat);
     }
 
     f_unmount("0:");
@@ -1078,6 +1276,12 @@ bool FATStorage::Load(std::string filename, u64 size, std::string sourcedir)
     fclose(FF_File);
     FF_File = nullptr;
 
+    if (hasdir)
+    {
+        ImageLastModified = GetImageLastModified();
+        SaveIndex();
+    }
+
     return true;
 }
 
@@ -1088,6 +1292,12 @@ bool FATStorage::Save()
         return true;
     }
 
+    // nothing to export if the volume is still as it was after the last sync
+    if ((!VolumeDirty) && (ImageLastModified != 0) && (ImageLastModified == GetImageLastModified()))
+    {
+        return true;
+    }
+
     FF_File = Platform::OpenLocalFile(FilePath.c_str(), "r+b");
     if (!FF_File)
     {
@@ -1095,7 +1305,7 @@ bool FATStorage::Save()
     }
 
     FF_FileSize = FileSize;
-    ff_disk_open(FF_ReadStorage, FF_WriteStorage, (LBA_t)(FileSize>>9));
+    ff_disk_open(FF_ReadStorage, FF_WriteStorage, nullptr, (LBA_t)(FileSize>>9));
 
     FRESULT res;
     FATFS fs;
@@ -1111,13 +1321,15 @@ bool FATStorage::Save()
 
     ExportChanges(SourceDir);
 
-    SaveIndex();
-
     f_unmount("0:");
 
     ff_disk_close();
     fclose(FF_File);
     FF_File = nullptr;
 
+    ImageLastModified = GetImageLastModified();
+    VolumeDirty = false;
+    SaveIndex();
+
     return true;
 }
@@ -48,9 +48,24 @@ private:
     std::string SourceDir;
     bool ReadOnly;
 
+    // state for incremental syncing with the source directory:
+    // last-modified time of the image as of the last sync, and whether
+    // the volume has been written to since
+    s64 ImageLastModified;
+    bool VolumeDirty;
+    s64 GetImageLastModified();
+
     FILE* File;
     u64 FileSize;
 
+    // the image gets mapped into memory when the platform allows it
+    // sector accesses then become plain copies instead of fseek/fread/fwrite
+    u8* FileMap;
+    u64 FileMapSize;
+
+    bool MapFile();
+    void UnmapFile();
+
     static FILE* FF_File;
     static u64 FF_FileSize;
     static UINT FF_ReadStorage(BYTE* buf, LBA_t sector, UINT num);
@@ -58,6 +73,8 @@ private:
 
     static u32 ReadSectorsInternal(FILE* file, u64 filelen, u32 start, u32 num, u8* data);
     static u32 WriteSectorsInternal(FILE* file, u64 filelen, u32 start, u32 num, u8* data);
+    static u32 ReadSectorsMapped(u8* map, u64 maplen, u32 start, u32 num, u8* data);
+    static u32 WriteSectorsMapped(u8* map, u64 maplen, u32 start, u32 num, u8* data);
 
     void LoadIndex();
     void SaveIndex();
@@ -71,7 +88,7 @@ private:
     bool DeleteDirectory(std::string path, int level);
     void CleanupDirectory(std::string sourcedir, std::string path, int level);
     bool ImportFile(std::string path, std::filesystem::path in);
-    bool ImportDirectory(std::string sourcedir);
+    bool ImportDirectory(std::string sourcedir, bool incremental);
     u64 GetDirectorySize(std::filesystem::path sourcedir);
 
     bool Load(std::string filename, u64 size, std::string sourcedir);
@@ -19,9 +19,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <algorithm>
+#include <atomic>
 #include "NDS.h"
 #include "GPU.h"
 #include "FIFO.h"
+#include "GPU3D_Geometry.h"
 
 
 // 3D engine notes
@@ -190,6 +192,7 @@ u32 ExecParams[32];
 u32 ExecParamCount;
 
 u64 Timestamp;
+GeometryStats Stats;
 s32 CycleCount;
 s32 VertexPipeline;
 s32 NormalPipeline;
@@ -258,15 +261,48 @@ u32 NumConsecutivePolygons;
 Polygon* LastStripPolygon;
 u32 NumOpaquePolygons;
 
-Vertex VertexRAM[6144 * 2];
-Polygon PolygonRAM[2048 * 2];
+// vertex/polygon RAM is triple-buffered: the geometry engine can fill one bank
+// while the renderer is still working on another one, and a third one holds
+// the last frame handed to the renderer
+Vertex VertexRAM[6144 * 3];
+Polygon PolygonRAM[2048 * 3];
+std::array<Polygon*,2048> SortedPolygonRAM[3];
 
 Vertex* CurVertexRAM;
 Polygon* CurPolygonRAM;
 u32 NumVertices, NumPolygons;
 u32 CurRAMBank;
 
-std::array<Polygon*,2048> RenderPolygonRAM;
+// everything the renderer needs for one frame, latched at VBlank
+struct RenderFrameState
+{
+    u32 Generation;
+
+    u32 Bank;
+    u32 NumPolygons;
+    bool FrameIdentical;
+
+    u32 DispCnt;
+    u8 AlphaRef;
+    u16 ToonTable[32];
+    u16 EdgeTable[8];
+    u32 FogColor, FogOffset, FogShift;
+    u8 FogDensityTable[34];
+    u32 ClearAttr1, ClearAttr2;
+};
+
+// lock-free triple buffer between VBlank (emulation thread) and the renderer
+// the three indices always form a permutation of 0..2
+// bit 2 of RenderFrameReady is set when it holds a frame the renderer hasn't picked up
+RenderFrameState RenderFrames[3];
+u32 RenderFrameWrite;               // emulation thread only
+std::atomic_uint32_t RenderFrameReady;
+u32 RenderFrameRead;                // renderer only
+u32 RenderFramePublished;           // emulation thread only
+u32 RenderFrameGeneration;
+u32 RenderedGeneration;
+
+Polygon** RenderPolygonRAM;
 u32 RenderNumPolygons;
 
 u32 FlushRequest;
@@ -278,6 +314,8 @@ bool AbortFrame;
 
 bool Init()
 {
+    Geometry::Init();
+
     return true;
 }
 
@@ -285,8 +323,33 @@ void DeInit()
 {
 }
 
+void ResetRenderFrames()
+{
+    // there is nothing to render yet, so all the frames can point to any bank
+    // as long as it isn't the one the geometry engine is filling
+    u32 bank = (CurRAMBank + 1) % 3;
+
+    memset(RenderFrames, 0, sizeof(RenderFrames));
+    for (int i = 0; i < 3; i++)
+    {
+        RenderFrames[i].Bank = bank;
+        RenderFrames[i].ClearAttr1 = 0x3F000000;
+        RenderFrames[i].ClearAttr2 = 0x00007FFF;
+    }
+
+    RenderFrameWrite = 0;
+    RenderFrameReady = 1;
+    RenderFrameRead = 2;
+    RenderFramePublished = 1;
+    RenderFrameGeneration = 0;
+    RenderedGeneration = 0xFFFFFFFF; // so the first frame is never considered identical
+}
+
 void ResetRenderingState()
 {
+    ResetRenderFrames();
+
+    RenderPolygonRAM = SortedPolygonRAM[0].data();
     RenderNumPolygons = 0;
 
     RenderDispCnt = 0;
@@ -330,6 +393,7 @@ void Reset()
     ExecParamCount = 0;
 
     Timestamp = 0;
+    memset(&Stats, 0, sizeof(Stats));
     CycleCount = 0;
     VertexPipeline = 0;
     NormalPipeline = 0;
@@ -501,7 +565,7 @@ void DoSavestate(Savestate* file)
     file->Var32(&FlushRequest);
     file->Var32(&FlushAttributes);
 
-    for (int i = 0; i < 6144*2; i++)
+    for (int i = 0; i < 6144*3; i++)
     {
         Vertex* vtx = &VertexRAM[i];
 
@@ -515,7 +579,7 @@ void DoSavestate(Savestate* file)
         file->VarArray(vtx->FinalColor, sizeof(s32)*3);
     }
 
-    for(int i = 0; i < 2048*2; i++)
+    for (int i = 0; i < 2048*3; i++)
     {
         Polygon* poly = &PolygonRAM[i];
 
@@ -601,11 +665,12 @@ void DoSavestate(Savestate* file)
         ClipMatrixDirty = true;
         UpdateClipMatrix();
 
-        CurVertexRAM = &VertexRAM[CurRAMBank ? 6144 : 0];
-        CurPolygonRAM = &PolygonRAM[CurRAMBank ? 2048 : 0];
+        CurVertexRAM = &VertexRAM[CurRAMBank * 6144];
+        CurPolygonRAM = &PolygonRAM[CurRAMBank * 2048];
 
         // better safe than sorry, I guess
         // might cause a blank frame but atleast it won't shit itself
+        ResetRenderFrames();
         RenderNumPolygons = 0;
     }
 
@@ -663,78 +728,37 @@ void MatrixLoad4x3(s32* m, s32* s)
 
 void MatrixMult4x4(s32* m, s32* s)
 {
-    s32 tmp[16];
-    memcpy(tmp, m, 16*4);
-
     // m = s*m
-    m[0] = ((s64)s[0]*tmp[0] + (s64)s[1]*tmp[4] + (s64)s[2]*tmp[8] + (s64)s[3]*tmp[12]) >> 12;
-    m[1] = ((s64)s[0]*tmp[1] + (s64)s[1]*tmp[5] + (s64)s[2]*tmp[9] + (s64)s[3]*tmp[13]) >> 12;
-    m[2] = ((s64)s[0]*tmp[2] + (s64)s[1]*tmp[6] + (s64)s[2]*tmp[10] + (s64)s[3]*tmp[14]) >> 12;
-    m[3] = ((s64)s[0]*tmp[3] + (s64)s[1]*tmp[7] + (s64)s[2]*tmp[11] + (s64)s[3]*tmp[15]) >> 12;
-
-    m[4] = ((s64)s[4]*tmp[0] + (s64)s[5]*tmp[4] + (s64)s[6]*tmp[8] + (s64)s[7]*tmp[12]) >> 12;
-    m[5] = ((s64)s[4]*tmp[1] + (s64)s[5]*tmp[5] + (s64)s[6]*tmp[9] + (s64)s[7]*tmp[13]) >> 12;
-    m[6] = ((s64)s[4]*tmp[2] + (s64)s[5]*tmp[6] + (s64)s[6]*tmp[10] + (s64)s[7]*tmp[14]) >> 12;
-    m[7] = ((s64)s[4]*tmp[3] + (s64)s[5]*tmp[7] + (s64)s[6]*tmp[11] + (s64)s[7]*tmp[15]) >> 12;
-
-    m[8] = ((s64)s[8]*tmp[0] + (s64)s[9]*tmp[4] + (s64)s[10]*tmp[8] + (s64)s[11]*tmp[12]) >> 12;
-    m[9] = ((s64)s[8]*tmp[1] + (s64)s[9]*tmp[5] + (s64)s[10]*tmp[9] + (s64)s[11]*tmp[13]) >> 12;
-    m[10] = ((s64)s[8]*tmp[2] + (s64)s[9]*tmp[6] + (s64)s[10]*tmp[10] + (s64)s[11]*tmp[14]) >> 12;
-    m[11] = ((s64)s[8]*tmp[3] + (s64)s[9]*tmp[7] + (s64)s[10]*tmp[11] + (s64)s[11]*tmp[15]) >> 12;
-
-    m[12] = ((s64)s[12]*tmp[0] + (s64)s[13]*tmp[4] + (s64)s[14]*tmp[8] + (s64)s[15]*tmp[12]) >> 12;
-    m[13] = ((s64)s[12]*tmp[1] + (s64)s[13]*tmp[5] + (s64)s[14]*tmp[9] + (s64)s[15]*tmp[13]) >> 12;
-    m[14] = ((s64)s[12]*tmp[2] + (s64)s[13]*tmp[6] + (s64)s[14]*tmp[10] + (s64)s[15]*tmp[14]) >> 12;
-    m[15] = ((s64)s[12]*tmp[3] + (s64)s[13]*tmp[7] + (s64)s[14]*tmp[11] + (s64)s[15]*tmp[15]) >> 12;
+    Geometry::MatrixMult(m, s, 4);
 }
 
 void MatrixMult4x3(s32* m, s32* s)
 {
-    s32 tmp[16];
-    memcpy(tmp, m, 16*4);
+    // padding with zeroes gives the same result as a proper 4x3 multiply
+    s32 tmp[16] =
+    {
+        s[0], s[1],  s[2],  0,
+        s[3], s[4],  s[5],  0,
+        s[6], s[7],  s[8],  0,
+        s[9], s[10], s[11], 0x1000
+    };
 
     // m = s*m
-    m[0] = ((s64)s[0]*tmp[0] + (s64)s[1]*tmp[4] + (s64)s[2]*tmp[8]) >> 12;
-    m[1] = ((s64)s[0]*tmp[1] + (s64)s[1]*tmp[5] + (s64)s[2]*tmp[9]) >> 12;
-    m[2] = ((s64)s[0]*tmp[2] + (s64)s[1]*tmp[6] + (s64)s[2]*tmp[10]) >> 12;
-    m[3] = ((s64)s[0]*tmp[3] + (s64)s[1]*tmp[7] + (s64)s[2]*tmp[11]) >> 12;
-
-    m[4] = ((s64)s[3]*tmp[0] + (s64)s[4]*tmp[4] + (s64)s[5]*tmp[8]) >> 12;
-    m[5] = ((s64)s[3]*tmp[1] + (s64)s[4]*tmp[5] + (s64)s[5]*tmp[9]) >> 12;
-    m[6] = ((s64)s[3]*tmp[2] + (s64)s[4]*tmp[6] + (s64)s[5]*tmp[10]) >> 12;
-    m[7] = ((s64)s[3]*tmp[3] + (s64)s[4]*tmp[7] + (s64)s[5]*tmp[11]) >> 12;
-
-    m[8] = ((s64)s[6]*tmp[0] + (s64)s[7]*tmp[4] + (s64)s[8]*tmp[8]) >> 12;
-    m[9] = ((s64)s[6]*tmp[1] + (s64)s[7]*tmp[5] + (s64)s[8]*tmp[9]) >> 12;
-    m[10] = ((s64)s[6]*tmp[2] + (s64)s[7]*tmp[6] + (s64)s[8]*tmp[10]) >> 12;
-    m[11] = ((s64)s[6]*tmp[3] + (s64)s[7]*tmp[7] + (s64)s[8]*tmp[11]) >> 12;
-
-    m[12] = ((s64)s[9]*tmp[0] + (s64)s[10]*tmp[4] + (s64)s[11]*tmp[8] + (s64)0x1000*tmp[12]) >> 12;
-    m[13] = ((s64)s[9]*tmp[1] + (s64)s[10]*tmp[5] + (s64)s[11]*tmp[9] + (s64)0x1000*tmp[13]) >> 12;
-    m[14] = ((s64)s[9]*tmp[2] + (s64)s[10]*tmp[6] + (s64)s[11]*tmp[10] + (s64)0x1000*tmp[14]) >> 12;
-    m[15] = ((s64)s[9]*tmp[3] + (s64)s[10]*tmp[7] + (s64)s[11]*tmp[11] + (s64)0x1000*tmp[15]) >> 12;
+    Geometry::MatrixMult(m, tmp, 4);
 }
 
 void MatrixMult3x3(s32* m, s32* s)
 {
-    s32 tmp[12];
-    memcpy(tmp, m, 12*4);
+    s32 tmp[16] =
+    {
+        s[0], s[1], s[2], 0,
+        s[3], s[4], s[5], 0,
+        s[6], s[7], s[8], 0,
+        0,    0,    0,    0
+    };
 
     // m = s*m
-    m[0] = ((s64)s[0]*tmp[0] + (s64)s[1]*tmp[4] + (s64)s[2]*tmp[8]) >> 12;
-    m[1] = ((s64)s[0]*tmp[1] + (s64)s[1]*tmp[5] + (s64)s[2]*tmp[9]) >> 12;
-    m[2] = ((s64)s[0]*tmp[2] + (s64)s[1]*tmp[6] + (s64)s[2]*tmp[10]) >> 12;
-    m[3] = ((s64)s[0]*tmp[3] + (s64)s[1]*tmp[7] + (s64)s[2]*tmp[11]) >> 12;
-
-    m[4] = ((s64)s[3]*tmp[0] + (s64)s[4]*tmp[4] + (s64)s[5]*tmp[8]) >> 12;
-    m[5] = ((s64)s[3]*tmp[1] + (s64)s[4]*tmp[5] + (s64)s[5]*tmp[9]) >> 12;
-    m[6] = ((s64)s[3]*tmp[2] + (s64)s[4]*tmp[6] + (s64)s[5]*tmp[10]) >> 12;
-    m[7] = ((s64)s[3]*tmp[3] + (s64)s[4]*tmp[7] + (s64)s[5]*tmp[11]) >> 12;
-
-    m[8] = ((s64)s[6]*tmp[0] + (s64)s[7]*tmp[4] + (s64)s[8]*tmp[8]) >> 12;
-    m[9] = ((s64)s[6]*tmp[1] + (s64)s[7]*tmp[5] + (s64)s[8]*tmp[9]) >> 12;
-    m[10] = ((s64)s[6]*tmp[2] + (s64)s[7]*tmp[6] + (s64)s[8]*tmp[10]) >> 12;
-    m[11] = ((s64)s[6]*tmp[3] + (s64)s[7]*tmp[7] + (s64)s[8]*tmp[11]) >> 12;
+    Geometry::MatrixMult(m, tmp, 3);
 }
 
 void MatrixScale(s32* m, s32* s)
@@ -1008,6 +1032,25 @@ int ClipPolygon(Vertex* vertices, int nverts, int clipstart)
     return nverts;
 }
 
+bool ClipTrivialAccept(Vertex* vertices, int nverts)
+{
+    // checks whether all the vertices are within the view volume
+    // in which case ClipPolygon() would leave the polygon untouched
+    // (the color fixup it does is a no-op for vertices that weren't clipped)
+
+    for (int i = 0; i < nverts; i++)
+    {
+        s32* pos = vertices[i].Position;
+        s32 w = pos[3];
+
+        if (pos[0] > w || pos[0] < -w) return false;
+        if (pos[1] > w || pos[1] < -w) return false;
+        if (pos[2] > w || pos[2] < -w) return false;
+    }
+
+    return true;
+}
+
 bool ClipCoordsEqual(Vertex* a, Vertex* b)
 {
     return a->Position[0] == b->Position[0] &&
@@ -1149,11 +1192,21 @@ void SubmitPolygon()
 
     // clipping
 
-    nverts = ClipPolygon<true>(clippedvertices, nverts, clipstart);
-    if (nverts == 0)
+    if (ClipTrivialAccept(clippedvertices, nverts))
     {
-        LastStripPolygon = NULL;
-        return;
+        Stats.NumClipAccepted++;
+    }
+    else
+    {
+        nverts = ClipPolygon<true>(clippedvertices, nverts, clipstart);
+        if (nverts == 0)
+        {
+            Stats.NumClipRejected++;
+            LastStripPolygon = NULL;
+            return;
+        }
+
+        Stats.NumClipped++;
     }
 
     // reject the polygon if it's not going to fit in polygon/vertex RAM
@@ -1423,14 +1476,11 @@ void SubmitPolygon()
 
 void SubmitVertex()
 {
-    s64 vertex[4] = {(s64)CurVertex[0], (s64)CurVertex[1], (s64)CurVertex[2], 0x1000};
+    s32 vertex[4] = {CurVertex[0], CurVertex[1], CurVertex[2], 0x1000};
     Vertex* vertextrans = &TempVertexBuffer[VertexNumInPoly];
 
     UpdateClipMatrix();
-    vertextrans->Position[0] = (vertex[0]*ClipMatrix[0] + vertex[1]*ClipMatrix[4] + vertex[2]*ClipMatrix[8] + vertex[3]*ClipMatrix[12]) >> 12;
-    vertextrans->Position[1] = (vertex[0]*ClipMatrix[1] + vertex[1]*ClipMatrix[5] + vertex[2]*ClipMatrix[9] + vertex[3]*ClipMatrix[13]) >> 12;
-    vertextrans->Position[2] = (vertex[0]*ClipMatrix[2] + vertex[1]*ClipMatrix[6] + vertex[2]*ClipMatrix[10] + vertex[3]*ClipMatrix[14]) >> 12;
-    vertextrans->Position[3] = (vertex[0]*ClipMatrix[3] + vertex[1]*ClipMatrix[7] + vertex[2]*ClipMatrix[11] + vertex[3]*ClipMatrix[15]) >> 12;
+    Geometry::VecMult4x4(vertextrans->Position, vertex, ClipMatrix);
 
     // this probably shouldn't be.
     // the way color is handled during clipping needs investigation. TODO
@@ -1440,8 +1490,8 @@ void SubmitVertex()
 
     if ((TexParam >> 30) == 3)
     {
-        vertextrans->TexCoords[0] = ((vertex[0]*TexMatrix[0] + vertex[1]*TexMatrix[4] + vertex[2]*TexMatrix[8]) >> 24) + RawTexCoords[0];
-        vertextrans->TexCoords[1] = ((vertex[0]*TexMatrix[1] + vertex[1]*TexMatrix[5] + vertex[2]*TexMatrix[9]) >> 24) + RawTexCoords[1];
+        vertextrans->TexCoords[0] = (((s64)vertex[0]*TexMatrix[0] + (s64)vertex[1]*TexMatrix[4] + (s64)vertex[2]*TexMatrix[8]) >> 24) + RawTexCoords[0];
+        vertextrans->TexCoords[1] = (((s64)vertex[0]*TexMatrix[1] + (s64)vertex[1]*TexMatrix[5] + (s64)vertex[2]*TexMatrix[9]) >> 24) + RawTexCoords[1];
     }
     else
     {
@@ -1527,10 +1577,12 @@ void CalculateLighting()
         TexCoords[1] = RawTexCoords[1] + (((s64)Normal[0]*TexMatrix[1] + (s64)Normal[1]*TexMatrix[5] + (s64)Normal[2]*TexMatrix[9]) >> 21);
     }
 
+    s32 normal[3] = {Normal[0], Normal[1], Normal[2]};
     s32 normaltrans[3];
-    normaltrans[0] = (Normal[0]*VecMatrix[0] + Normal[1]*VecMatrix[4] + Normal[2]*VecMatrix[8]) >> 12;
-    normaltrans[1] = (Normal[0]*VecMatrix[1] + Normal[1]*VecMatrix[5] + Normal[2]*VecMatrix[9]) >> 12;
-    normaltrans[2] = (Normal[0]*VecMatrix[2] + Normal[1]*VecMatrix[6] + Normal[2]*VecMatrix[10]) >> 12;
+    Geometry::VecMult3x3(normaltrans, normal, VecMatrix);
+
+    s32 diffdot[4], shinedot[4];
+    Geometry::LightDots(diffdot, shinedot, LightDirection, normaltrans);
 
     VertexColor[0] = MatEmission[0];
     VertexColor[1] = MatEmission[1];
@@ -1548,15 +1600,11 @@ void CalculateLighting()
         // * shininess level mirrors back to 0 and is ANDed with 0xFF, that before being squared
         // TODO: check how it behaves when the computed shininess is >=0x200
 
-        s32 difflevel = (-(LightDirection[i][0]*normaltrans[0] +
-                         LightDirection[i][1]*normaltrans[1] +
-                         LightDirection[i][2]*normaltrans[2])) >> 10;
+        s32 difflevel = (-diffdot[i]) >> 10;
         if (difflevel < 0) difflevel = 0;
         else if (difflevel > 255) difflevel = 255;
 
-        s32 shinelevel = -(((LightDirection[i][0]>>1)*normaltrans[0] +
-                          (LightDirection[i][1]>>1)*normaltrans[1] +
-                          ((LightDirection[i][2]-0x200)>>1)*normaltrans[2]) >> 10);
+        s32 shinelevel = -(shinedot[i] >> 10);
         if (shinelevel < 0) shinelevel = 0;
         else if (shinelevel > 255) shinelevel = (0x100 - shinelevel) & 0xFF;
         shinelevel = ((shinelevel * shinelevel) >> 7) - 0x100; // really (2*shinelevel*shinelevel)-1
@@ -1626,14 +1674,9 @@ void BoxTest(u32* params)
     UpdateClipMatrix();
     for (int i = 0; i < 8; i++)
     {
-        s32 x = cube[i].Position[0];
-        s32 y = cube[i].Position[1];
-        s32 z = cube[i].Position[2];
+        s32 vertex[4] = {cube[i].Position[0], cube[i].Position[1], cube[i].Position[2], 0x1000};
 
-        cube[i].Position[0] = ((s64)x*ClipMatrix[0] + (s64)y*ClipMatrix[4] + (s64)z*ClipMatrix[8] + (s64)0x1000*ClipMatrix[12]) >> 12;
-        cube[i].Position[1] = ((s64)x*ClipMatrix[1] + (s64)y*ClipMatrix[5] + (s64)z*ClipMatrix[9] + (s64)0x1000*ClipMatrix[13]) >> 12;
-        cube[i].Position[2] = ((s64)x*ClipMatrix[2] + (s64)y*ClipMatrix[6] + (s64)z*ClipMatrix[10] + (s64)0x1000*ClipMatrix[14]) >> 12;
-        cube[i].Position[3] = ((s64)x*ClipMatrix[3] + (s64)y*ClipMatrix[7] + (s64)z*ClipMatrix[11] + (s64)0x1000*ClipMatrix[15]) >> 12;
+        Geometry::VecMult4x4(cube[i].Position, vertex, ClipMatrix);
     }
 
     // front face (-Z)
@@ -1693,13 +1736,10 @@ void BoxTest(u32* params)
 
 void PosTest()
 {
-    s64 vertex[4] = {(s64)CurVertex[0], (s64)CurVertex[1], (s64)CurVertex[2], 0x1000};
+    s32 vertex[4] = {CurVertex[0], CurVertex[1], CurVertex[2], 0x1000};
 
     UpdateClipMatrix();
-    PosTestResult[0] = (vertex[0]*ClipMatrix[0] + vertex[1]*ClipMatrix[4] + vertex[2]*ClipMatrix[8] + vertex[3]*ClipMatrix[12]) >> 12;
-    PosTestResult[1] = (vertex[0]*ClipMatrix[1] + vertex[1]*ClipMatrix[5] + vertex[2]*ClipMatrix[9] + vertex[3]*ClipMatrix[13]) >> 12;
-    PosTestResult[2] = (vertex[0]*ClipMatrix[2] + vertex[1]*ClipMatrix[6] + vertex[2]*ClipMatrix[10] + vertex[3]*ClipMatrix[14]) >> 12;
-    PosTestResult[3] = (vertex[0]*ClipMatrix[3] + vertex[1]*ClipMatrix[7] + vertex[2]*ClipMatrix[11] + vertex[3]*ClipMatrix[15]) >> 12;
+    Geometry::VecMult4x4(PosTestResult, vertex, ClipMatrix);
 
     AddCycles(5);
 }
@@ -1828,10 +1868,74 @@ inline void VertexPipelineCmdDelayed4()
     NormalPipeline = 0;
 }
 
+inline bool CmdIsBatchable(u8 cmd)
+{
+    // commands that only affect internal geometry engine state:
+    // matrix ops, vertex attributes, vertices, polygon begin/end
+    // push/pop and tests are left out since they update GXSTAT
+    if (cmd == 0x11 || cmd == 0x12) return false;
+
+    return (cmd >= 0x10 && cmd <= 0x1C) ||
+           (cmd >= 0x20 && cmd <= 0x2B) ||
+           (cmd >= 0x30 && cmd <= 0x34) ||
+           cmd == 0x40 || cmd == 0x41;
+}
+
+void ExecuteCommandEntry(CmdFIFOEntry& entry);
+
 void ExecuteCommand()
 {
     CmdFIFOEntry entry = CmdFIFORead();
+    ExecuteCommandEntry(entry);
+}
 
+void ExecuteCommandBatch()
+{
+    // run a sequence of batchable commands without going through CmdFIFORead()
+    // the PIPE is refilled the same way, but the stall queue, DMA and IRQ
+    // checks are only done once at the end of the batch
+    // nothing can write to the FIFO while we're running, so the FIFO level only
+    // goes down and checking it at the end gives the same result
+    // cycles are still accounted per command as they depend on pipeline state
+
+    u32 num = 0;
+    bool refilled = false;
+
+    while (CycleCount <= 0 && !CmdPIPE.IsEmpty())
+    {
+        CmdFIFOEntry entry = CmdPIPE.Peek();
+        if (!CmdIsBatchable(entry.Command))
+            break;
+
+        CmdPIPE.Read();
+        if (CmdPIPE.Level() <= 2)
+        {
+            if (!CmdFIFO.IsEmpty())
+                CmdPIPE.Write(CmdFIFO.Read());
+            if (!CmdFIFO.IsEmpty())
+                CmdPIPE.Write(CmdFIFO.Read());
+
+            refilled = true;
+        }
+
+        ExecuteCommandEntry(entry);
+        num++;
+    }
+
+    if (refilled)
+    {
+        CheckFIFODMA();
+        CheckFIFOIRQ();
+    }
+
+    Stats.NumBatches++;
+    Stats.NumBatchedCommands += num;
+    if (num > Stats.MaxBatchSize)
+        Stats.MaxBatchSize = num;
+}
+
+void ExecuteCommandEntry(CmdFIFOEntry& entry)
+{
     //printf("FIFO: processing %02X %08X. Levels: FIFO=%d, PIPE=%d\n", entry.Command, entry.Param, CmdFIFO->Level(), CmdPIPE->Level());
 
     // each FIFO entry takes 1 cycle to be processed
@@ -2466,7 +2570,11 @@ void Run()
             if (NumPushPopCommands == 0) GXStat &= ~(1<<14);
             if (NumTestCommands == 0)    GXStat &= ~(1<<0);
 
-            ExecuteCommand();
+            // the stall queue needs to be drained as soon as possible
+            if (CmdStallQueue.IsEmpty() && CmdIsBatchable(CmdPIPE.Peek().Command))
+                ExecuteCommandBatch();
+            else
+                ExecuteCommand();
         }
     }
 
@@ -2529,10 +2637,15 @@ void VBlank()
     {
         if (RenderingEnabled)
         {
+            RenderFrameState* frame = &RenderFrames[RenderFrameWrite];
+            RenderFrameState* prev = &RenderFrames[RenderFramePublished];
+
             if (FlushRequest)
             {
                 if (NumPolygons)
                 {
+                    std::array<Polygon*,2048>& sorted = SortedPolygonRAM[CurRAMBank];
+
                     // separate translucent polygons from opaque ones
 
                     u32 io = 0, it = NumOpaquePolygons;
@@ -2540,56 +2653,82 @@ void VBlank()
                     {
                         Polygon* poly = &CurPolygonRAM[i];
                         if (poly->Translucent)
-                            RenderPolygonRAM[it++] = poly;
+                            sorted[it++] = poly;
                         else
-                            RenderPolygonRAM[io++] = poly;
+                            sorted[io++] = poly;
                     }
 
                     // apply Y-sorting
 
-                    std::stable_sort(RenderPolygonRAM.begin(),
-                        RenderPolygonRAM.begin() + ((FlushAttributes & 0x1) ? NumOpaquePolygons : NumPolygons),
+                    std::stable_sort(sorted.begin(),
+                        sorted.begin() + ((FlushAttributes & 0x1) ? NumOpaquePolygons : NumPolygons),
                         YSort);
                 }
 
-                RenderNumPolygons = NumPolygons;
-                RenderFrameIdentical = false;
+                frame->Bank = CurRAMBank;
+                frame->NumPolygons = NumPolygons;
+                frame->FrameIdentical = false;
             }
             else
             {
-                RenderFrameIdentical = RenderDispCnt == DispCnt
-                    && RenderAlphaRef == AlphaRef
-                    && RenderClearAttr1 == ClearAttr1
-                    && RenderClearAttr2 == ClearAttr2
-                    && RenderFogColor == FogColor
-                    && RenderFogOffset == FogOffset * 0x200
-                    && memcmp(RenderEdgeTable, EdgeTable, 8*2) == 0
-                    && memcmp(RenderFogDensityTable + 1, FogDensityTable, 32) == 0
-                    && memcmp(RenderToonTable, ToonTable, 32*2) == 0;
+                frame->Bank = prev->Bank;
+                frame->NumPolygons = prev->NumPolygons;
+                frame->FrameIdentical = prev->DispCnt == DispCnt
+                    && prev->AlphaRef == AlphaRef
+                    && prev->ClearAttr1 == ClearAttr1
+                    && prev->ClearAttr2 == ClearAttr2
+                    && prev->FogColor == FogColor
+                    && prev->FogOffset == FogOffset * 0x200
+                    && memcmp(prev->EdgeTable, EdgeTable, 8*2) == 0
+                    && memcmp(prev->FogDensityTable + 1, FogDensityTable, 32) == 0
+                    && memcmp(prev->ToonTable, ToonTable, 32*2) == 0;
             }
 
-            RenderDispCnt = DispCnt;
-            RenderAlphaRef = AlphaRef;
+            frame->DispCnt = DispCnt;
+            frame->AlphaRef = AlphaRef;
+
+            memcpy(frame->EdgeTable, EdgeTable, 8*2);
+            memcpy(frame->ToonTable, ToonTable, 32*2);
 
-            memcpy(RenderEdgeTable, EdgeTable, 8*2);
-            memcpy(RenderToonTable, ToonTable, 32*2);
+            frame->FogColor = FogColor;
+            frame->FogOffset = FogOffset * 0x200;
+            frame->FogShift = (DispCnt >> 8) & 0xF;
+            frame->FogDensityTable[0] = FogDensityTable[0];
+            memcpy(&frame->FogDensityTable[1], FogDensityTable, 32);
+            frame->FogDensityTable[33] = FogDensityTable[31];
 
-            RenderFogColor = FogColor;
-            RenderFogOffset = FogOffset * 0x200;
-            RenderFogShift = (RenderDispCnt >> 8) & 0xF;
-            RenderFogDensityTable[0] = FogDensityTable[0];
-            memcpy(&RenderFogDensityTable[1], FogDensityTable, 32);
-            RenderFogDensityTable[33] = FogDensityTable[31];
+            frame->ClearAttr1 = ClearAttr1;
+            frame->ClearAttr2 = ClearAttr2;
 
-            RenderClearAttr1 = ClearAttr1;
-            RenderClearAttr2 = ClearAttr2;
+            frame->Generation = ++RenderFrameGeneration;
+
+            // hand the frame over to the renderer
+            // we get back either a frame that was never picked up, or one the renderer is done with
+            RenderFramePublished = RenderFrameWrite;
+            RenderFrameWrite = RenderFrameReady.exchange(RenderFrameWrite | 0x4, std::memory_order_acq_rel) & 0x3;
         }
 
         if (FlushRequest)
         {
-            CurRAMBank = CurRAMBank?0:1;
-            CurVertexRAM = &VertexRAM[CurRAMBank ? 6144 : 0];
-            CurPolygonRAM = &PolygonRAM[CurRAMBank ? 2048 : 0];
+            // the new bank must not be used by the last published frame or by the frame
+            // the renderer is working on. the renderer can only swap its frame for the
+            // published one, so even if this races with it we're safe
+            u32 readframe = 3 - RenderFrameWrite - (RenderFrameReady.load(std::memory_order_acquire) & 0x3);
+            u32 busy0 = RenderFrames[RenderFramePublished].Bank;
+            u32 busy1 = RenderFrames[readframe].Bank;
+
+            for (u32 i = 1; i <= 3; i++)
+            {
+                u32 bank = (CurRAMBank + i) % 3;
+                if (bank != busy0 && bank != busy1)
+                {
+                    CurRAMBank = bank;
+                    break;
+                }
+            }
+
+            CurVertexRAM = &VertexRAM[CurRAMBank * 6144];
+            CurPolygonRAM = &PolygonRAM[CurRAMBank * 2048];
 
             NumVertices = 0;
             NumPolygons = 0;
@@ -2600,6 +2739,38 @@ void VBlank()
     }
 }
 
+void LatchRenderFrame()
+{
+    if (RenderFrameReady.load(std::memory_order_acquire) & 0x4)
+        RenderFrameRead = RenderFrameReady.exchange(RenderFrameRead, std::memory_order_acq_rel) & 0x3;
+
+    RenderFrameState* frame = &RenderFrames[RenderFrameRead];
+
+    // if frames were skipped, we can't know whether this one is identical
+    if (frame->Generation == RenderedGeneration)
+        RenderFrameIdentical = true;
+    else
+        RenderFrameIdentical = frame->FrameIdentical && (frame->Generation == RenderedGeneration+1);
+    RenderedGeneration = frame->Generation;
+
+    RenderPolygonRAM = SortedPolygonRAM[frame->Bank].data();
+    RenderNumPolygons = frame->NumPolygons;
+
+    RenderDispCnt = frame->DispCnt;
+    RenderAlphaRef = frame->AlphaRef;
+
+    memcpy(RenderEdgeTable, frame->EdgeTable, 8*2);
+    memcpy(RenderToonTable, frame->ToonTable, 32*2);
+
+    RenderFogColor = frame->FogColor;
+    RenderFogOffset = frame->FogOffset;
+    RenderFogShift = frame->FogShift;
+    memcpy(RenderFogDensityTable, frame->FogDensityTable, 34);
+
+    RenderClearAttr1 = frame->ClearAttr1;
+    RenderClearAttr2 = frame->ClearAttr2;
+}
+
 void VCount215()
 {
     CurrentRenderer->RenderFrame();
@@ -94,13 +94,27 @@ extern bool RenderFrameIdentical;
 
 extern u16 RenderXPos;
 
-extern std::array<Polygon*,2048> RenderPolygonRAM;
+extern Polygon** RenderPolygonRAM;
 extern u32 RenderNumPolygons;
 
 extern bool AbortFrame;
 
 extern u64 Timestamp;
 
+// geometry engine statistics, for profiling
+struct GeometryStats
+{
+    u32 NumBatches;         // runs of side-effect-free commands executed in one go
+    u32 NumBatchedCommands; // FIFO entries processed through those batches
+    u32 MaxBatchSize;
+
+    u32 NumClipAccepted;    // polygons entirely within the view volume, not going through the clipper
+    u32 NumClipped;         // polygons that needed clipping
+    u32 NumClipRejected;    // polygons discarded by the clipper
+};
+
+extern GeometryStats Stats;
+
 bool Init();
 void DeInit();
 void Reset();
@@ -120,6 +134,10 @@ void VCount144();
 void VBlank();
 void VCount215();
 
+// to be called by the renderer when it starts working on a frame
+// sets the Renderxxxxxx variables from the latest frame latched at VBlank
+void LatchRenderFrame();
+
 void RestartFrame();
 
 void SetRenderXPos(u16 xpos);
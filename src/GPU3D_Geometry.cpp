@@ -0,0 +1,352 @@
+/*
+    Copyright 2016-2022 melonDS team
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <string.h>
+#include "GPU3D_Geometry.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GEOMETRY_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define GEOMETRY_NEON
+#include <arm_neon.h>
+#endif
+
+namespace GPU3D
+{
+namespace Geometry
+{
+
+int Impl;
+
+void (*MatrixMult)(s32* m, const s32* s, int rows);
+void (*VecMult4x4)(s32* out, const s32* v, const s32* m);
+void (*VecMult3x3)(s32* out, const s32* v, const s32* m);
+void (*LightDots)(s32* diff, s32* shine, const s16 (*lightdir)[3], const s32* normal);
+
+
+// reference implementation
+
+void MatrixMult_Scalar(s32* m, const s32* s, int rows)
+{
+    s32 tmp[16];
+    memcpy(tmp, m, 16*4);
+
+    for (int r = 0; r < rows; r++)
+    {
+        const s32* row = &s[r*4];
+        for (int c = 0; c < 4; c++)
+        {
+            m[r*4 + c] = ((s64)row[0]*tmp[c] + (s64)row[1]*tmp[4+c] +
+                          (s64)row[2]*tmp[8+c] + (s64)row[3]*tmp[12+c]) >> 12;
+        }
+    }
+}
+
+void VecMult4x4_Scalar(s32* out, const s32* v, const s32* m)
+{
+    for (int c = 0; c < 4; c++)
+    {
+        out[c] = ((s64)v[0]*m[c] + (s64)v[1]*m[4+c] + (s64)v[2]*m[8+c] + (s64)v[3]*m[12+c]) >> 12;
+    }
+}
+
+void VecMult3x3_Scalar(s32* out, const s32* v, const s32* m)
+{
+    // 32-bit wraparound is intended here
+    for (int c = 0; c < 3; c++)
+    {
+        out[c] = (s32)((u32)v[0]*(u32)m[c] + (u32)v[1]*(u32)m[4+c] + (u32)v[2]*(u32)m[8+c]) >> 12;
+    }
+}
+
+void LightDots_Scalar(s32* diff, s32* shine, const s16 (*lightdir)[3], const s32* normal)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        s32 x = lightdir[i][0], y = lightdir[i][1], z = lightdir[i][2];
+
+        diff[i] = (s32)((u32)x*(u32)normal[0] + (u32)y*(u32)normal[1] + (u32)z*(u32)normal[2]);
+        shine[i] = (s32)((u32)(x>>1)*(u32)normal[0] + (u32)(y>>1)*(u32)normal[1] + (u32)((z-0x200)>>1)*(u32)normal[2]);
+    }
+}
+
+
+#ifdef GEOMETRY_X86
+
+// _mm_mul_epi32 only multiplies the even 32-bit lanes, so even and odd
+// columns are accumulated separately and interleaved back afterwards.
+// a logical 64-bit shift is fine since only the low 32 bits are kept.
+
+__attribute__((target("sse4.1")))
+static inline __m128i RowMult_SSE41(const s32* row, __m128i m0, __m128i m1, __m128i m2, __m128i m3)
+{
+    __m128i s0 = _mm_set1_epi32(row[0]);
+    __m128i s1 = _mm_set1_epi32(row[1]);
+    __m128i s2 = _mm_set1_epi32(row[2]);
+    __m128i s3 = _mm_set1_epi32(row[3]);
+
+    __m128i even = _mm_add_epi64(_mm_add_epi64(_mm_mul_epi32(s0, m0), _mm_mul_epi32(s1, m1)),
+                                 _mm_add_epi64(_mm_mul_epi32(s2, m2), _mm_mul_epi32(s3, m3)));
+    __m128i odd = _mm_add_epi64(_mm_add_epi64(_mm_mul_epi32(s0, _mm_srli_epi64(m0, 32)), _mm_mul_epi32(s1, _mm_srli_epi64(m1, 32))),
+                                _mm_add_epi64(_mm_mul_epi32(s2, _mm_srli_epi64(m2, 32)), _mm_mul_epi32(s3, _mm_srli_epi64(m3, 32))));
+
+    even = _mm_srli_epi64(even, 12);
+    odd = _mm_slli_epi64(_mm_srli_epi64(odd, 12), 32);
+    return _mm_blend_epi16(even, odd, 0xCC);
+}
+
+__attribute__((target("sse4.1")))
+void MatrixMult_SSE41(s32* m, const s32* s, int rows)
+{
+    __m128i m0 = _mm_loadu_si128((__m128i*)&m[0]);
+    __m128i m1 = _mm_loadu_si128((__m128i*)&m[4]);
+    __m128i m2 = _mm_loadu_si128((__m128i*)&m[8]);
+    __m128i m3 = _mm_loadu_si128((__m128i*)&m[12]);
+
+    for (int r = 0; r < rows; r++)
+        _mm_storeu_si128((__m128i*)&m[r*4], RowMult_SSE41(&s[r*4], m0, m1, m2, m3));
+}
+
+__attribute__((target("sse4.1")))
+void VecMult4x4_SSE41(s32* out, const s32* v, const s32* m)
+{
+    __m128i m0 = _mm_loadu_si128((__m128i*)&m[0]);
+    __m128i m1 = _mm_loadu_si128((__m128i*)&m[4]);
+    __m128i m2 = _mm_loadu_si128((__m128i*)&m[8]);
+    __m128i m3 = _mm_loadu_si128((__m128i*)&m[12]);
+
+    _mm_storeu_si128((__m128i*)out, RowMult_SSE41(v, m0, m1, m2, m3));
+}
+
+__attribute__((target("sse4.1")))
+void VecMult3x3_SSE41(s32* out, const s32* v, const s32* m)
+{
+    __m128i res = _mm_add_epi32(_mm_add_epi32(
+        _mm_mullo_epi32(_mm_set1_epi32(v[0]), _mm_loadu_si128((__m128i*)&m[0])),
+        _mm_mullo_epi32(_mm_set1_epi32(v[1]), _mm_loadu_si128((__m128i*)&m[4]))),
+        _mm_mullo_epi32(_mm_set1_epi32(v[2]), _mm_loadu_si128((__m128i*)&m[8])));
+    res = _mm_srai_epi32(res, 12);
+
+    s32 tmp[4];
+    _mm_storeu_si128((__m128i*)tmp, res);
+    out[0] = tmp[0]; out[1] = tmp[1]; out[2] = tmp[2];
+}
+
+__attribute__((target("sse4.1")))
+void LightDots_SSE41(s32* diff, s32* shine, const s16 (*lightdir)[3], const s32* normal)
+{
+    __m128i lx = _mm_setr_epi32(lightdir[0][0], lightdir[1][0], lightdir[2][0], lightdir[3][0]);
+    __m128i ly = _mm_setr_epi32(lightdir[0][1], lightdir[1][1], lightdir[2][1], lightdir[3][1]);
+    __m128i lz = _mm_setr_epi32(lightdir[0][2], lightdir[1][2], lightdir[2][2], lightdir[3][2]);
+    __m128i nx = _mm_set1_epi32(normal[0]);
+    __m128i ny = _mm_set1_epi32(normal[1]);
+    __m128i nz = _mm_set1_epi32(normal[2]);
+
+    __m128i d = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(lx, nx), _mm_mullo_epi32(ly, ny)), _mm_mullo_epi32(lz, nz));
+
+    lx = _mm_srai_epi32(lx, 1);
+    ly = _mm_srai_epi32(ly, 1);
+    lz = _mm_srai_epi32(_mm_sub_epi32(lz, _mm_set1_epi32(0x200)), 1);
+    __m128i sh = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(lx, nx), _mm_mullo_epi32(ly, ny)), _mm_mullo_epi32(lz, nz));
+
+    _mm_storeu_si128((__m128i*)diff, d);
+    _mm_storeu_si128((__m128i*)shine, sh);
+}
+
+// AVX2: two rows per iteration
+
+__attribute__((target("avx2")))
+static inline __m256i RowMult2_AVX2(const s32* row0, const s32* row1, __m256i m0, __m256i m1, __m256i m2, __m256i m3)
+{
+    __m256i s0 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi32(row0[0])), _mm_set1_epi32(row1[0]), 1);
+    __m256i s1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi32(row0[1])), _mm_set1_epi32(row1[1]), 1);
+    __m256i s2 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi32(row0[2])), _mm_set1_epi32(row1[2]), 1);
+    __m256i s3 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi32(row0[3])), _mm_set1_epi32(row1[3]), 1);
+
+    __m256i even = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epi32(s0, m0), _mm256_mul_epi32(s1, m1)),
+                                    _mm256_add_epi64(_mm256_mul_epi32(s2, m2), _mm256_mul_epi32(s3, m3)));
+    __m256i odd = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epi32(s0, _mm256_srli_epi64(m0, 32)), _mm256_mul_epi32(s1, _mm256_srli_epi64(m1, 32))),
+                                   _mm256_add_epi64(_mm256_mul_epi32(s2, _mm256_srli_epi64(m2, 32)), _mm256_mul_epi32(s3, _mm256_srli_epi64(m3, 32))));
+
+    even = _mm256_srli_epi64(even, 12);
+    odd = _mm256_slli_epi64(_mm256_srli_epi64(odd, 12), 32);
+    return _mm256_blend_epi32(even, odd, 0xAA);
+}
+
+__attribute__((target("avx2")))
+void MatrixMult_AVX2(s32* m, const s32* s, int rows)
+{
+    __m256i m0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)&m[0]));
+    __m256i m1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)&m[4]));
+    __m256i m2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)&m[8]));
+    __m256i m3 = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)&m[12]));
+
+    int r = 0;
+    for (; r+1 < rows; r += 2)
+        _mm256_storeu_si256((__m256i*)&m[r*4], RowMult2_AVX2(&s[r*4], &s[(r+1)*4], m0, m1, m2, m3));
+
+    if (r < rows)
+    {
+        __m256i res = RowMult2_AVX2(&s[r*4], &s[r*4], m0, m1, m2, m3);
+        _mm_storeu_si128((__m128i*)&m[r*4], _mm256_castsi256_si128(res));
+    }
+}
+
+#endif // GEOMETRY_X86
+
+
+#ifdef GEOMETRY_NEON
+
+// vshrn_n_s64 keeps the low 32 bits of the shifted 64-bit sums, same as the scalar truncation
+
+static inline int32x4_t RowMult_NEON(const s32* row, int32x4_t m0, int32x4_t m1, int32x4_t m2, int32x4_t m3)
+{
+    int64x2_t lo = vmull_n_s32(vget_low_s32(m0), row[0]);
+    int64x2_t hi = vmull_n_s32(vget_high_s32(m0), row[0]);
+    lo = vmlal_n_s32(lo, vget_low_s32(m1), row[1]);
+    hi = vmlal_n_s32(hi, vget_high_s32(m1), row[1]);
+    lo = vmlal_n_s32(lo, vget_low_s32(m2), row[2]);
+    hi = vmlal_n_s32(hi, vget_high_s32(m2), row[2]);
+    lo = vmlal_n_s32(lo, vget_low_s32(m3), row[3]);
+    hi = vmlal_n_s32(hi, vget_high_s32(m3), row[3]);
+
+    return vcombine_s32(vshrn_n_s64(lo, 12), vshrn_n_s64(hi, 12));
+}
+
+void MatrixMult_NEON(s32* m, const s32* s, int rows)
+{
+    int32x4_t m0 = vld1q_s32(&m[0]);
+    int32x4_t m1 = vld1q_s32(&m[4]);
+    int32x4_t m2 = vld1q_s32(&m[8]);
+    int32x4_t m3 = vld1q_s32(&m[12]);
+
+    for (int r = 0; r < rows; r++)
+        vst1q_s32(&m[r*4], RowMult_NEON(&s[r*4], m0, m1, m2, m3));
+}
+
+void VecMult4x4_NEON(s32* out, const s32* v, const s32* m)
+{
+    vst1q_s32(out, RowMult_NEON(v, vld1q_s32(&m[0]), vld1q_s32(&m[4]), vld1q_s32(&m[8]), vld1q_s32(&m[12])));
+}
+
+void VecMult3x3_NEON(s32* out, const s32* v, const s32* m)
+{
+    int32x4_t res = vmulq_n_s32(vld1q_s32(&m[0]), v[0]);
+    res = vmlaq_n_s32(res, vld1q_s32(&m[4]), v[1]);
+    res = vmlaq_n_s32(res, vld1q_s32(&m[8]), v[2]);
+    res = vshrq_n_s32(res, 12);
+
+    out[0] = vgetq_lane_s32(res, 0);
+    out[1] = vgetq_lane_s32(res, 1);
+    out[2] = vgetq_lane_s32(res, 2);
+}
+
+void LightDots_NEON(s32* diff, s32* shine, const s16 (*lightdir)[3], const s32* normal)
+{
+    s32 tmp[3][4];
+    for (int i = 0; i < 4; i++)
+    {
+        tmp[0][i] = lightdir[i][0];
+        tmp[1][i] = lightdir[i][1];
+        tmp[2][i] = lightdir[i][2];
+    }
+
+    int32x4_t lx = vld1q_s32(tmp[0]);
+    int32x4_t ly = vld1q_s32(tmp[1]);
+    int32x4_t lz = vld1q_s32(tmp[2]);
+
+    int32x4_t d = vmulq_n_s32(lx, normal[0]);
+    d = vmlaq_n_s32(d, ly, normal[1]);
+    d = vmlaq_n_s32(d, lz, normal[2]);
+
+    lx = vshrq_n_s32(lx, 1);
+    ly = vshrq_n_s32(ly, 1);
+    lz = vshrq_n_s32(vsubq_s32(lz, vdupq_n_s32(0x200)), 1);
+    int32x4_t sh = vmulq_n_s32(lx, normal[0]);
+    sh = vmlaq_n_s32(sh, ly, normal[1]);
+    sh = vmlaq_n_s32(sh, lz, normal[2]);
+
+    vst1q_s32(diff, d);
+    vst1q_s32(shine, sh);
+}
+
+#endif // GEOMETRY_NEON
+
+
+bool SetImpl(int impl)
+{
+    switch (impl)
+    {
+    case Impl_Scalar:
+        MatrixMult = MatrixMult_Scalar;
+        VecMult4x4 = VecMult4x4_Scalar;
+        VecMult3x3 = VecMult3x3_Scalar;
+        LightDots = LightDots_Scalar;
+        break;
+
+#if defined(GEOMETRY_X86)
+    case Impl_SSE41:
+    case Impl_AVX2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("sse4.1"))
+            return false;
+        if (impl == Impl_AVX2 && !__builtin_cpu_supports("avx2"))
+            return false;
+
+        MatrixMult = MatrixMult_SSE41;
+        VecMult4x4 = VecMult4x4_SSE41;
+        VecMult3x3 = VecMult3x3_SSE41;
+        LightDots = LightDots_SSE41;
+
+        // the vector routines are too narrow to benefit from AVX2
+        if (impl == Impl_AVX2)
+            MatrixMult = MatrixMult_AVX2;
+        break;
+#elif defined(GEOMETRY_NEON)
+    case Impl_NEON:
+        MatrixMult = MatrixMult_NEON;
+        VecMult4x4 = VecMult4x4_NEON;
+        VecMult3x3 = VecMult3x3_NEON;
+        LightDots = LightDots_NEON;
+        break;
+#endif
+
+    default:
+        return false;
+    }
+
+    Impl = impl;
+    return true;
+}
+
+void Init()
+{
+    if (SetImpl(Impl_AVX2)) return;
+    if (SetImpl(Impl_SSE41)) return;
+    if (SetImpl(Impl_NEON)) return;
+    SetImpl(Impl_Scalar);
+}
+
+int GetImpl()
+{
+    return Impl;
+}
+
+}
+}
@@ -0,0 +1,67 @@
+/*
+    Copyright 2016-2022 melonDS team
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef GPU3D_GEOMETRY_H
+#define GPU3D_GEOMETRY_H
+
+#include "types.h"
+
+// fixed-point (20.12) math used by the geometry engine
+//
+// every implementation must give the exact same results as the scalar one:
+// * matrix/position math uses 64-bit intermediates, the result is truncated to 32 bits after the shift
+// * normal/light math uses 32-bit intermediates that wrap around, like on hardware
+
+namespace GPU3D
+{
+namespace Geometry
+{
+
+enum
+{
+    Impl_Scalar = 0,
+    Impl_SSE41,
+    Impl_AVX2,
+    Impl_NEON,
+};
+
+// picks the fastest implementation supported by the host CPU
+void Init();
+
+// forces a given implementation, returns false if the host CPU doesn't support it
+bool SetImpl(int impl);
+int GetImpl();
+
+// m = s*m, for the first 'rows' rows of m
+// s is a full 4x4 matrix
+extern void (*MatrixMult)(s32* m, const s32* s, int rows);
+
+// out = v*m, v being a 4-component row vector
+extern void (*VecMult4x4)(s32* out, const s32* v, const s32* m);
+
+// out = (v*m) >> 12 for the upper 3x3 part of m, with 32-bit intermediates
+extern void (*VecMult3x3)(s32* out, const s32* v, const s32* m);
+
+// raw diffuse and specular dot products between the normal and the 4 lights
+// (before any shifting/clamping)
+extern void (*LightDots)(s32* diff, s32* shine, const s16 (*lightdir)[3], const s32* normal);
+
+}
+}
+
+#endif // GPU3D_GEOMETRY_H
@@ -1113,6 +1113,8 @@ void GLRenderer::RenderSceneChunk(int y, int h)
 
 void GLRenderer::RenderFrame()
 {
+    GPU3D::LatchRenderFrame();
+
     CurShaderID = -1;
 
     glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
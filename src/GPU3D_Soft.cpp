@@ -63,10 +63,12 @@ void SoftRenderer::SetupRenderThread()
         Platform::Semaphore_Reset(Sema_ScanlineCount);
 
         Platform::Semaphore_Post(Sema_RenderStart);
+        RenderThreadPending = true;
     }
     else
     {
         StopRenderThread();
+        RenderThreadPending = false;
     }
 }
 
@@ -86,6 +88,7 @@ bool SoftRenderer::Init()
     Threaded = false;
     RenderThreadRunning = false;
     RenderThreadRendering = false;
+    RenderThreadPending = false;
 
     return true;
 }
@@ -1642,27 +1645,35 @@ void SoftRenderer::RenderPolygons(bool threaded, Polygon** polygons, int npolys)
         Platform::Semaphore_Post(Sema_ScanlineCount);
 }
 
-void SoftRenderer::VCount144()
+void SoftRenderer::RenderFrame()
 {
-    if (RenderThreadRunning.load(std::memory_order_relaxed) && !GPU3D::AbortFrame)
+    // the render thread keeps its own copy of the frame state (see GPU3D::LatchRenderFrame())
+    // so it only has to be done before we touch the flattened texture memory again
+    if (RenderThreadPending)
+    {
         Platform::Semaphore_Wait(Sema_RenderDone);
-}
+        RenderThreadPending = false;
+    }
 
-void SoftRenderer::RenderFrame()
-{
     auto textureDirty = GPU::VRAMDirty_Texture.DeriveState(GPU::VRAMMap_Texture);
     auto texPalDirty = GPU::VRAMDirty_TexPal.DeriveState(GPU::VRAMMap_TexPal);
 
     bool textureChanged = GPU::MakeVRAMFlat_TextureCoherent(textureDirty);
     bool texPalChanged = GPU::MakeVRAMFlat_TexPalCoherent(texPalDirty);
 
-    FrameIdentical = !(textureChanged || texPalChanged) && RenderFrameIdentical;
+    TexturesChanged = textureChanged || texPalChanged;
 
     if (RenderThreadRunning.load(std::memory_order_relaxed))
     {
         Platform::Semaphore_Post(Sema_RenderStart);
+        RenderThreadPending = true;
+        return;
     }
-    else if (!FrameIdentical)
+
+    GPU3D::LatchRenderFrame();
+    FrameIdentical = !TexturesChanged && RenderFrameIdentical;
+
+    if (!FrameIdentical)
     {
         ClearBuffers();
         RenderPolygons(false, &RenderPolygonRAM[0], RenderNumPolygons);
@@ -1682,6 +1693,10 @@ void SoftRenderer::RenderThreadFunc()
         if (!RenderThreadRunning) return;
 
         RenderThreadRendering = true;
+
+        GPU3D::LatchRenderFrame();
+        FrameIdentical = !TexturesChanged && RenderFrameIdentical;
+
         if (FrameIdentical)
         {
             Platform::Semaphore_Post(Sema_ScanlineCount, 192);
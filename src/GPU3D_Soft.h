@@ -36,7 +36,6 @@ public:
 
     virtual void SetRenderSettings(GPU::RenderSettings& settings) override;
 
-    virtual void VCount144() override;
     virtual void RenderFrame() override;
     virtual void RestartFrame() override;
     virtual u32* GetLine(int line) override;
@@ -502,6 +501,7 @@ private:
     bool Enabled;
 
     bool FrameIdentical;
+    bool TexturesChanged;
 
     // threading
 
@@ -509,6 +509,7 @@ private:
     Platform::Thread* RenderThread;
     std::atomic_bool RenderThreadRunning;
     std::atomic_bool RenderThreadRendering;
+    bool RenderThreadPending; // a frame was started and its RenderDone wasn't waited for yet
     Platform::Semaphore* Sema_RenderStart;
     Platform::Semaphore* Sema_RenderDone;
     Platform::Semaphore* Sema_ScanlineCount;
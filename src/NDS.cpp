@@ -175,7 +175,8 @@ bool RunningGame;
 
 void DivDone(u32 param);
 void SqrtDone(u32 param);
-void RunTimer(u32 tid, s32 cycles);
+void RunTimer(u32 tid, u64 cycles);
+void TimerEvent(u32 cpu);
 void UpdateWifiTimings();
 void SetWifiWaitCnt(u16 val);
 void SetGBASlotTimings();
@@ -724,6 +725,7 @@ bool DoSavestate_Scheduler(Savestate* file)
         SPI::TransferDone,
         DivDone,
         SqrtDone,
+        TimerEvent,
 
         DSi_SDHost::FinishRX,
         DSi_SDHost::FinishTX,
@@ -954,6 +956,38 @@ bool LoadCart(const u8* romdata, u32 romlen, const u8* savedata, u32 savelen)
     return true;
 }
 
+bool LoadCart(FILE* romfile, u32 romlen, const u8* savedata, u32 savelen)
+{
+    if (!NDSCart::LoadROM(romfile, romlen))
+        return false;
+
+    if (savedata && savelen)
+        NDSCart::LoadSave(savedata, savelen);
+
+    return true;
+}
+
+bool LoadCartStream(FILE* romfile, u32 romlen, u32 readylen, const u8* savedata, u32 savelen)
+{
+    if (!NDSCart::LoadROMStream(romfile, romlen, readylen))
+        return false;
+
+    if (savedata && savelen)
+        NDSCart::LoadSave(savedata, savelen);
+
+    return true;
+}
+
+void UpdateCartStream(u32 readylen)
+{
+    NDSCart::UpdateROMStream(readylen);
+}
+
+void AbortCartStream()
+{
+    NDSCart::AbortROMStream();
+}
+
 void LoadSave(const u8* savedata, u32 savelen)
 {
     if (savedata && savelen)
@@ -1085,7 +1119,6 @@ u32 RunFrame()
                     ARM9->Execute();
             }
 
-            RunTimers(0);
             GPU3D::Run();
 
             target = ARM9Timestamp >> ARM9ClockShift;
@@ -1112,8 +1145,6 @@ u32 RunFrame()
 #endif
                         ARM7->Execute();
                 }
-
-                RunTimers(1);
             }
 
             RunSystem(target);
@@ -1700,22 +1731,50 @@ void HandleTimerOverflow(u32 tid)
     }
 }
 
-void RunTimer(u32 tid, s32 cycles)
+bool TimerOverflowVisible(u32 tid)
+{
+    // an overflow only needs to be delivered on time if it raises an IRQ
+    // or clocks the next timer in count-up mode
+    if (Timers[tid].Cnt & (1<<6))
+        return true;
+    if ((tid & 0x3) == 3)
+        return false;
+
+    return (Timers[tid+1].Cnt & 0x84) == 0x84;
+}
+
+void RunTimer(u32 tid, u64 cycles)
 {
     Timer* timer = &Timers[tid];
 
-    timer->Counter += (cycles << timer->CycleShift);
-    while (timer->Counter >> 26)
+    u64 counter = timer->Counter + (cycles << timer->CycleShift);
+    if (!(counter >> 26))
+    {
+        timer->Counter = (u32)counter;
+        return;
+    }
+
+    if (!TimerOverflowVisible(tid))
     {
-        timer->Counter -= (1 << 26);
+        // nobody is watching the overflows, skip straight to the final value
+        u32 reload = timer->Reload << 10;
+        timer->Counter = reload + (u32)((counter - (1<<26)) % ((1<<26) - reload));
+        return;
+    }
+
+    // overflow events keep this bounded to a handful of iterations
+    while (counter >> 26)
+    {
+        timer->Counter = (u32)(counter - (1<<26));
         HandleTimerOverflow(tid);
+        counter = timer->Counter;
     }
 }
 
 void RunTimers(u32 cpu)
 {
     u32 timermask = TimerCheckMask[cpu];
-    s32 cycles;
+    u64 cycles;
 
     if (cpu == 0)
         cycles = (ARM9Timestamp >> ARM9ClockShift) - TimerTimestamp[0];
@@ -1730,6 +1789,41 @@ void RunTimers(u32 cpu)
     TimerTimestamp[cpu] += cycles;
 }
 
+void UpdateTimerEvent(u32 cpu)
+{
+    // timers are only brought up to date when they're accessed
+    // or when one of them overflows in a way that can be observed
+    // so schedule an event for the earliest such overflow
+    // RunTimers() must have been called beforehand
+
+    u32 evt = cpu ? Event_Timer7 : Event_Timer9;
+    CancelEvent(evt);
+
+    u64 next = UINT64_MAX;
+    u32 timermask = TimerCheckMask[cpu];
+    for (u32 i = 0; i < 4; i++)
+    {
+        if (!(timermask & (1<<i))) continue;
+
+        u32 tid = (cpu<<2) + i;
+        if (!TimerOverflowVisible(tid)) continue;
+
+        Timer* timer = &Timers[tid];
+        u32 left = (1<<26) - timer->Counter;
+        u64 cycles = (left + (1<<timer->CycleShift) - 1) >> timer->CycleShift;
+        if (cycles < next) next = cycles;
+    }
+
+    if (next != UINT64_MAX)
+        ScheduleEvent(evt, TimerTimestamp[cpu] + next, TimerEvent, cpu);
+}
+
+void TimerEvent(u32 cpu)
+{
+    RunTimers(cpu);
+    UpdateTimerEvent(cpu);
+}
+
 const s32 TimerPrescaler[4] = {0, 6, 8, 10};
 
 u16 TimerGetCounter(u32 timer)
@@ -1740,6 +1834,13 @@ u16 TimerGetCounter(u32 timer)
     return ret >> 10;
 }
 
+void TimerSetReload(u32 id, u16 val)
+{
+    // the reload value is picked up at overflow time, so catch up first
+    RunTimers(id>>2);
+    Timers[id].Reload = val;
+}
+
 void TimerStart(u32 id, u16 cnt)
 {
     Timer* timer = &Timers[id];
@@ -1760,8 +1861,9 @@ void TimerStart(u32 id, u16 cnt)
         TimerCheckMask[id>>2] |= 0x01 << (id&0x3);
     else
         TimerCheckMask[id>>2] &= ~(0x01 << (id&0x3));
-}
 
+    UpdateTimerEvent(id>>2);
+}
 
 
 // matching NDMA modes for DSi
@@ -3424,13 +3526,13 @@ void ARM9IOWrite16(u32 addr, u16 val)
     case 0x040000EC: DMA9Fill[3] = (DMA9Fill[3] & 0xFFFF0000) | val; return;
     case 0x040000EE: DMA9Fill[3] = (DMA9Fill[3] & 0x0000FFFF) | (val << 16); return;
 
-    case 0x04000100: Timers[0].Reload = val; return;
+    case 0x04000100: TimerSetReload(0, val); return;
     case 0x04000102: TimerStart(0, val); return;
-    case 0x04000104: Timers[1].Reload = val; return;
+    case 0x04000104: TimerSetReload(1, val); return;
     case 0x04000106: TimerStart(1, val); return;
-    case 0x04000108: Timers[2].Reload = val; return;
+    case 0x04000108: TimerSetReload(2, val); return;
     case 0x0400010A: TimerStart(2, val); return;
-    case 0x0400010C: Timers[3].Reload = val; return;
+    case 0x0400010C: TimerSetReload(3, val); return;
     case 0x0400010E: TimerStart(3, val); return;
 
     case 0x04000132:
@@ -3610,19 +3712,19 @@ void ARM9IOWrite32(u32 addr, u32 val)
     case 0x040000EC: DMA9Fill[3] = val; return;
 
     case 0x04000100:
-        Timers[0].Reload = val & 0xFFFF;
+        TimerSetReload(0, val & 0xFFFF);
         TimerStart(0, val>>16);
         return;
     case 0x04000104:
-        Timers[1].Reload = val & 0xFFFF;
+        TimerSetReload(1, val & 0xFFFF);
         TimerStart(1, val>>16);
         return;
     case 0x04000108:
-        Timers[2].Reload = val & 0xFFFF;
+        TimerSetReload(2, val & 0xFFFF);
         TimerStart(2, val>>16);
         return;
     case 0x0400010C:
-        Timers[3].Reload = val & 0xFFFF;
+        TimerSetReload(3, val & 0xFFFF);
         TimerStart(3, val>>16);
         return;
 
@@ -4136,13 +4238,13 @@ void ARM7IOWrite16(u32 addr, u16 val)
     case 0x040000DC: DMAs[7]->WriteCnt((DMAs[7]->Cnt & 0xFFFF0000) | val); return;
     case 0x040000DE: DMAs[7]->WriteCnt((DMAs[7]->Cnt & 0x0000FFFF) | (val << 16)); return;
 
-    case 0x04000100: Timers[4].Reload = val; return;
+    case 0x04000100: TimerSetReload(4, val); return;
     case 0x04000102: TimerStart(4, val); return;
-    case 0x04000104: Timers[5].Reload = val; return;
+    case 0x04000104: TimerSetReload(5, val); return;
     case 0x04000106: TimerStart(5, val); return;
-    case 0x04000108: Timers[6].Reload = val; return;
+    case 0x04000108: TimerSetReload(6, val); return;
     case 0x0400010A: TimerStart(6, val); return;
-    case 0x0400010C: Timers[7].Reload = val; return;
+    case 0x0400010C: TimerSetReload(7, val); return;
     case 0x0400010E: TimerStart(7, val); return;
 
     case 0x04000132: KeyCnt = val; return;
@@ -4298,19 +4400,19 @@ void ARM7IOWrite32(u32 addr, u32 val)
     case 0x040000DC: DMAs[7]->WriteCnt(val); return;
 
     case 0x04000100:
-        Timers[4].Reload = val & 0xFFFF;
+        TimerSetReload(4, val & 0xFFFF);
         TimerStart(4, val>>16);
         return;
     case 0x04000104:
-        Timers[5].Reload = val & 0xFFFF;
+        TimerSetReload(5, val & 0xFFFF);
         TimerStart(5, val>>16);
         return;
     case 0x04000108:
-        Timers[6].Reload = val & 0xFFFF;
+        TimerSetReload(6, val & 0xFFFF);
         TimerStart(6, val>>16);
         return;
     case 0x0400010C:
-        Timers[7].Reload = val & 0xFFFF;
+        TimerSetReload(7, val & 0xFFFF);
         TimerStart(7, val>>16);
         return;
 
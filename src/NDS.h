@@ -43,6 +43,8 @@ enum
     Event_SPITransfer,
     Event_Div,
     Event_Sqrt,
+    Event_Timer9,
+    Event_Timer7,
 
     // DSi
     Event_DSi_SDMMCTransfer,
@@ -185,6 +187,7 @@ extern bool LagFrameFlag;
 
 extern u64 ARM9Timestamp, ARM9Target;
 extern u64 ARM7Timestamp, ARM7Target;
+extern u64 SysTimestamp;
 extern u32 ARM9ClockShift;
 
 extern u32 IME[2];
@@ -239,6 +242,10 @@ void SetConsoleType(int type);
 void LoadBIOS();
 
 bool LoadCart(const u8* romdata, u32 romlen, const u8* savedata, u32 savelen);
+bool LoadCart(FILE* romfile, u32 romlen, const u8* savedata, u32 savelen);
+bool LoadCartStream(FILE* romfile, u32 romlen, u32 readylen, const u8* savedata, u32 savelen);
+void UpdateCartStream(u32 readylen);
+void AbortCartStream();
 void LoadSave(const u8* savedata, u32 savelen);
 void EjectCart();
 bool CartInserted();
@@ -18,6 +18,12 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
+#if !defined(_WIN32) && !defined(__SWITCH__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "NDS.h"
 #include "DSi.h"
 #include "NDSCart.h"
@@ -53,6 +59,14 @@ u8 TransferCmd[8];
 bool CartInserted;
 u8* CartROM;
 u32 CartROMSize;
+bool CartROMMapped;
+
+// for ROMs that are still being written to their file by another thread (streamed out of an archive):
+// amount of data available from the start of the ROM
+std::atomic_uint32_t CartROMReady;
+std::atomic_bool CartROMStreamFailed;
+u32 CartROMStreamLen;
+Platform::Semaphore* CartROMSignal;
 u32 CartID;
 
 NDSHeader Header;
@@ -62,55 +76,99 @@ CartCommon* Cart;
 
 u32 Key1_KeyBuf[0x412];
 
+// setting up a KEY1 key means reading the initial table from the BIOS and running a few
+// hundred Blowfish passes, and it is done again for every KEY1 command phase when booting
+// from the BIOS, so the last few keys are kept around
+struct Key1_CachedKey
+{
+    bool Valid;
+    bool DSi;
+    u32 IDCode, Level, Mod;
+    u32 KeyBuf[0x412];
+};
+
+Key1_CachedKey Key1_Cache[4];
+u32 Key1_CacheNext;
+
+// decrypted secure area of the current cart
+u8 SecureAreaCache[0x800];
+bool SecureAreaCached;
+
 u64 Key2_X;
 u64 Key2_Y;
 
 
+void MakeROMWritable(u8* start, u32 len);
+void WaitForROM(u32 end);
+
+
 u32 ByteSwap(u32 val)
 {
     return (val >> 24) | ((val >> 8) & 0xFF00) | ((val << 8) & 0xFF0000) | (val << 24);
 }
 
-void Key1_Encrypt(u32* data)
+// processes 'num' 8-byte blocks at once, with their rounds interleaved
+// the table lookups of one block can then overlap with the others
+template <int num, bool decrypt>
+inline void Key1_Crypt(u32* data)
 {
-    u32 y = data[0];
-    u32 x = data[1];
-    u32 z;
+    u32 x[num], y[num];
+
+    for (int b = 0; b < num; b++)
+    {
+        y[b] = data[b*2];
+        x[b] = data[b*2 + 1];
+    }
+
+    for (u32 i = 0; i < 16; i++)
+    {
+        u32 key = Key1_KeyBuf[decrypt ? (0x11 - i) : i];
+
+        for (int b = 0; b < num; b++)
+        {
+            u32 z = key ^ x[b];
+            u32 t =  Key1_KeyBuf[0x012 +  (z >> 24)        ];
+            t     += Key1_KeyBuf[0x112 + ((z >> 16) & 0xFF)];
+            t     ^= Key1_KeyBuf[0x212 + ((z >>  8) & 0xFF)];
+            t     += Key1_KeyBuf[0x312 +  (z        & 0xFF)];
+            x[b] = t ^ y[b];
+            y[b] = z;
+        }
+    }
 
-    for (u32 i = 0x0; i <= 0xF; i++)
+    for (int b = 0; b < num; b++)
     {
-        z = Key1_KeyBuf[i] ^ x;
-        x =  Key1_KeyBuf[0x012 +  (z >> 24)        ];
-        x += Key1_KeyBuf[0x112 + ((z >> 16) & 0xFF)];
-        x ^= Key1_KeyBuf[0x212 + ((z >>  8) & 0xFF)];
-        x += Key1_KeyBuf[0x312 +  (z        & 0xFF)];
-        x ^= y;
-        y = z;
+        data[b*2]     = x[b] ^ Key1_KeyBuf[decrypt ? 0x1 : 0x10];
+        data[b*2 + 1] = y[b] ^ Key1_KeyBuf[decrypt ? 0x0 : 0x11];
     }
+}
 
-    data[0] = x ^ Key1_KeyBuf[0x10];
-    data[1] = y ^ Key1_KeyBuf[0x11];
+void Key1_Encrypt(u32* data)
+{
+    Key1_Crypt<1, false>(data);
 }
 
 void Key1_Decrypt(u32* data)
 {
-    u32 y = data[0];
-    u32 x = data[1];
-    u32 z;
+    Key1_Crypt<1, true>(data);
+}
 
-    for (u32 i = 0x11; i >= 0x2; i--)
-    {
-        z = Key1_KeyBuf[i] ^ x;
-        x =  Key1_KeyBuf[0x012 +  (z >> 24)        ];
-        x += Key1_KeyBuf[0x112 + ((z >> 16) & 0xFF)];
-        x ^= Key1_KeyBuf[0x212 + ((z >>  8) & 0xFF)];
-        x += Key1_KeyBuf[0x312 +  (z        & 0xFF)];
-        x ^= y;
-        y = z;
-    }
+void Key1_EncryptBlocks(u32* data, u32 num)
+{
+    u32 i = 0;
+    for (; (i + 4) <= num; i += 4)
+        Key1_Crypt<4, false>(&data[i*2]);
+    for (; i < num; i++)
+        Key1_Crypt<1, false>(&data[i*2]);
+}
 
-    data[0] = x ^ Key1_KeyBuf[0x1];
-    data[1] = y ^ Key1_KeyBuf[0x0];
+void Key1_DecryptBlocks(u32* data, u32 num)
+{
+    u32 i = 0;
+    for (; (i + 4) <= num; i += 4)
+        Key1_Crypt<4, true>(&data[i*2]);
+    for (; i < num; i++)
+        Key1_Crypt<1, true>(&data[i*2]);
 }
 
 void Key1_ApplyKeycode(u32* keycode, u32 mod)
@@ -157,6 +215,16 @@ void Key1_LoadKeyBuf(bool dsi)
 
 void Key1_InitKeycode(bool dsi, u32 idcode, u32 level, u32 mod)
 {
+    for (int i = 0; i < 4; i++)
+    {
+        Key1_CachedKey& key = Key1_Cache[i];
+        if (key.Valid && key.DSi == dsi && key.IDCode == idcode && key.Level == level && key.Mod == mod)
+        {
+            memcpy(Key1_KeyBuf, key.KeyBuf, sizeof(Key1_KeyBuf));
+            return;
+        }
+    }
+
     Key1_LoadKeyBuf(dsi);
 
     u32 keycode[3] = {idcode, idcode>>1, idcode<<1};
@@ -168,6 +236,22 @@ void Key1_InitKeycode(bool dsi, u32 idcode, u32 level, u32 mod)
         keycode[2] >>= 1;
         Key1_ApplyKeycode(keycode, mod);
     }
+
+    Key1_CachedKey& key = Key1_Cache[Key1_CacheNext];
+    Key1_CacheNext = (Key1_CacheNext + 1) & 3;
+
+    key.Valid = true;
+    key.DSi = dsi;
+    key.IDCode = idcode;
+    key.Level = level;
+    key.Mod = mod;
+    memcpy(key.KeyBuf, Key1_KeyBuf, sizeof(Key1_KeyBuf));
+}
+
+void Key1_FlushCache()
+{
+    for (int i = 0; i < 4; i++)
+        Key1_Cache[i].Valid = false;
 }
 
 
@@ -387,6 +471,7 @@ void CartCommon::ReadROM(u32 addr, u32 len, u8* data, u32 offset)
     if ((addr+len) > ROMLength)
         len = ROMLength - addr;
 
+    WaitForROM(addr+len);
     memcpy(data+offset, ROM+addr, len);
 }
 
@@ -568,6 +653,7 @@ void CartRetail::ReadROM_B7(u32 addr, u32 len, u8* data, u32 offset)
             addr = 0x8000 + (addr & 0x1FF);
     }
 
+    WaitForROM(addr+len);
     memcpy(data+offset, ROM+addr, len);
 }
 
@@ -1203,6 +1289,7 @@ void CartHomebrew::SetupDirectBoot(std::string romname)
     {
         // add the ROM to the SD volume
 
+        WaitForROM(CartROMSize);
         if (!SD->InjectFile(romname, CartROM, CartROMSize))
             return;
 
@@ -1405,15 +1492,29 @@ void CartHomebrew::ApplyDLDIPatch(const u8* patch, u32 patchlen, bool readonly)
     u32 offset = *(u32*)&ROM[0x20];
     u32 size = *(u32*)&ROM[0x2C];
 
+    if (offset >= ROMLength) return;
+    if (size > (ROMLength - offset)) size = ROMLength - offset;
+
     u8* binary = &ROM[offset];
+    MakeROMWritable(binary, size);
 
-    for (u32 i = 0; i < size; )
+    for (u32 i = 0; (u64)i + 12 <= size; )
     {
         if (*(u32*)&binary[i  ] == 0xBF8DA5ED &&
             *(u32*)&binary[i+4] == 0x69684320 &&
             *(u32*)&binary[i+8] == 0x006D6873)
         {
             printf("DLDI structure found at %08X (%08X)\n", i, offset+i);
+            // the patch can write anywhere in the area reserved for the driver
+            // (BSS clearing, read-only stubs), not just over its own length
+            u8 reservedshift = binary[i+0x0F];
+            if ((u64)i + patchlen > size || reservedshift >= 32 ||
+                (u64)i + (1ULL << reservedshift) > size)
+            {
+                printf("DLDI driver area runs past the end of the binary, not patching\n");
+                break;
+            }
+
             ApplyDLDIPatchAt(binary, i, patch, patchlen, readonly);
             i += patchlen;
         }
@@ -1428,15 +1529,142 @@ void CartHomebrew::ReadROM_B7(u32 addr, u32 len, u8* data, u32 offset)
 
     addr &= (ROMLength-1);
 
+    WaitForROM(addr+len);
     memcpy(data+offset, ROM+addr, len);
 }
 
 
 
+bool AllocROM(u32 romlen)
+{
+    CartROMSize = 0x200;
+    while (CartROMSize < romlen)
+        CartROMSize <<= 1;
+
+    try
+    {
+        CartROM = new u8[CartROMSize];
+    }
+    catch (const std::bad_alloc& e)
+    {
+        printf("NDSCart: failed to allocate memory for ROM (%d bytes)\n", CartROMSize);
+        return false;
+    }
+
+    CartROMMapped = false;
+    memset(CartROM, 0, CartROMSize);
+    return true;
+}
+
+bool MapROM(FILE* romfile, u32 romlen)
+{
+#if !defined(_WIN32) && !defined(__SWITCH__)
+    CartROMSize = 0x200;
+    while (CartROMSize < romlen)
+        CartROMSize <<= 1;
+
+    // reserve the whole power-of-two range as zero pages, then put the file over the start of it
+    // the mapping is read-only and backed by the page cache, so every instance running the same
+    // ROM shares the same physical pages. the regions we patch (secure area, DLDI) are made
+    // writable with MakeROMWritable(), which turns them into private copy-on-write pages
+    //
+    // the pages that weren't made writable stay a live view of the file: if it's rewritten
+    // while the ROM runs, the cart changes under the game, and reading past a truncated end
+    // kills the process with SIGBUS. that's why homebrew (which tends to be rebuilt in place)
+    // isn't mapped, and why mapping can be turned off altogether (see LoadROMStream())
+    struct stat st;
+    if (fstat(fileno(romfile), &st) != 0 || !S_ISREG(st.st_mode) || (u64)st.st_size < romlen)
+        return false;
+
+    u8* base = (u8*)mmap(nullptr, CartROMSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return false;
+
+    if (mmap(base, romlen, PROT_READ, MAP_PRIVATE | MAP_FIXED, fileno(romfile), 0) == MAP_FAILED)
+    {
+        munmap(base, CartROMSize);
+        return false;
+    }
+
+    CartROM = base;
+    CartROMMapped = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void MakeROMWritable(u8* start, u32 len)
+{
+#if !defined(_WIN32) && !defined(__SWITCH__)
+    if (!CartROMMapped || !len) return;
+
+    uintptr_t pagemask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t pagestart = (uintptr_t)start & ~pagemask;
+    uintptr_t pageend = ((uintptr_t)start + len + pagemask) & ~pagemask;
+
+    if (mprotect((void*)pagestart, pageend - pagestart, PROT_READ | PROT_WRITE) != 0)
+        printf("NDSCart: failed to unprotect ROM range %08X-%08X\n",
+               (u32)(pagestart - (uintptr_t)CartROM), (u32)(pageend - (uintptr_t)CartROM));
+#endif
+}
+
+void WaitForROM(u32 end)
+{
+    if (end <= CartROMReady.load(std::memory_order_acquire))
+        return;
+
+    // the writer posts the semaphore every time it makes progress
+    while (end > CartROMReady.load(std::memory_order_acquire))
+        Platform::Semaphore_Wait(CartROMSignal);
+
+    // the data isn't there and never will be, don't keep running on garbage
+    if (CartROMStreamFailed.exchange(false))
+    {
+        printf("NDSCart: ROM data at %08X is missing, stopping\n", end);
+        NDS::Stop();
+    }
+}
+
+void UpdateROMStream(u32 readylen)
+{
+    // once the whole file is in, the padding past it can be read too
+    if (readylen >= CartROMStreamLen)
+        readylen = 0xFFFFFFFF;
+
+    CartROMReady.store(readylen, std::memory_order_release);
+    Platform::Semaphore_Post(CartROMSignal);
+}
+
+void AbortROMStream()
+{
+    CartROMStreamFailed = true;
+    CartROMReady.store(0xFFFFFFFF, std::memory_order_release);
+    Platform::Semaphore_Post(CartROMSignal);
+}
+
+void FreeROM()
+{
+    if (!CartROM) return;
+
+#if !defined(_WIN32) && !defined(__SWITCH__)
+    if (CartROMMapped)
+        munmap(CartROM, CartROMSize);
+    else
+#endif
+        delete[] CartROM;
+
+    CartROM = nullptr;
+    CartROMMapped = false;
+}
+
 bool Init()
 {
     CartInserted = false;
     CartROM = nullptr;
+    CartROMMapped = false;
+    CartROMReady = 0xFFFFFFFF;
+    CartROMSignal = Platform::Semaphore_Create();
     Cart = nullptr;
 
     return true;
@@ -1444,12 +1672,17 @@ bool Init()
 
 void DeInit()
 {
-    if (CartROM) delete[] CartROM;
+    FreeROM();
     if (Cart) delete Cart;
+
+    Platform::Semaphore_Free(CartROMSignal);
 }
 
 void Reset()
 {
+    // the BIOS might have changed
+    Key1_FlushCache();
+
     ResetCart();
 }
 
@@ -1556,14 +1789,19 @@ void DecryptSecureArea(u8* out)
                    (u32)Header.GameCode[0];
     u32 arm9base = Header.ARM9ROMOffset;
 
+    if (SecureAreaCached)
+    {
+        memcpy(out, SecureAreaCache, 0x800);
+        return;
+    }
+
     memcpy(out, &CartROM[arm9base], 0x800);
 
     Key1_InitKeycode(false, gamecode, 2, 2);
     Key1_Decrypt((u32*)&out[0]);
 
     Key1_InitKeycode(false, gamecode, 3, 2);
-    for (u32 i = 0; i < 0x800; i += 8)
-        Key1_Decrypt((u32*)&out[i]);
+    Key1_DecryptBlocks((u32*)out, 0x800 / 8);
 
     if (!strncmp((const char*)out, "encryObj", 8))
     {
@@ -1577,33 +1815,19 @@ void DecryptSecureArea(u8* out)
         for (u32 i = 0; i < 0x800; i += 4)
             *(u32*)&out[i] = 0xE7FFDEFF;
     }
+
+    memcpy(SecureAreaCache, out, 0x800);
+    SecureAreaCached = true;
 }
 
-bool LoadROM(const u8* romdata, u32 romlen)
+bool InsertROM(u32 romlen)
 {
-    if (CartInserted)
-        EjectCart();
+    SecureAreaCached = false;
 
     memset(&Header, 0, sizeof(Header));
     memset(&Banner, 0, sizeof(Banner));
 
-    CartROMSize = 0x200;
-    while (CartROMSize < romlen)
-        CartROMSize <<= 1;
-
-    try
-    {
-        CartROM = new u8[CartROMSize];
-    }
-    catch (const std::bad_alloc& e)
-    {
-        printf("NDSCart: failed to allocate memory for ROM (%d bytes)\n", CartROMSize);
-        return false;
-    }
-
-    memset(CartROM, 0, CartROMSize);
-    memcpy(CartROM, romdata, romlen);
-
+    WaitForROM(sizeof(Header));
     memcpy(&Header, CartROM, sizeof(Header));
 
     u8 unitcode = Header.UnitCode;
@@ -1612,6 +1836,7 @@ bool LoadROM(const u8* romdata, u32 romlen)
     size_t bannersize = dsi ? 0x23C0 : 0xA40;
     if (Header.BannerOffset >= 0x200 && Header.BannerOffset < (CartROMSize - bannersize))
     {
+        WaitForROM(Header.BannerOffset + bannersize);
         memcpy(&Banner, CartROM + Header.BannerOffset, bannersize);
     }
 
@@ -1670,16 +1895,25 @@ bool LoadROM(const u8* romdata, u32 romlen)
 
     if (arm9base >= 0x4000 && arm9base < 0x8000)
     {
+        WaitForROM(arm9base + 0x800);
+
         // reencrypt secure area if needed
         if (*(u32*)&CartROM[arm9base] == 0xE7FFDEFF && *(u32*)&CartROM[arm9base+0x10] != 0xE7FFDEFF)
         {
             printf("Re-encrypting cart secure area\n");
 
+            MakeROMWritable(&CartROM[arm9base], 0x800);
+
+            // we already know what decrypting it will give
+            memcpy(SecureAreaCache, &CartROM[arm9base], 0x800);
+            *(u32*)&SecureAreaCache[0] = 0xE7FFDEFF;
+            *(u32*)&SecureAreaCache[4] = 0xE7FFDEFF;
+            SecureAreaCached = true;
+
             strncpy((char*)&CartROM[arm9base], "encryObj", 8);
 
             Key1_InitKeycode(false, gamecode, 3, 2);
-            for (u32 i = 0; i < 0x800; i += 8)
-                Key1_Encrypt((u32*)&CartROM[arm9base + i]);
+            Key1_EncryptBlocks((u32*)&CartROM[arm9base], 0x800 / 8);
 
             Key1_InitKeycode(false, gamecode, 2, 2);
             Key1_Encrypt((u32*)&CartROM[arm9base]);
@@ -1718,6 +1952,79 @@ bool LoadROM(const u8* romdata, u32 romlen)
     return true;
 }
 
+bool LoadROM(const u8* romdata, u32 romlen)
+{
+    if (CartInserted)
+        EjectCart();
+
+    if (!AllocROM(romlen))
+        return false;
+
+    CartROMReady = 0xFFFFFFFF;
+    memcpy(CartROM, romdata, romlen);
+
+    return InsertROM(romlen);
+}
+
+bool LoadROM(FILE* romfile, u32 romlen)
+{
+    return LoadROMStream(romfile, romlen, 0xFFFFFFFF);
+}
+
+bool LoadROMStream(FILE* romfile, u32 romlen, u32 readylen)
+{
+    if (CartInserted)
+        EjectCart();
+
+    Platform::Semaphore_Reset(CartROMSignal);
+    CartROMStreamFailed = false;
+    CartROMStreamLen = romlen;
+    CartROMReady = (readylen >= romlen) ? 0xFFFFFFFF : readylen;
+
+    // a ROM that's still being streamed in is our own temporary file, it has to be mapped.
+    // otherwise the file belongs to the user and could be rewritten while it's mapped,
+    // so it's only mapped if that's enabled, and never for homebrew
+    bool map = true;
+    if (CartROMReady >= romlen)
+    {
+        map = Platform::GetConfigBool(Platform::MapROMFiles);
+
+        u32 header[0x24/4];
+        fseek(romfile, 0, SEEK_SET);
+        if (map && fread(header, sizeof(header), 1, romfile) == 1)
+        {
+            u32 gamecode = header[0x0C/4];
+            u32 arm9base = header[0x20/4];
+            if ((arm9base < 0x4000) || (gamecode == 0x23232323))
+                map = false;
+        }
+    }
+
+    if (!map || !MapROM(romfile, romlen))
+    {
+        // not mapping, no mmap on this platform, or the mapping failed: read the whole thing in
+        // which can't be done before it has been fully written
+        if (CartROMReady < romlen)
+        {
+            printf("NDSCart: can't stream ROM without mapping it\n");
+            return false;
+        }
+
+        if (!AllocROM(romlen))
+            return false;
+
+        fseek(romfile, 0, SEEK_SET);
+        if (fread(CartROM, romlen, 1, romfile) != 1)
+        {
+            printf("NDSCart: failed to read ROM\n");
+            FreeROM();
+            return false;
+        }
+    }
+
+    return InsertROM(romlen);
+}
+
 void LoadSave(const u8* savedata, u32 savelen)
 {
     if (Cart)
@@ -1742,8 +2049,7 @@ void EjectCart()
     Cart = nullptr;
 
     CartInserted = false;
-    if (CartROM) delete[] CartROM;
-    CartROM = nullptr;
+    FreeROM();
     CartROMSize = 0;
     CartID = 0;
 
@@ -220,6 +220,15 @@ void DoSavestate(Savestate* file);
 void DecryptSecureArea(u8* out);
 
 bool LoadROM(const u8* romdata, u32 romlen);
+// maps the ROM file directly when the platform allows it, the file can be closed afterwards
+bool LoadROM(FILE* romfile, u32 romlen);
+// same, for a ROM file that is still being written by another thread
+// only the first 'readylen' bytes are there yet, cart reads past that block until
+// UpdateROMStream() reports enough progress
+bool LoadROMStream(FILE* romfile, u32 romlen, u32 readylen);
+void UpdateROMStream(u32 readylen);
+// the rest of the ROM won't come: blocked readers are released and emulation is stopped
+void AbortROMStream();
 void LoadSave(const u8* savedata, u32 savelen);
 void SetupDirectBoot(std::string romname);
 
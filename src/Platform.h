@@ -58,6 +58,7 @@ enum ConfigEntry
     DSi_BIOS7Path,
     DSi_FirmwarePath,
     DSi_NANDPath,
+    DSi_NANDCacheSize,
 
     DLDI_Enable,
     DLDI_ImagePath,
@@ -73,6 +74,10 @@ enum ConfigEntry
     DSiSD_FolderSync,
     DSiSD_FolderPath,
 
+    DSi_DSPThreaded,
+
+    MapROMFiles,
+
     Firm_OverrideSettings,
     Firm_Username,
     Firm_Language,
@@ -170,6 +175,9 @@ int MP_SendReply(u8* data, int len, u64 timestamp, u16 aid);
 int MP_SendAck(u8* data, int len, u64 timestamp);
 int MP_RecvHostPacket(u8* data, u64* timestamp);
 u16 MP_RecvReplies(u8* data, u64 timestamp, u16 aidmask);
+// called with the current Wifi microsecond timestamp as emulated time goes by
+// (while Wifi is powered on), so that instances can be kept in step
+void MP_AdvanceTime(u64 timestamp);
 
 
 // LAN comm interface
@@ -19,11 +19,20 @@
 #include <stdio.h>
 #include <string.h>
 #include <cmath>
+#include <atomic>
 #include "Platform.h"
 #include "NDS.h"
 #include "DSi.h"
 #include "SPU.h"
 
+#if defined(__SSE2__)
+#define SPU_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define SPU_NEON
+#include <arm_neon.h>
+#endif
+
 
 // SPU TODO
 // * capture addition modes, overflow bugs
@@ -72,11 +81,22 @@ const u32 OutputBufferSize = 2*2048;
 s16 OutputBackbuffer[2 * OutputBufferSize];
 u32 OutputBackbufferWritePosition;
 
+// the front buffer is a lock-free ring between the emulator thread (producer)
+// and the audio output callback (consumer)
+// the positions are free-running sample counts, and each of them is only
+// written by its own side. the producer can't touch the read position, so
+// it asks the consumer to skip ahead to a given position through
+// OutputFrontBufferDropTo. that position is taken when the request is made, so
+// samples written after it are kept
 s16 OutputFrontBuffer[2 * OutputBufferSize];
-u32 OutputFrontBufferWritePosition;
-u32 OutputFrontBufferReadPosition;
+std::atomic_uint32_t OutputFrontBufferWritePosition;
+std::atomic_uint32_t OutputFrontBufferReadPosition;
+
+std::atomic_uint32_t OutputFrontBufferDropTo;
+std::atomic_bool OutputFrontBufferDrop;
 
-Platform::Mutex* AudioLock;
+std::atomic_uint32_t OutputUnderruns;
+std::atomic_uint32_t OutputOverruns;
 
 u16 Cnt;
 u8 MasterVolume;
@@ -87,6 +107,18 @@ bool Degrade10Bit;
 Channel* Channels[16];
 CaptureUnit* Capture[2];
 
+// samples are mixed in batches rather than one by one: the mixer is caught up
+// whenever the sound registers are accessed, and otherwise every MixBatchSize samples
+//
+// a batch is cut short at the first sample that accesses memory (a channel refilling
+// its FIFO, or any sample while sound capture is on), so those samples are still mixed
+// at the time they're due and see the sound buffers as they would one by one.
+// the samples before it only read the channel FIFOs, which aren't visible to the CPU.
+const u32 SampleCycles = 1024; // 1 sample every 1024 cycles at 33MHz
+u32 MixBatchSize = 16;
+const u32 MixBlockSize = 32; // max. samples mixed in one go
+u64 SampleTimestamp; // time of the next sample to be mixed
+
 
 bool Init()
 {
@@ -96,8 +128,6 @@ bool Init()
     Capture[0] = new CaptureUnit(0);
     Capture[1] = new CaptureUnit(1);
 
-    AudioLock = Platform::Mutex_Create();
-
     InterpType = 0;
     ApplyBias = true;
     Degrade10Bit = false;
@@ -136,8 +166,6 @@ void DeInit()
 
     delete Capture[0];
     delete Capture[1];
-
-    Platform::Mutex_Free(AudioLock);
 }
 
 void Reset()
@@ -154,18 +182,20 @@ void Reset()
     Capture[0]->Reset();
     Capture[1]->Reset();
 
-    NDS::ScheduleEvent(NDS::Event_SPU, true, 1024, Mix, 0);
+    SampleTimestamp = NDS::SysTimestamp + SampleCycles;
+    ScheduleMix();
 }
 
-void Stop()
+void SetMixBatchSize(u32 size)
 {
-    Platform::Mutex_Lock(AudioLock);
-    memset(OutputFrontBuffer, 0, 2*OutputBufferSize*2);
+    MixBatchSize = size;
+    ScheduleMix();
+}
 
+void Stop()
+{
     OutputBackbufferWritePosition = 0;
-    OutputFrontBufferReadPosition = 0;
-    OutputFrontBufferWritePosition = 0;
-    Platform::Mutex_Unlock(AudioLock);
+    DrainOutput();
 }
 
 void DoSavestate(Savestate* file)
@@ -175,6 +205,7 @@ void DoSavestate(Savestate* file)
     file->Var16(&Cnt);
     file->Var8(&MasterVolume);
     file->Var16(&Bias);
+    file->Var64(&SampleTimestamp);
 
     for (int i = 0; i < 16; i++)
         Channels[i]->DoSavestate(file);
@@ -211,6 +242,127 @@ void SetDegrade10Bit(bool enable)
 }
 
 
+// block processing helpers
+// channels generate a block of samples at once: timer and decoding are
+// inherently serial, but interpolation, volume and panning are applied
+// to the whole block, using SIMD where available
+//
+// all of these give the exact same results as the per-sample math
+
+// out[i] = (smp[2i]*wgt[2i] + smp[2i+1]*wgt[2i+1] (+ same for smp2/wgt2)) >> shift
+void InterpolateBlock(s32* out, const s16* smp, const s16* wgt, const s16* smp2, const s16* wgt2, u32 count, int shift)
+{
+    u32 i = 0;
+#if defined(SPU_SSE2)
+    const __m128i vshift = _mm_cvtsi32_si128(shift);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i sum = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)&smp[i*2]),
+                                     _mm_loadu_si128((const __m128i*)&wgt[i*2]));
+        if (smp2)
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)&smp2[i*2]),
+                                                    _mm_loadu_si128((const __m128i*)&wgt2[i*2])));
+        _mm_storeu_si128((__m128i*)&out[i], _mm_sra_epi32(sum, vshift));
+    }
+#elif defined(SPU_NEON)
+    const int32x4_t vshift = vdupq_n_s32(-shift);
+    for (; i + 4 <= count; i += 4)
+    {
+        int16x8_t s = vld1q_s16(&smp[i*2]);
+        int16x8_t w = vld1q_s16(&wgt[i*2]);
+        int32x4_t sum = vpaddq_s32(vmull_s16(vget_low_s16(s), vget_low_s16(w)),
+                                   vmull_high_s16(s, w));
+        if (smp2)
+        {
+            s = vld1q_s16(&smp2[i*2]);
+            w = vld1q_s16(&wgt2[i*2]);
+            sum = vaddq_s32(sum, vpaddq_s32(vmull_s16(vget_low_s16(s), vget_low_s16(w)),
+                                            vmull_high_s16(s, w)));
+        }
+        vst1q_s32(&out[i], vshlq_s32(sum, vshift));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        s32 sum = (smp[i*2] * wgt[i*2]) + (smp[i*2 + 1] * wgt[i*2 + 1]);
+        if (smp2)
+            sum += (smp2[i*2] * wgt2[i*2]) + (smp2[i*2 + 1] * wgt2[i*2 + 1]);
+        out[i] = sum >> shift;
+    }
+}
+
+#if defined(SPU_SSE2)
+inline __m128i MulLo32(__m128i a, __m128i b)
+{
+    // SSE2 lacks pmulld, but the low 32 bits of the product don't depend on the signedness
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0,0,2,0)));
+}
+#endif
+
+// data[i] = (data[i] << shift) * volume
+void VolumeBlock(s32* data, u32 count, u32 shift, u32 volume)
+{
+    u32 i = 0;
+#if defined(SPU_SSE2)
+    const __m128i vshift = _mm_cvtsi32_si128(shift);
+    const __m128i vvol = _mm_set1_epi32(volume);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i val = _mm_sll_epi32(_mm_loadu_si128((const __m128i*)&data[i]), vshift);
+        _mm_storeu_si128((__m128i*)&data[i], MulLo32(val, vvol));
+    }
+#elif defined(SPU_NEON)
+    const int32x4_t vshift = vdupq_n_s32(shift);
+    for (; i + 4 <= count; i += 4)
+    {
+        int32x4_t val = vshlq_s32(vld1q_s32(&data[i]), vshift);
+        vst1q_s32(&data[i], vmulq_n_s32(val, volume));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        s32 val = data[i];
+        val <<= shift;
+        val *= volume;
+        data[i] = val;
+    }
+}
+
+// out[i] += ((s64)in[i] * pan) >> 10
+// done as ((in >> 10) * pan) + (((in & 0x3FF) * pan) >> 10), which gives the
+// same result without needing 64-bit math
+void PanAccumulate(const s32* in, s32* out, u32 pan, u32 count)
+{
+    u32 i = 0;
+#if defined(SPU_SSE2)
+    const __m128i vpan = _mm_set1_epi32(pan);
+    const __m128i vmask = _mm_set1_epi32(0x3FF);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i val = _mm_loadu_si128((const __m128i*)&in[i]);
+        __m128i hi = MulLo32(_mm_srai_epi32(val, 10), vpan);
+        __m128i lo = _mm_srli_epi32(MulLo32(_mm_and_si128(val, vmask), vpan), 10);
+        __m128i acc = _mm_loadu_si128((const __m128i*)&out[i]);
+        _mm_storeu_si128((__m128i*)&out[i], _mm_add_epi32(acc, _mm_add_epi32(hi, lo)));
+    }
+#elif defined(SPU_NEON)
+    const int32x4_t vmask = vdupq_n_s32(0x3FF);
+    for (; i + 4 <= count; i += 4)
+    {
+        int32x4_t val = vld1q_s32(&in[i]);
+        int32x4_t hi = vmulq_n_s32(vshrq_n_s32(val, 10), pan);
+        int32x4_t lo = vshrq_n_s32(vmulq_n_s32(vandq_s32(val, vmask), pan), 10);
+        vst1q_s32(&out[i], vaddq_s32(vld1q_s32(&out[i]), vaddq_s32(hi, lo)));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] += ((s64)in[i] * pan) >> 10;
+}
+
+
 Channel::Channel(u32 num)
 {
     Num = num;
@@ -316,6 +468,44 @@ void Channel::FIFO_BufferData()
     FIFOLevel += burstlen;
 }
 
+u32 Channel::NextRefill(u32 max)
+{
+    u32 type = (Cnt >> 29) & 0x3;
+    if (!(Cnt & (1<<31)) || type == 3 || (LoopPos + Length) < 16)
+        return max;
+
+    // starting the channel fills the FIFO
+    if (KeyOn)
+        return 0;
+
+    // runs the channel timer ahead, counting what each sample step takes out of the FIFO:
+    // PCM8 and PCM16 take a whole sample, ADPCM at most one byte, or 4 for the header.
+    // this can only overestimate what is taken, so the refill is never before the sample found here
+    u32 size = (type == 1) ? 2 : 1;
+    u32 level = FIFOLevel;
+    u32 timer = Timer;
+    s32 pos = Pos;
+
+    for (u32 n = 0; n < max; n++)
+    {
+        timer += 512;
+
+        while (timer >> 16)
+        {
+            timer = TimerReload + (timer - 0x10000);
+
+            pos++;
+            u32 len = ((type == 2) && (pos == 0)) ? 4 : size;
+            if (level <= (len + 16))
+                return n;
+
+            level -= len;
+        }
+    }
+
+    return max;
+}
+
 template<typename T>
 T Channel::FIFO_ReadData()
 {
@@ -501,85 +691,136 @@ void Channel::NextSample_Noise()
 }
 
 template<u32 type>
-s32 Channel::Run()
+u32 Channel::RunBlock(s32* out, u32 count)
 {
-    if (!(Cnt & (1<<31))) return 0;
+    // samples for the interpolation, as (sample, weight) pairs
+    s16 interpsmp[MixBlockSize * 2], interpwgt[MixBlockSize * 2];
+    s16 interpsmp2[MixBlockSize * 2], interpwgt2[MixBlockSize * 2];
 
-    if ((type < 3) && ((Length+LoopPos) < 16)) return 0;
+    const bool interp = (type < 3) && (InterpType != 0);
+    const int interptype = InterpType;
 
-    if (KeyOn)
+    u32 n = 0;
+    if ((type < 3) && ((Length+LoopPos) < 16))
     {
-        Start();
-        KeyOn = false;
+        // nothing to play
     }
+    else
+    {
+        for (; n < count; n++)
+        {
+            // one-shot sounds can end in the middle of the block
+            if (!(Cnt & (1<<31))) break;
 
-    Timer += 512; // 1 sample = 512 cycles at 16MHz
+            if (KeyOn)
+            {
+                Start();
+                KeyOn = false;
+            }
 
-    while (Timer >> 16)
-    {
-        Timer = TimerReload + (Timer - 0x10000);
+            Timer += 512; // 1 sample = 512 cycles at 16MHz
 
-        // for optional interpolation: save previous samples
-        // the interpolated audio will be delayed by a couple samples,
-        // but it's easier to deal with this way
-        if ((type < 3) && (InterpType != 0))
-        {
-            PrevSample[2] = PrevSample[1];
-            PrevSample[1] = PrevSample[0];
-            PrevSample[0] = CurSample;
+            while (Timer >> 16)
+            {
+                Timer = TimerReload + (Timer - 0x10000);
+
+                // for optional interpolation: save previous samples
+                // the interpolated audio will be delayed by a couple samples,
+                // but it's easier to deal with this way
+                if (interp)
+                {
+                    PrevSample[2] = PrevSample[1];
+                    PrevSample[1] = PrevSample[0];
+                    PrevSample[0] = CurSample;
+                }
+
+                switch (type)
+                {
+                case 0: NextSample_PCM8(); break;
+                case 1: NextSample_PCM16(); break;
+                case 2: NextSample_ADPCM(); break;
+                case 3: NextSample_PSG(); break;
+                case 4: NextSample_Noise(); break;
+                }
+            }
+
+            if (!interp)
+            {
+                out[n] = (s32)CurSample;
+                continue;
+            }
+
+            // interpolation (emulation improvement, not a hardware feature)
+            // the actual math is done on the whole block at once, below
+            s32 samplepos = ((Timer - TimerReload) * 0x100) / (0x10000 - TimerReload);
+            if (samplepos > 0xFF) samplepos = 0xFF;
+
+            switch (interptype)
+            {
+            case 1: // linear
+                interpsmp[n*2    ] = CurSample;     interpwgt[n*2    ] = samplepos;
+                interpsmp[n*2 + 1] = PrevSample[0]; interpwgt[n*2 + 1] = 0xFF-samplepos;
+                break;
+
+            case 2: // cosine
+                interpsmp[n*2    ] = CurSample;     interpwgt[n*2    ] = InterpCos[samplepos];
+                interpsmp[n*2 + 1] = PrevSample[0]; interpwgt[n*2 + 1] = InterpCos[0xFF-samplepos];
+                break;
+
+            case 3: // cubic
+                interpsmp[n*2    ] = PrevSample[2]; interpwgt[n*2    ] = InterpCubic[samplepos][0];
+                interpsmp[n*2 + 1] = PrevSample[1]; interpwgt[n*2 + 1] = InterpCubic[samplepos][1];
+                interpsmp2[n*2    ] = PrevSample[0]; interpwgt2[n*2    ] = InterpCubic[samplepos][2];
+                interpsmp2[n*2 + 1] = CurSample;     interpwgt2[n*2 + 1] = InterpCubic[samplepos][3];
+                break;
+            }
         }
+    }
 
-        switch (type)
+    if (interp)
+    {
+        switch (interptype)
         {
-        case 0: NextSample_PCM8(); break;
-        case 1: NextSample_PCM16(); break;
-        case 2: NextSample_ADPCM(); break;
-        case 3: NextSample_PSG(); break;
-        case 4: NextSample_Noise(); break;
+        case 1: InterpolateBlock(out, interpsmp, interpwgt, nullptr, nullptr, n, 8); break;
+        case 2: InterpolateBlock(out, interpsmp, interpwgt, nullptr, nullptr, n, 14); break;
+        case 3: InterpolateBlock(out, interpsmp, interpwgt, interpsmp2, interpwgt2, n, 14); break;
         }
     }
 
-    s32 val = (s32)CurSample;
+    VolumeBlock(out, n, VolumeShift, Volume);
 
-    // interpolation (emulation improvement, not a hardware feature)
-    if ((type < 3) && (InterpType != 0))
-    {
-        s32 samplepos = ((Timer - TimerReload) * 0x100) / (0x10000 - TimerReload);
-        if (samplepos > 0xFF) samplepos = 0xFF;
+    for (u32 i = n; i < count; i++)
+        out[i] = 0;
 
-        switch (InterpType)
-        {
-        case 1: // linear
-            val = ((val           * samplepos) +
-                   (PrevSample[0] * (0xFF-samplepos))) >> 8;
-            break;
-
-        case 2: // cosine
-            val = ((val           * InterpCos[samplepos]) +
-                   (PrevSample[0] * InterpCos[0xFF-samplepos])) >> 14;
-            break;
+    return n;
+}
 
-        case 3: // cubic
-            val = ((PrevSample[2] * InterpCubic[samplepos][0]) +
-                   (PrevSample[1] * InterpCubic[samplepos][1]) +
-                   (PrevSample[0] * InterpCubic[samplepos][2]) +
-                   (val           * InterpCubic[samplepos][3])) >> 14;
-            break;
-        }
+u32 Channel::DoRunBlock(s32* out, u32 count)
+{
+    switch ((Cnt >> 29) & 0x3)
+    {
+    case 0: return RunBlock<0>(out, count);
+    case 1: return RunBlock<1>(out, count);
+    case 2: return RunBlock<2>(out, count);
+    case 3:
+        if (Num >= 14)
+            return RunBlock<4>(out, count);
+        else if (Num >= 8)
+            return RunBlock<3>(out, count);
+        break;
     }
 
-    val <<= VolumeShift;
-    val *= Volume;
-    return val;
+    for (u32 i = 0; i < count; i++)
+        out[i] = 0;
+    return 0;
 }
 
-void Channel::PanOutput(s32 in, s32& left, s32& right)
+void Channel::PanBlock(const s32* in, s32* left, s32* right, u32 count)
 {
-    left += ((s64)in * (128-Pan)) >> 10;
-    right += ((s64)in * Pan) >> 10;
+    PanAccumulate(in, left, 128-Pan, count);
+    PanAccumulate(in, right, Pan, count);
 }
 
-
 CaptureUnit::CaptureUnit(u32 num)
 {
     Num = num;
@@ -712,220 +953,300 @@ void CaptureUnit::Run(s32 sample)
 }
 
 
-void Mix(u32 dummy)
+void MixBlock(u32 count)
 {
-    s32 left = 0, right = 0;
-    s32 leftoutput = 0, rightoutput = 0;
+    s32 left[MixBlockSize], right[MixBlockSize];
+    s32 ch1[MixBlockSize], ch3[MixBlockSize];
+    s32 chbuf[MixBlockSize];
 
     if (Cnt & (1<<15))
     {
-        s32 ch0 = Channels[0]->DoRun();
-        s32 ch1 = Channels[1]->DoRun();
-        s32 ch2 = Channels[2]->DoRun();
-        s32 ch3 = Channels[3]->DoRun();
+        memset(left, 0, count*4);
+        memset(right, 0, count*4);
 
-        // TODO: addition from capture registers
-        Channels[0]->PanOutput(ch0, left, right);
-        Channels[2]->PanOutput(ch2, left, right);
+        u32 n0 = Channels[0]->DoRunBlock(chbuf, count);
+        Channels[0]->PanBlock(chbuf, left, right, n0);
+
+        u32 n1 = Channels[1]->DoRunBlock(ch1, count);
 
-        if (!(Cnt & (1<<12))) Channels[1]->PanOutput(ch1, left, right);
-        if (!(Cnt & (1<<13))) Channels[3]->PanOutput(ch3, left, right);
+        n0 = Channels[2]->DoRunBlock(chbuf, count);
+        Channels[2]->PanBlock(chbuf, left, right, n0);
+
+        u32 n3 = Channels[3]->DoRunBlock(ch3, count);
+
+        // TODO: addition from capture registers
+        if (!(Cnt & (1<<12))) Channels[1]->PanBlock(ch1, left, right, n1);
+        if (!(Cnt & (1<<13))) Channels[3]->PanBlock(ch3, left, right, n3);
 
         for (int i = 4; i < 16; i++)
         {
             Channel* chan = Channels[i];
 
-            s32 channel = chan->DoRun();
-            chan->PanOutput(channel, left, right);
+            u32 n = chan->DoRunBlock(chbuf, count);
+            chan->PanBlock(chbuf, left, right, n);
         }
+    }
 
-        // sound capture
-        // TODO: other sound capture sources, along with their bugs
+    for (u32 i = 0; i < count; i++)
+    {
+        s32 leftoutput = 0, rightoutput = 0;
 
-        if (Capture[0]->Cnt & (1<<7))
+        if (Cnt & (1<<15))
         {
-            s32 val = left;
-
-            val >>= 8;
-            if      (val < -0x8000) val = -0x8000;
-            else if (val > 0x7FFF)  val = 0x7FFF;
+            // sound capture
+            // TODO: other sound capture sources, along with their bugs
 
-            Capture[0]->Run(val);
-        }
+            if (Capture[0]->Cnt & (1<<7))
+            {
+                s32 val = left[i];
 
-        if (Capture[1]->Cnt & (1<<7))
-        {
-            s32 val = right;
+                val >>= 8;
+                if      (val < -0x8000) val = -0x8000;
+                else if (val > 0x7FFF)  val = 0x7FFF;
 
-            val >>= 8;
-            if      (val < -0x8000) val = -0x8000;
-            else if (val > 0x7FFF)  val = 0x7FFF;
+                Capture[0]->Run(val);
+            }
 
-            Capture[1]->Run(val);
-        }
+            if (Capture[1]->Cnt & (1<<7))
+            {
+                s32 val = right[i];
 
-        // final output
+                val >>= 8;
+                if      (val < -0x8000) val = -0x8000;
+                else if (val > 0x7FFF)  val = 0x7FFF;
 
-        switch (Cnt & 0x0300)
-        {
-        case 0x0000: // left mixer
-            leftoutput = left;
-            break;
-        case 0x0100: // channel 1
-            {
-                s32 pan = 128 - Channels[1]->Pan;
-                leftoutput = ((s64)ch1 * pan) >> 10;
+                Capture[1]->Run(val);
             }
-            break;
-        case 0x0200: // channel 3
+
+            // final output
+
+            switch (Cnt & 0x0300)
             {
-                s32 pan = 128 - Channels[3]->Pan;
-                leftoutput = ((s64)ch3 * pan) >> 10;
+            case 0x0000: // left mixer
+                leftoutput = left[i];
+                break;
+            case 0x0100: // channel 1
+                {
+                    s32 pan = 128 - Channels[1]->Pan;
+                    leftoutput = ((s64)ch1[i] * pan) >> 10;
+                }
+                break;
+            case 0x0200: // channel 3
+                {
+                    s32 pan = 128 - Channels[3]->Pan;
+                    leftoutput = ((s64)ch3[i] * pan) >> 10;
+                }
+                break;
+            case 0x0300: // channel 1+3
+                {
+                    s32 pan1 = 128 - Channels[1]->Pan;
+                    s32 pan3 = 128 - Channels[3]->Pan;
+                    leftoutput = (((s64)ch1[i] * pan1) >> 10) + (((s64)ch3[i] * pan3) >> 10);
+                }
+                break;
             }
-            break;
-        case 0x0300: // channel 1+3
+
+            switch (Cnt & 0x0C00)
             {
-                s32 pan1 = 128 - Channels[1]->Pan;
-                s32 pan3 = 128 - Channels[3]->Pan;
-                leftoutput = (((s64)ch1 * pan1) >> 10) + (((s64)ch3 * pan3) >> 10);
+            case 0x0000: // right mixer
+                rightoutput = right[i];
+                break;
+            case 0x0400: // channel 1
+                {
+                    s32 pan = Channels[1]->Pan;
+                    rightoutput = ((s64)ch1[i] * pan) >> 10;
+                }
+                break;
+            case 0x0800: // channel 3
+                {
+                    s32 pan = Channels[3]->Pan;
+                    rightoutput = ((s64)ch3[i] * pan) >> 10;
+                }
+                break;
+            case 0x0C00: // channel 1+3
+                {
+                    s32 pan1 = Channels[1]->Pan;
+                    s32 pan3 = Channels[3]->Pan;
+                    rightoutput = (((s64)ch1[i] * pan1) >> 10) + (((s64)ch3[i] * pan3) >> 10);
+                }
+                break;
             }
-            break;
         }
 
-        switch (Cnt & 0x0C00)
+
+        leftoutput = ((s64)leftoutput * MasterVolume) >> 7;
+        rightoutput = ((s64)rightoutput * MasterVolume) >> 7;
+
+        leftoutput >>= 8;
+        rightoutput >>= 8;
+
+        // Add SOUNDBIAS value
+        // The value used by all commercial games is 0x200, so we subtract that so it won't offset the final sound output.
+        if (ApplyBias)
         {
-        case 0x0000: // right mixer
-            rightoutput = right;
-            break;
-        case 0x0400: // channel 1
-            {
-                s32 pan = Channels[1]->Pan;
-                rightoutput = ((s64)ch1 * pan) >> 10;
-            }
-            break;
-        case 0x0800: // channel 3
-            {
-                s32 pan = Channels[3]->Pan;
-                rightoutput = ((s64)ch3 * pan) >> 10;
-            }
-            break;
-        case 0x0C00: // channel 1+3
-            {
-                s32 pan1 = Channels[1]->Pan;
-                s32 pan3 = Channels[3]->Pan;
-                rightoutput = (((s64)ch1 * pan1) >> 10) + (((s64)ch3 * pan3) >> 10);
-            }
-            break;
+            leftoutput += (Bias << 6) - 0x8000;
+            rightoutput += (Bias << 6) - 0x8000;
         }
-    }
 
-    leftoutput = ((s64)leftoutput * MasterVolume) >> 7;
-    rightoutput = ((s64)rightoutput * MasterVolume) >> 7;
+        if      (leftoutput < -0x8000) leftoutput = -0x8000;
+        else if (leftoutput > 0x7FFF)  leftoutput = 0x7FFF;
+        if      (rightoutput < -0x8000) rightoutput = -0x8000;
+        else if (rightoutput > 0x7FFF)  rightoutput = 0x7FFF;
 
-    leftoutput >>= 8;
-    rightoutput >>= 8;
+        // The original DS and DS lite degrade the output from 16 to 10 bit before output
+        if (Degrade10Bit)
+        {
+            leftoutput &= 0xFFFFFFC0;
+            rightoutput &= 0xFFFFFFC0;
+        }
 
-    // Add SOUNDBIAS value
-    // The value used by all commercial games is 0x200, so we subtract that so it won't offset the final sound output.
-    if (ApplyBias)
+        // OutputBufferFrame can never get full because it's
+        // transfered to OutputBuffer at the end of the frame
+        OutputBackbuffer[OutputBackbufferWritePosition    ] = leftoutput >> 1;
+        OutputBackbuffer[OutputBackbufferWritePosition + 1] = rightoutput >> 1;
+        OutputBackbufferWritePosition += 2;
+
+    }
+}
+
+void MixUntil(u64 timestamp)
+{
+    while (SampleTimestamp < timestamp)
     {
-        leftoutput += (Bias << 6) - 0x8000;
-        rightoutput += (Bias << 6) - 0x8000;
+        u32 count = (timestamp - SampleTimestamp + SampleCycles - 1) / SampleCycles;
+        if (count > MixBlockSize) count = MixBlockSize;
+
+        // sound capture works sample by sample, and its output can be played back right away
+        if ((Capture[0]->Cnt | Capture[1]->Cnt) & (1<<7))
+            count = 1;
+
+        MixBlock(count);
+        SampleTimestamp += count * SampleCycles;
     }
+}
 
-    if      (leftoutput < -0x8000) leftoutput = -0x8000;
-    else if (leftoutput > 0x7FFF)  leftoutput = 0x7FFF;
-    if      (rightoutput < -0x8000) rightoutput = -0x8000;
-    else if (rightoutput > 0x7FFF)  rightoutput = 0x7FFF;
+void CatchUp()
+{
+    // a register access at a given time is seen by the samples due after that time:
+    // like any event, the mix event for a sample runs before the CPU does anything at that time
+    MixUntil(NDS::ARM7Timestamp + 1);
+}
+
+void ScheduleMix()
+{
+    u32 count = MixBatchSize;
 
-    // The original DS and DS lite degrade the output from 16 to 10 bit before output
-    if (Degrade10Bit)
+    if (Cnt & (1<<15))
     {
-        leftoutput &= 0xFFFFFFC0;
-        rightoutput &= 0xFFFFFFC0;
+        // sound capture writes to memory every sample
+        if ((Capture[0]->Cnt | Capture[1]->Cnt) & (1<<7))
+            count = 1;
+
+        for (int i = 0; i < 16 && count > 1; i++)
+        {
+            u32 n = Channels[i]->NextRefill(count);
+            if (n < count) count = n + 1;
+        }
     }
 
-    // OutputBufferFrame can never get full because it's
-    // transfered to OutputBuffer at the end of the frame
-    OutputBackbuffer[OutputBackbufferWritePosition    ] = leftoutput >> 1;
-    OutputBackbuffer[OutputBackbufferWritePosition + 1] = rightoutput >> 1;
-    OutputBackbufferWritePosition += 2;
+    NDS::CancelEvent(NDS::Event_SPU);
+    NDS::ScheduleEvent(NDS::Event_SPU, SampleTimestamp + (count-1)*SampleCycles, Mix, 0);
+}
+
+void CatchUpWrite()
+{
+    CatchUp();
 
-    NDS::ScheduleEvent(NDS::Event_SPU, true, 1024, Mix, 0);
+    // the write can start a channel or change how it reads memory, so the batch
+    // is redone from the next sample on
+    NDS::CancelEvent(NDS::Event_SPU);
+    NDS::ScheduleEvent(NDS::Event_SPU, SampleTimestamp, Mix, 0);
+}
+
+void Mix(u32 dummy)
+{
+    MixUntil(NDS::SysTimestamp + 1);
+    ScheduleMix();
 }
 
 void TransferOutput()
 {
-    Platform::Mutex_Lock(AudioLock);
-    for (u32 i = 0; i < OutputBackbufferWritePosition; i += 2)
+    // flush the samples that are due by the end of the frame
+    MixUntil(NDS::SysTimestamp + 1);
+
+    u32 writepos = OutputFrontBufferWritePosition.load(std::memory_order_relaxed);
+    u32 readpos = OutputFrontBufferReadPosition.load(std::memory_order_acquire);
+
+    u32 num = OutputBackbufferWritePosition >> 1;
+    u32 space = OutputBufferSize - (writepos - readpos);
+    if (num > space)
     {
-        OutputFrontBuffer[OutputFrontBufferWritePosition    ] = OutputBackbuffer[i   ];
-        OutputFrontBuffer[OutputFrontBufferWritePosition + 1] = OutputBackbuffer[i + 1];
+        // the output isn't keeping up, drop what doesn't fit
+        OutputOverruns.fetch_add(1, std::memory_order_relaxed);
+        num = space;
+    }
 
-        OutputFrontBufferWritePosition += 2;
-        OutputFrontBufferWritePosition &= OutputBufferSize*2-1;
-        if (OutputFrontBufferWritePosition == OutputFrontBufferReadPosition)
-        {
-            // advance the read position too, to avoid losing the entire FIFO
-            OutputFrontBufferReadPosition += 2;
-            OutputFrontBufferReadPosition &= OutputBufferSize*2-1;
-        }
+    for (u32 i = 0; i < num; i++)
+    {
+        u32 pos = ((writepos + i) & (OutputBufferSize-1)) << 1;
+
+        OutputFrontBuffer[pos    ] = OutputBackbuffer[(i << 1)    ];
+        OutputFrontBuffer[pos + 1] = OutputBackbuffer[(i << 1) + 1];
     }
+
+    OutputFrontBufferWritePosition.store(writepos + num, std::memory_order_release);
     OutputBackbufferWritePosition = 0;
-    Platform::Mutex_Unlock(AudioLock);
+}
+
+void DropOutput(u32 keep)
+{
+    // only what was written up to now is dropped
+    u32 writepos = OutputFrontBufferWritePosition.load(std::memory_order_relaxed);
+    OutputFrontBufferDropTo.store(writepos - keep, std::memory_order_relaxed);
+    OutputFrontBufferDrop.store(true, std::memory_order_release);
 }
 
 void TrimOutput()
 {
-    Platform::Mutex_Lock(AudioLock);
     const int halflimit = (OutputBufferSize / 2);
-
-    int readpos = OutputFrontBufferWritePosition - (halflimit*2);
-    if (readpos < 0) readpos += (OutputBufferSize*2);
-
-    OutputFrontBufferReadPosition = readpos;
-    Platform::Mutex_Unlock(AudioLock);
+    DropOutput(halflimit);
 }
 
 void DrainOutput()
 {
-    Platform::Mutex_Lock(AudioLock);
-    OutputFrontBufferWritePosition = 0;
-    OutputFrontBufferReadPosition = 0;
-    Platform::Mutex_Unlock(AudioLock);
+    DropOutput(0);
 }
 
 void InitOutput()
 {
-    Platform::Mutex_Lock(AudioLock);
     memset(OutputBackbuffer, 0, 2*OutputBufferSize*2);
-    memset(OutputFrontBuffer, 0, 2*OutputBufferSize*2);
-    OutputFrontBufferReadPosition = 0;
-    OutputFrontBufferWritePosition = 0;
-    Platform::Mutex_Unlock(AudioLock);
+    DropOutput(0);
+
+    OutputUnderruns = 0;
+    OutputOverruns = 0;
 }
 
 int GetOutputSize()
 {
-    Platform::Mutex_Lock(AudioLock);
+    u32 readpos = OutputFrontBufferReadPosition.load(std::memory_order_acquire);
+    u32 writepos = OutputFrontBufferWritePosition.load(std::memory_order_acquire);
 
-    int ret;
-    if (OutputFrontBufferWritePosition >= OutputFrontBufferReadPosition)
-        ret = OutputFrontBufferWritePosition - OutputFrontBufferReadPosition;
-    else
-        ret = (OutputBufferSize*2) - OutputFrontBufferReadPosition + OutputFrontBufferWritePosition;
+    return (int)(writepos - readpos);
+}
 
-    ret >>= 1;
+u32 GetOutputUnderruns()
+{
+    return OutputUnderruns.load(std::memory_order_relaxed);
+}
 
-    Platform::Mutex_Unlock(AudioLock);
-    return ret;
+u32 GetOutputOverruns()
+{
+    return OutputOverruns.load(std::memory_order_relaxed);
 }
 
 void Sync(bool wait)
 {
     // this function is currently not used anywhere
-    // depending on the usage context the thread safety measures could be made
-    // a lot faster
 
     // sync to audio output in case the core is running too fast
     // * wait=true: wait until enough audio data has been played
@@ -940,48 +1261,47 @@ void Sync(bool wait)
     }
     else if (GetOutputSize() > halflimit)
     {
-        Platform::Mutex_Lock(AudioLock);
-
-        int readpos = OutputFrontBufferWritePosition - (halflimit*2);
-        if (readpos < 0) readpos += (OutputBufferSize*2);
-
-        OutputFrontBufferReadPosition = readpos;
-
-        Platform::Mutex_Unlock(AudioLock);
+        TrimOutput();
     }
 }
 
 int ReadOutput(s16* data, int samples)
 {
-    Platform::Mutex_Lock(AudioLock);
-    if (OutputFrontBufferReadPosition == OutputFrontBufferWritePosition)
+    u32 readpos = OutputFrontBufferReadPosition.load(std::memory_order_relaxed);
+
+    // the drop position is never past the write position seen after this
+    if (OutputFrontBufferDrop.exchange(false, std::memory_order_acquire))
     {
-        Platform::Mutex_Unlock(AudioLock);
-        return 0;
+        u32 dropto = OutputFrontBufferDropTo.load(std::memory_order_relaxed);
+        if ((s32)(dropto - readpos) > 0)
+            readpos = dropto;
     }
 
-    for (int i = 0; i < samples; i++)
-    {
-        *data++ = OutputFrontBuffer[OutputFrontBufferReadPosition];
-        *data++ = OutputFrontBuffer[OutputFrontBufferReadPosition + 1];
+    u32 writepos = OutputFrontBufferWritePosition.load(std::memory_order_acquire);
 
-        OutputFrontBufferReadPosition += 2;
-        OutputFrontBufferReadPosition &= ((2*OutputBufferSize)-1);
+    u32 num = writepos - readpos;
+    if (num < (u32)samples)
+        OutputUnderruns.fetch_add(1, std::memory_order_relaxed);
+    else
+        num = samples;
 
-        if (OutputFrontBufferWritePosition == OutputFrontBufferReadPosition)
-        {
-            Platform::Mutex_Unlock(AudioLock);
-            return i+1;
-        }
+    for (u32 i = 0; i < num; i++)
+    {
+        u32 pos = ((readpos + i) & (OutputBufferSize-1)) << 1;
+
+        *data++ = OutputFrontBuffer[pos    ];
+        *data++ = OutputFrontBuffer[pos + 1];
     }
 
-    Platform::Mutex_Unlock(AudioLock);
-    return samples;
+    OutputFrontBufferReadPosition.store(readpos + num, std::memory_order_release);
+    return num;
 }
 
 
 u8 Read8(u32 addr)
 {
+    CatchUp();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1012,6 +1332,8 @@ u8 Read8(u32 addr)
 
 u16 Read16(u32 addr)
 {
+    CatchUp();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1039,6 +1361,8 @@ u16 Read16(u32 addr)
 
 u32 Read32(u32 addr)
 {
+    CatchUp();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1068,6 +1392,8 @@ u32 Read32(u32 addr)
 
 void Write8(u32 addr, u8 val)
 {
+    CatchUpWrite();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1109,6 +1435,8 @@ void Write8(u32 addr, u8 val)
 
 void Write16(u32 addr, u16 val)
 {
+    CatchUpWrite();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
@@ -1158,6 +1486,8 @@ void Write16(u32 addr, u16 val)
 
 void Write32(u32 addr, u32 val)
 {
+    CatchUpWrite();
+
     if (addr < 0x04000500)
     {
         Channel* chan = Channels[(addr >> 4) & 0xF];
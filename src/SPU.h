@@ -40,12 +40,24 @@ void SetBias(u16 bias);
 void SetDegrade10Bit(bool enable);
 void SetApplyBias(bool enable);
 
+// mixes all the samples due before the given timestamp
+void MixUntil(u64 timestamp);
+void CatchUp();
+void ScheduleMix();
 void Mix(u32 dummy);
 
+// samples mixed at most per batch, 1 mixes every sample at the time it's due
+void SetMixBatchSize(u32 size);
+
 void TrimOutput();
 void DrainOutput();
 void InitOutput();
 int GetOutputSize();
+
+// number of times the output callback asked for more samples than there were,
+// and number of times samples had to be dropped because the output buffer was full
+u32 GetOutputUnderruns();
+u32 GetOutputOverruns();
 void Sync(bool wait);
 int ReadOutput(s16* data, int samples);
 void TransferOutput();
@@ -99,6 +111,10 @@ public:
     void FIFO_BufferData();
     template<typename T> T FIFO_ReadData();
 
+    // index of the first of the next 'max' samples that can refill the FIFO from memory,
+    // 'max' if none of them can
+    u32 NextRefill(u32 max);
+
     void SetCnt(u32 val)
     {
         u32 oldcnt = Cnt;
@@ -132,33 +148,13 @@ public:
     void NextSample_PSG();
     void NextSample_Noise();
 
-    template<u32 type> s32 Run();
-
-    s32 DoRun()
-    {
-        switch ((Cnt >> 29) & 0x3)
-        {
-        case 0: return Run<0>(); break;
-        case 1: return Run<1>(); break;
-        case 2: return Run<2>(); break;
-        case 3:
-            if (Num >= 14)
-            {
-                return Run<4>();
-                break;
-            }
-            else if (Num >= 8)
-            {
-                return Run<3>();
-                break;
-            }
-            [[fallthrough]];
-        default:
-            return 0;
-        }
-    }
+    // generates 'count' samples, returns how many of them can be non-zero
+    // (the rest is zero-filled)
+    template<u32 type> u32 RunBlock(s32* out, u32 count);
+    u32 DoRunBlock(s32* out, u32 count);
 
-    void PanOutput(s32 in, s32& left, s32& right);
+    // left/right[i] += panned in[i]
+    void PanBlock(const s32* in, s32* left, s32* right, u32 count);
 
 private:
     u32 (*BusRead32)(u32 addr);
@@ -23,7 +23,7 @@
 #include <stdio.h>
 #include "types.h"
 
-#define SAVESTATE_MAJOR 9
+#define SAVESTATE_MAJOR 10
 #define SAVESTATE_MINOR 0
 
 class Savestate
@@ -48,11 +48,20 @@ const u8 MPAckMAC[6]   = {0x03, 0x09, 0xBF, 0x00, 0x00, 0x03};
 
 const int kTimerInterval = 8;
 const u32 kTimeCheckMask = ~(kTimerInterval - 1);
+const s64 kTimerTickCycles = 33513982LL * kTimerInterval; // in millionths of a cycle
+const u32 kMaxTimerBatch = 1024;
 
 bool Enabled;
 bool PowerOn;
 
-s32 TimerError;
+// timer ticks are batched when the radio is idle:
+// most ticks then only advance counters, so USTimer() works out how many of them
+// can go by before one that actually does something, and only the last one gets
+// an event. the others are caught up in bulk when it fires, or when the ARM7
+// accesses a register in the meantime.
+s32 TimerError;      // as of TimerBatchBase
+u64 TimerBatchBase;  // timestamp of the last tick that was processed
+u32 TimerBatchTicks; // ticks between TimerBatchBase and the scheduled event
 
 u16 Random;
 
@@ -235,6 +244,10 @@ void Reset()
 
     USTimestamp = 0;
 
+    TimerError = 0;
+    TimerBatchBase = 0;
+    TimerBatchTicks = 0;
+
     USCounter = 0;
     USCompare = 0;
     BlockBeaconIRQ14 = false;
@@ -284,6 +297,8 @@ void DoSavestate(Savestate* file)
     file->Var16(&Random);
 
     file->Var32((u32*)&TimerError);
+    file->Var64(&TimerBatchBase);
+    file->Var32(&TimerBatchTicks);
 
     file->VarArray(BBRegs, 0x100);
     file->VarArray(BBRegsRO, 0x100);
@@ -336,16 +351,131 @@ void DoSavestate(Savestate* file)
 }
 
 
+// timestamp of the given tick, counting from the last one that was processed
+u64 TimerTickTime(u32 ticks)
+{
+    s64 cycles = (kTimerTickCycles * ticks) - TimerError;
+    return TimerBatchBase + (cycles + 999999) / 1000000;
+}
+
+void AdvanceTimerBase(u32 ticks)
+{
+    s64 cycles = (kTimerTickCycles * ticks) - TimerError;
+    s64 delay = (cycles + 999999) / 1000000;
+    TimerError = (s32)((delay * 1000000) - cycles);
+    TimerBatchBase += delay;
+    TimerBatchTicks -= ticks;
+}
+
+// how many ticks can go by until one that needs to be processed
+u32 NextTimerBatch()
+{
+    // sending, receiving, or waiting on the MP host: every tick counts
+    if (ComStatus || IOPORT(W_TXBusy) || IsMPClient)
+        return 1;
+    if ((USUntilPowerOn >= 0) && (IOPORT(W_PowerState) & 0x0002))
+        return 1;
+
+    // see CheckRX()
+    bool rxcheck = !(IOPORT(W_PowerState) & 0x0300) &&
+                   (IOPORT(W_RXCnt) & 0x8000) &&
+                   (IOPORT(W_RXBufBegin) != IOPORT(W_RXBufEnd));
+
+    for (u32 i = 1; i < kMaxTimerBatch; i++)
+    {
+        u32 us = i * kTimerInterval;
+
+        if ((USUntilPowerOn < 0) && ((USUntilPowerOn + (int)us) >= 0))
+            return i;
+
+        if (IOPORT(W_USCountCnt))
+        {
+            u32 uspart = ((USCounter + us) & 0x3FF);
+
+            if (IOPORT(W_USCompareCnt))
+            {
+                u32 beaconus = (IOPORT(W_BeaconCount1) << 10) | (0x3FF - uspart);
+                if ((beaconus & kTimeCheckMask) == (IOPORT(W_PreBeacon) & kTimeCheckMask))
+                    return i;
+            }
+
+            if (!(uspart & kTimeCheckMask))
+                return i;
+        }
+
+        if (rxcheck && !((RXCounter + us - kTimerInterval) & 0x1FF & kTimeCheckMask))
+            return i;
+    }
+
+    return kMaxTimerBatch;
+}
+
+// advances everything like USTimer() would, for ticks that don't do anything else
+void SkipTimerTicks(u32 ticks)
+{
+    for (u32 i = 0; i < ticks; i++)
+    {
+        USTimestamp += kTimerInterval;
+        if (!(USTimestamp & 0x3FF & kTimeCheckMask))
+            WifiAP::MSTimer();
+    }
+
+    u32 us = ticks * kTimerInterval;
+
+    if (USUntilPowerOn < 0)
+        USUntilPowerOn += us;
+
+    if (IOPORT(W_USCountCnt))
+        USCounter += us;
+
+    if (IOPORT(W_CmdCountCnt) & 0x0001)
+        CmdCounter = (CmdCounter > us) ? (CmdCounter - us) : 0;
+
+    if (IOPORT(W_ContentFree) != 0)
+        IOPORT(W_ContentFree) = (IOPORT(W_ContentFree) > us) ? (IOPORT(W_ContentFree) - us) : 0;
+
+    RXCounter += us;
+
+    AdvanceTimerBase(ticks);
+}
+
+void CatchUpTimer()
+{
+    if (TimerBatchTicks <= 1) return;
+
+    u64 now = NDS::ARM7Timestamp;
+    if (now <= TimerBatchBase) return;
+
+    u64 ticks = (((now - TimerBatchBase) * 1000000) + TimerError) / kTimerTickCycles;
+    if (ticks >= TimerBatchTicks) ticks = TimerBatchTicks - 1;
+
+    if (ticks) SkipTimerTicks((u32)ticks);
+}
+
 void ScheduleTimer(bool first)
 {
-    if (first) TimerError = 0;
+    if (first)
+    {
+        TimerError = 0;
+        TimerBatchBase = NDS::ARM7Timestamp;
+        TimerBatchTicks = 1;
+    }
+    else
+        TimerBatchTicks = NextTimerBatch();
 
-    s32 cycles = 33513982 * kTimerInterval;
-    cycles -= TimerError;
-    s32 delay = (cycles + 999999) / 1000000;
-    TimerError = (delay * 1000000) - cycles;
+    NDS::ScheduleEvent(NDS::Event_Wifi, TimerTickTime(TimerBatchTicks), USTimer, 0);
+}
 
-    NDS::ScheduleEvent(NDS::Event_Wifi, !first, delay, USTimer, 0);
+// to be called when something the batch was based on may have changed
+void BreakTimerBatch()
+{
+    if (TimerBatchTicks <= 1) return;
+
+    CatchUpTimer();
+
+    TimerBatchTicks = 1;
+    NDS::CancelEvent(NDS::Event_Wifi);
+    NDS::ScheduleEvent(NDS::Event_Wifi, TimerTickTime(1), USTimer, 0);
 }
 
 void UpdatePowerOn()
@@ -381,6 +511,7 @@ void UpdatePowerOn()
         printf("WIFI: OFF\n");
 
         NDS::CancelEvent(NDS::Event_Wifi);
+        TimerBatchTicks = 0;
 
         Platform::MP_End();
     }
@@ -1590,6 +1721,10 @@ void MSTimer()
 
 void USTimer(u32 param)
 {
+    if (TimerBatchTicks > 1)
+        SkipTimerTicks(TimerBatchTicks - 1);
+    AdvanceTimerBase(1);
+
     USTimestamp += kTimerInterval;
 
     if (IsMPClient && (!ComStatus))
@@ -1767,6 +1902,8 @@ void USTimer(u32 param)
         }
     }
 
+    Platform::MP_AdvanceTime(USTimestamp);
+
     ScheduleTimer(false);
 }
 
@@ -1819,6 +1956,8 @@ u16 Read(u32 addr)
     if (addr >= 0x2000 && addr < 0x4000)
         return 0xFFFF;
 
+    CatchUpTimer();
+
     bool activeread = (addr < 0x1000);
 
     switch (addr)
@@ -1923,6 +2062,8 @@ void Write(u32 addr, u16 val)
     if (addr >= 0x2000 && addr < 0x4000)
         return;
 
+    BreakTimerBatch();
+
     switch (addr)
     {
     case W_ModeReset:
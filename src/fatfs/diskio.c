@@ -13,16 +13,18 @@
 
 static ff_disk_read_cb ReadCb;
 static ff_disk_write_cb WriteCb;
+static ff_disk_sync_cb SyncCb;
 static LBA_t SectorCount;
 static DSTATUS Status = STA_NOINIT | STA_NODISK;
 
 
-void ff_disk_open(ff_disk_read_cb readcb, ff_disk_write_cb writecb, LBA_t seccnt)
+void ff_disk_open(ff_disk_read_cb readcb, ff_disk_write_cb writecb, ff_disk_sync_cb synccb, LBA_t seccnt)
 {
     if (!readcb) return;
 
     ReadCb = readcb;
     WriteCb = writecb;
+    SyncCb = synccb;
     SectorCount = seccnt;
 
     Status &= ~STA_NODISK;
@@ -34,6 +36,7 @@ void ff_disk_close(void)
 {
     ReadCb = (void*)0;
     WriteCb = (void*)0;
+    SyncCb = (void*)0;
     SectorCount = 0;
 
     Status &= ~STA_PROTECT;
@@ -127,7 +130,7 @@ DRESULT disk_ioctl (
     switch (cmd)
     {
     case CTRL_SYNC:
-        // TODO: fflush?
+        if (SyncCb) SyncCb();
         return RES_OK;
 
     case GET_SECTOR_COUNT:
@@ -419,8 +419,10 @@ int ff_del_syncobj (FF_SYNC_t sobj);	/* Delete a sync object */
 
 typedef UINT (*ff_disk_read_cb)(BYTE* buff, LBA_t sector, UINT count);
 typedef UINT (*ff_disk_write_cb)(BYTE* buff, LBA_t sector, UINT count);
+typedef void (*ff_disk_sync_cb)(void);
 
-void ff_disk_open(ff_disk_read_cb readcb, ff_disk_write_cb writecb, LBA_t seccnt);
+// synccb is called on CTRL_SYNC (f_sync/f_close/f_unmount), can be null
+void ff_disk_open(ff_disk_read_cb readcb, ff_disk_write_cb writecb, ff_disk_sync_cb synccb, LBA_t seccnt);
 void ff_disk_close(void);
 
 
@@ -78,8 +78,17 @@ void Init_Audio(int outputfreq);
 // based on how many are needed by the frontend (outlen in samples)
 int AudioOut_GetNumSamples(int outlen);
 
+// dynamic rate control: slightly adjust the resampling ratio so that the
+// core audio output buffer stays around 'target' samples ('fill' being its
+// current level). this absorbs the drift between the emulated frame rate and
+// the audio output rate. pass target=0 to disable
+// should be called before AudioOut_GetNumSamples()
+void AudioOut_SetFillLevel(int fill, int target);
+
 // resample audio from the core audio output to match the frontend's
 // output frequency, and apply specified volume
+// the resampler keeps some input history between calls: inlen should be
+// what AudioOut_GetNumSamples() returned for this outlen
 // note: this assumes the output buffer is interleaved stereo
 void AudioOut_Resample(s16* inbuf, int inlen, s16* outbuf, int outlen, int volume);
 
@@ -20,6 +20,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "FrontendUtil.h"
 
@@ -32,17 +39,126 @@ namespace Frontend
 {
 
 int AudioOut_Freq;
-float AudioOut_SampleFrac;
 
 s16* MicBuffer;
 u32 MicBufferLength;
 u32 MicBufferReadPos;
 
 
+// band-limited resampler
+//
+// this is a polyphase windowed-sinc FIR: every output sample is computed from
+// ResamplerTaps input samples around its position, with the coefficients for
+// the nearest of ResamplerPhases sub-sample positions. the input history is
+// kept across calls, so there are no discontinuities between audio buffers.
+
+const double CoreSampleRate = 32823.6328125;
+
+const int ResamplerTaps = 32;
+const int ResamplerPhaseBits = 9;
+const int ResamplerPhases = 1 << ResamplerPhaseBits;
+
+alignas(16) s16 ResamplerCoefs[ResamplerPhases][ResamplerTaps];
+
+const int ResamplerHistSize = 8192;
+s16 ResamplerHist[2][ResamplerHistSize];
+int ResamplerHistLen;
+
+// position of the next output sample in the history and input/output ratio
+// in 32.32 fixed point
+u64 ResamplerPos;
+u64 ResamplerBaseStep;
+u64 ResamplerStep;
+
+// dynamic rate control
+// the ratio is adjusted by up to MaxRateAdjust, depending on how far the core
+// output buffer is from its target level
+const double MaxRateAdjust = 0.005;
+double RateAdjust;
+
+
+void Resampler_Init()
+{
+    // cutoff, relative to the input Nyquist frequency
+    // leave some room for the transition band
+    double cutoff = std::min(1.0, AudioOut_Freq / CoreSampleRate) * 0.9;
+    const double pi = acos(-1.0);
+    const double halfwidth = ResamplerTaps / 2;
+
+    for (int p = 0; p < ResamplerPhases; p++)
+    {
+        double frac = p / (double)ResamplerPhases;
+        double coefs[ResamplerTaps];
+        double sum = 0;
+
+        for (int t = 0; t < ResamplerTaps; t++)
+        {
+            // the output sample sits between taps Taps/2-1 and Taps/2
+            double x = t - (halfwidth - 1) - frac;
+
+            double sinc = (x == 0) ? 1.0 : sin(pi * cutoff * x) / (pi * cutoff * x);
+            double window = 0.42 + 0.5 * cos(pi * x / halfwidth) + 0.08 * cos(2 * pi * x / halfwidth); // Blackman
+            if (fabs(x) >= halfwidth) window = 0;
+
+            coefs[t] = sinc * window;
+            sum += coefs[t];
+        }
+
+        // normalize to unity gain, 1.15 fixed point
+        // the rounding error goes to the center tap so there's no DC drift between phases
+        int isum = 0;
+        for (int t = 0; t < ResamplerTaps; t++)
+        {
+            ResamplerCoefs[p][t] = (s16)lround((coefs[t] / sum) * 32768.0);
+            isum += ResamplerCoefs[p][t];
+        }
+        ResamplerCoefs[p][ResamplerTaps/2 - 1] += 32768 - isum;
+    }
+
+    memset(ResamplerHist, 0, sizeof(ResamplerHist));
+    ResamplerHistLen = 0;
+    ResamplerPos = 0;
+
+    ResamplerBaseStep = (u64)((CoreSampleRate / AudioOut_Freq) * 4294967296.0);
+    ResamplerStep = ResamplerBaseStep;
+    RateAdjust = 0;
+}
+
+s32 Resampler_Dot(const s16* hist, const s16* coefs)
+{
+#if defined(__SSE2__)
+    __m128i sum = _mm_setzero_si128();
+    for (int t = 0; t < ResamplerTaps; t += 8)
+    {
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)&hist[t]),
+                                                _mm_load_si128((const __m128i*)&coefs[t])));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1,0,3,2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_cvtsi128_si32(sum);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int32x4_t sum = vdupq_n_s32(0);
+    for (int t = 0; t < ResamplerTaps; t += 8)
+    {
+        int16x8_t h = vld1q_s16(&hist[t]);
+        int16x8_t c = vld1q_s16(&coefs[t]);
+        sum = vmlal_s16(sum, vget_low_s16(h), vget_low_s16(c));
+        sum = vmlal_high_s16(sum, h, c);
+    }
+    return vaddvq_s32(sum);
+#else
+    s32 sum = 0;
+    for (int t = 0; t < ResamplerTaps; t++)
+        sum += hist[t] * coefs[t];
+    return sum;
+#endif
+}
+
+
 void Init_Audio(int outputfreq)
 {
     AudioOut_Freq = outputfreq;
-    AudioOut_SampleFrac = 0;
+    Resampler_Init();
 
     MicBuffer = nullptr;
     MicBufferLength = 0;
@@ -52,31 +168,85 @@ void Init_Audio(int outputfreq)
 
 int AudioOut_GetNumSamples(int outlen)
 {
-    float f_len_in = (outlen * 32823.6328125) / (float)AudioOut_Freq;
-    f_len_in += AudioOut_SampleFrac;
-    int len_in = (int)floor(f_len_in);
-    AudioOut_SampleFrac = f_len_in - len_in;
+    if (outlen < 1) return 0;
+
+    // the last output sample needs ResamplerTaps input samples from its position on
+    u64 lastpos = ResamplerPos + (outlen-1) * ResamplerStep;
+    int needed = (int)(lastpos >> 32) + ResamplerTaps - ResamplerHistLen;
+
+    return std::max(needed, 0);
+}
+
+void AudioOut_SetFillLevel(int fill, int target)
+{
+    double adjust = 0;
+    if (target > 0)
+    {
+        adjust = (fill - target) / (double)target;
+        adjust = std::clamp(adjust, -1.0, 1.0) * MaxRateAdjust;
+    }
 
-    return len_in;
+    // the fill level jumps by a frame worth of samples every frame, smooth it out
+    RateAdjust += (adjust - RateAdjust) * 0.05;
+    ResamplerStep = (u64)(ResamplerBaseStep * (1.0 + RateAdjust));
 }
 
 void AudioOut_Resample(s16* inbuf, int inlen, s16* outbuf, int outlen, int volume)
 {
-    float res_incr = inlen / (float)outlen;
-    float res_timer = 0;
-    int res_pos = 0;
+    if (outlen < 1) return;
 
-    for (int i = 0; i < outlen; i++)
+    // append the new samples to the history
+    // if we're given less than what we asked for, repeat the last sample
+    int needed = AudioOut_GetNumSamples(outlen);
+    int total = std::min(ResamplerHistLen + std::max(inlen, needed), ResamplerHistSize);
+    for (int i = 0; ResamplerHistLen < total; i++, ResamplerHistLen++)
     {
-        outbuf[i*2  ] = (inbuf[res_pos*2  ] * volume) >> 8;
-        outbuf[i*2+1] = (inbuf[res_pos*2+1] * volume) >> 8;
-
-        res_timer += res_incr;
-        while (res_timer >= 1.0)
+        s16 l, r;
+        if (i < inlen)
         {
-            res_timer -= 1.0;
-            res_pos++;
+            l = inbuf[i*2];
+            r = inbuf[i*2+1];
         }
+        else if (ResamplerHistLen > 0)
+        {
+            l = ResamplerHist[0][ResamplerHistLen-1];
+            r = ResamplerHist[1][ResamplerHistLen-1];
+        }
+        else
+            l = r = 0;
+
+        ResamplerHist[0][ResamplerHistLen] = l;
+        ResamplerHist[1][ResamplerHistLen] = r;
+    }
+
+    for (int i = 0; i < outlen; i++)
+    {
+        int idx = (int)(ResamplerPos >> 32);
+        int phase = (int)(ResamplerPos >> (32 - ResamplerPhaseBits)) & (ResamplerPhases - 1);
+        if (idx > ResamplerHistLen - ResamplerTaps)
+            idx = ResamplerHistLen - ResamplerTaps; // only happens if the history is full
+
+        s32 l = Resampler_Dot(&ResamplerHist[0][idx], ResamplerCoefs[phase]) >> 15;
+        s32 r = Resampler_Dot(&ResamplerHist[1][idx], ResamplerCoefs[phase]) >> 15;
+
+        l = (l * volume) >> 8;
+        r = (r * volume) >> 8;
+
+        // the filter can overshoot a little
+        outbuf[i*2  ] = (s16)std::clamp(l, -0x8000, 0x7FFF);
+        outbuf[i*2+1] = (s16)std::clamp(r, -0x8000, 0x7FFF);
+
+        ResamplerPos += ResamplerStep;
+    }
+
+    // drop the samples we're done with
+    int consumed = std::min((int)(ResamplerPos >> 32), ResamplerHistLen);
+    if (consumed > 0)
+    {
+        ResamplerHistLen -= consumed;
+        memmove(&ResamplerHist[0][0], &ResamplerHist[0][consumed], ResamplerHistLen * sizeof(s16));
+        memmove(&ResamplerHist[1][0], &ResamplerHist[1][consumed], ResamplerHistLen * sizeof(s16));
+        ResamplerPos -= (u64)consumed << 32;
     }
 }
 
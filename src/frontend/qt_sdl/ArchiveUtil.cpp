@@ -154,6 +154,70 @@ u32 ExtractFileFromArchive(QString path, QString wantedFile, u8** filedata, u32*
 
 }
 
+struct ArchiveStream
+{
+    struct archive* Archive;
+};
+
+ArchiveStream* OpenFileInArchive(QString path, QString wantedFile, u32* filesize)
+{
+    struct archive *a = archive_read_new();
+    struct archive_entry *entry;
+    int r;
+
+    archive_read_support_format_all(a);
+    archive_read_support_filter_all(a);
+
+    r = melon_archive_open(a, path, 10240);
+    if (r != ARCHIVE_OK)
+    {
+        archive_read_free(a);
+        return nullptr;
+    }
+
+    bool found = false;
+    while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
+    {
+        if (strcmp(wantedFile.toUtf8().constData(), archive_entry_pathname_utf8(entry)) == 0)
+        {
+            found = true;
+            break;
+        }
+    }
+
+    if (!found || archive_entry_size(entry) > 0x40000000)
+    {
+        archive_read_close(a);
+        archive_read_free(a);
+        return nullptr;
+    }
+
+    if (filesize) *filesize = (u32)archive_entry_size(entry);
+
+    ArchiveStream* stream = new ArchiveStream;
+    stream->Archive = a;
+    return stream;
+}
+
+s32 ReadFileInArchive(ArchiveStream* stream, u8* data, u32 len)
+{
+    ssize_t bytesRead = archive_read_data(stream->Archive, data, len);
+    if (bytesRead < 0)
+    {
+        printf("Error whilst reading archive: %s\n", archive_error_string(stream->Archive));
+        return -1;
+    }
+
+    return (s32)bytesRead;
+}
+
+void CloseFileInArchive(ArchiveStream* stream)
+{
+    archive_read_close(stream->Archive);
+    archive_read_free(stream->Archive);
+    delete stream;
+}
+
 /*u32 ExtractFileFromArchive(const char* path, const char* wantedFile, u8 **romdata)
 {
     QByteArray romBuffer;
@@ -37,6 +37,13 @@ namespace Archive
 
 QVector<QString> ListArchive(QString path);
 u32 ExtractFileFromArchive(QString path, QString wantedFile, u8** filedata, u32* filesize);
+
+// sequential reading of a file inside an archive, for extracting it in chunks
+struct ArchiveStream;
+ArchiveStream* OpenFileInArchive(QString path, QString wantedFile, u32* filesize);
+// returns the amount of data read (0 at the end of the file), or -1 on error
+s32 ReadFileInArchive(ArchiveStream* stream, u8* data, u32 len);
+void CloseFileInArchive(ArchiveStream* stream);
 //QVector<QString> ExtractFileFromArchive(QString path, QString wantedFile, QByteArray *romBuffer);
 //u32 ExtractFileFromArchive(const char* path, const char* wantedFile, u8 **romdata);
 
@@ -60,6 +60,7 @@ bool GL_BetterPolygons;
 
 bool LimitFPS;
 bool AudioSync;
+bool AudioRateControl;
 bool ShowOSD;
 
 int ConsoleType;
@@ -98,6 +99,12 @@ bool DSiSDReadOnly;
 bool DSiSDFolderSync;
 std::string DSiSDFolderPath;
 
+bool DSiDSPThreaded;
+
+bool MapROMFiles;
+
+int DSiNANDCacheSize;
+
 bool FirmwareOverrideSettings;
 std::string FirmwareUsername;
 int FirmwareLanguage;
@@ -109,6 +116,7 @@ std::string FirmwareMAC;
 
 int MPAudioMode;
 int MPRecvTimeout;
+bool MPLockstep;
 
 std::string LANDevice;
 bool DirectLAN;
@@ -226,6 +234,7 @@ ConfigEntry ConfigFile[] =
 
     {"LimitFPS", 1, &LimitFPS, true, false},
     {"AudioSync", 1, &AudioSync, false},
+    {"AudioRateControl", 1, &AudioRateControl, true, false},
     {"ShowOSD", 1, &ShowOSD, true, false},
 
     {"ConsoleType", 0, &ConsoleType, 0, false},
@@ -268,6 +277,14 @@ ConfigEntry ConfigFile[] =
     {"DSiSDFolderSync", 1, &DSiSDFolderSync, false, false},
     {"DSiSDFolderPath", 2, &DSiSDFolderPath, (std::string)"", false},
 
+    // runs the DSi DSP on its own thread. faster, but not deterministic: the DSP reads
+    // main RAM while the ARMs run, and its writes only show up at the next sync point
+    {"DSiDSPThreaded", 1, &DSiDSPThreaded, false, false},
+
+    {"MapROMFiles", 1, &MapROMFiles, true, false},
+
+    {"DSiNANDCacheSize", 0, &DSiNANDCacheSize, 2048, false},
+
     {"FirmwareOverrideSettings", 1, &FirmwareOverrideSettings, false, true},
     {"FirmwareUsername", 2, &FirmwareUsername, (std::string)"melonDS", true},
     {"FirmwareLanguage", 0, &FirmwareLanguage, 1, true},
@@ -279,6 +296,7 @@ ConfigEntry ConfigFile[] =
 
     {"MPAudioMode", 0, &MPAudioMode, 1, false},
     {"MPRecvTimeout", 0, &MPRecvTimeout, 25, false},
+    {"MPLockstep", 1, &MPLockstep, false, false},
 
     {"LANDevice", 2, &LANDevice, (std::string)"", false},
     {"DirectLAN", 1, &DirectLAN, false, false},
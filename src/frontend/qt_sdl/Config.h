@@ -104,6 +104,7 @@ extern bool GL_BetterPolygons;
 
 extern bool LimitFPS;
 extern bool AudioSync;
+extern bool AudioRateControl;
 extern bool ShowOSD;
 
 extern int ConsoleType;
@@ -142,6 +143,12 @@ extern bool DSiSDReadOnly;
 extern bool DSiSDFolderSync;
 extern std::string DSiSDFolderPath;
 
+extern bool DSiDSPThreaded;
+
+extern bool MapROMFiles;
+
+extern int DSiNANDCacheSize;
+
 extern bool FirmwareOverrideSettings;
 extern std::string FirmwareUsername;
 extern int FirmwareLanguage;
@@ -153,6 +160,7 @@ extern std::string FirmwareMAC;
 
 extern int MPAudioMode;
 extern int MPRecvTimeout;
+extern bool MPLockstep;
 
 extern std::string LANDevice;
 extern bool DirectLAN;
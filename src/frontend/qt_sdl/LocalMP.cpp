@@ -22,6 +22,13 @@
 
 #ifdef __WIN32__
     #include <windows.h>
+#elif defined(__linux__)
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+    #include <errno.h>
+    #include <limits.h>
+    #include <time.h>
 #else
     #include <fcntl.h>
     #include <semaphore.h>
@@ -31,6 +38,8 @@
     #endif
 #endif
 
+#include <atomic>
+#include <chrono>
 #include <string>
 #include <QSharedMemory>
 
@@ -44,17 +53,42 @@ namespace LocalMP
 u32 MPUniqueID;
 u8 PacketBuffer[2048];
 
+// the shared memory holds two rings, one for regular frames (broadcast to every
+// instance) and one for MP replies (read by the MP host). nothing is locked when
+// sending or receiving:
+// * senders reserve space by bumping the ring's write position, fill in their
+//   record, and then commit it by writing its inverted position at its start
+//   (not the position itself: the ring starts out zeroed, so the first record
+//   would look committed as soon as it's reserved)
+// * every instance has its own read cursor, and stops at the first record that
+//   isn't committed yet
+// * a reader that falls more than a ring behind notices it and skips ahead
+// the QSharedMemory lock is only used when instances come and go.
+
 struct MPQueueHeader
 {
-    u16 NumInstances;
-    u16 InstanceBitmask;  // bitmask of all instances present
-    u16 ConnectedBitmask; // bitmask of which instances are ready to send/receive packets
-    u32 PacketWriteOffset;
-    u32 ReplyWriteOffset;
-    u16 MPHostInstanceID; // instance ID from which the last CMD frame was sent
-    u16 MPReplyBitmask;   // bitmask of which clients replied in time
+    std::atomic<u16> NumInstances;
+    std::atomic<u16> InstanceBitmask;  // bitmask of all instances present
+    std::atomic<u16> ConnectedBitmask; // bitmask of which instances are ready to send/receive packets
+    std::atomic<u16> MPHostInstanceID; // instance ID from which the last CMD frame was sent
+    std::atomic<u16> MPReplyBitmask;   // bitmask of which clients replied in time
+    std::atomic<u32> PacketWritePos;   // free-running, in bytes
+    std::atomic<u32> ReplyWritePos;
+    // bumped whenever the matching instance has something new to look at
+    // 0-15: regular frames, 16-31: MP replies
+    std::atomic<u32> Wake[32];
+
+    // lockstep, see below
+    std::atomic<u16> LockstepBitmask;  // instances running in lockstep mode
+    std::atomic<u16> SyncedBitmask;    // instances whose timestamps are in the MP host's timebase
+    std::atomic<u16> BarrierWaiters;   // instances waiting for others to catch up
+    std::atomic<u64> InstanceTime[16]; // latest timestamp each instance got to
 };
 
+static_assert(std::atomic<u16>::is_always_lock_free && std::atomic<u32>::is_always_lock_free &&
+              std::atomic<u64>::is_always_lock_free,
+              "the MP queue header needs address-free atomics");
+
 struct MPPacketHeader
 {
     u32 Magic;
@@ -64,35 +98,44 @@ struct MPPacketHeader
     u64 Timestamp;
 };
 
-struct MPSync
-{
-    u32 Magic;
-    u32 SenderID;
-    u16 ClientMask;
-    u16 Type;
-    u64 Timestamp;
-};
+// records are 8-byte aligned: the commit word, 4 bytes of padding, the packet header, the packet data
+const u32 kRecordHeaderSize = 8 + sizeof(MPPacketHeader);
 
 QSharedMemory* MPQueue;
+MPQueueHeader* Header;
 int InstanceID;
-u32 PacketReadOffset;
-u32 ReplyReadOffset;
+u32 PacketReadPos;
+u32 ReplyReadPos;
 
-const u32 kQueueSize = 0x20000;
+const u32 kRingSize = 0x10000; // must be a power of two
 const u32 kMaxFrameSize = 0x800;
-const u32 kPacketStart = sizeof(MPQueueHeader);
-const u32 kReplyStart = kQueueSize / 2;
-const u32 kPacketEnd = kReplyStart;
-const u32 kReplyEnd = kQueueSize;
+const u32 kPacketStart = 0x1000;
+const u32 kReplyStart = kPacketStart + kRingSize;
+const u32 kQueueSize = kReplyStart + kRingSize;
+
+static_assert(sizeof(MPQueueHeader) <= kPacketStart, "MP queue header too big");
 
 int RecvTimeout;
 
 int LastHostID;
 
+bool Lockstep;
+u64 CurTime;
+
+// how far ahead of the slowest instance one may run, in microseconds
+const u64 kLockstepWindow = 16384;
+// how long to wait for an instance whose timestamp doesn't move (paused, stuck...)
+// before going on without it, in milliseconds
+const int kLockstepStallTimeout = 1000;
+
+u16 StalledMask;
+u64 StalledTime[16];
+
 
 // we need to come up with our own abstraction layer for named semaphores
 // because QSystemSemaphore doesn't support waiting with a timeout
 // and, as such, is unsuitable to our needs
+// (not needed on Linux, where futexes are used instead, see below)
 
 #ifdef __WIN32__
 
@@ -157,7 +200,7 @@ void SemReset(int num)
     while (WaitForSingleObject(SemPool[num], 0) == WAIT_OBJECT_0);
 }
 
-#else
+#elif !defined(__linux__)
 
 bool SemInited[32];
 sem_t* SemPool[32];
@@ -233,9 +276,86 @@ void SemReset(int num)
 #endif
 
 
+// wakeups: an instance checks its rings, and if there's nothing for it, waits until
+// its wake counter changes (or the timeout expires)
+
+#ifdef __linux__
+
+bool WakeWait(int num, u32 seen, int timeout)
+{
+    if (!timeout)
+        return false;
+
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+
+    // the shared memory is mapped in several processes, so no FUTEX_PRIVATE_FLAG
+    long ret = syscall(SYS_futex, (u32*)&Header->Wake[num], FUTEX_WAIT, seen, &ts, nullptr, 0);
+    if (ret == 0) return true;
+
+    // EAGAIN: the counter changed before we went to sleep
+    // EINTR: try again, the caller keeps track of the time
+    return (errno == EAGAIN) || (errno == EINTR);
+}
+
+void WakePost(int num)
+{
+    Header->Wake[num].fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, (u32*)&Header->Wake[num], FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+void WakeInit()
+{
+}
+
+void WakeDeinit()
+{
+}
+
+void WakeReset(int num)
+{
+}
+
+#else
+
+bool WakeWait(int num, u32 seen, int timeout)
+{
+    return SemWait(num, timeout);
+}
+
+void WakePost(int num)
+{
+    Header->Wake[num].fetch_add(1, std::memory_order_release);
+    SemPost(num);
+}
+
+void WakeInit()
+{
+    // semaphores 0-15: regular frames; semaphore I is posted when instance I needs to process a new frame
+    // semaphores 16-31: MP replies; semaphore I is posted when instance I needs to process a new MP reply
+
+    SemPoolInit();
+    SemInit(InstanceID);
+    SemInit(16+InstanceID);
+}
+
+void WakeDeinit()
+{
+    SemPoolDeinit();
+}
+
+void WakeReset(int num)
+{
+    SemReset(num);
+}
+
+#endif
+
+
 bool Init()
 {
-    MPQueue = new QSharedMemory("melonNIFI");
+    MPQueue = new QSharedMemory("melonNIFI_Ring");
 
     if (!MPQueue->attach())
     {
@@ -248,40 +368,31 @@ bool Init()
 
         MPQueue->lock();
         memset(MPQueue->data(), 0, MPQueue->size());
-        MPQueueHeader* header = (MPQueueHeader*)MPQueue->data();
-        header->PacketWriteOffset = kPacketStart;
-        header->ReplyWriteOffset = kReplyStart;
         MPQueue->unlock();
     }
 
     MPQueue->lock();
-    MPQueueHeader* header = (MPQueueHeader*)MPQueue->data();
+    Header = (MPQueueHeader*)MPQueue->data();
 
-    u16 mask = header->InstanceBitmask;
+    u16 mask = Header->InstanceBitmask;
     for (int i = 0; i < 16; i++)
     {
         if (!(mask & (1<<i)))
         {
             InstanceID = i;
-            header->InstanceBitmask |= (1<<i);
-            //header->ConnectedBitmask |= (1 << i);
+            Header->InstanceBitmask |= (1<<i);
+            //Header->ConnectedBitmask |= (1 << i);
             break;
         }
     }
-    header->NumInstances++;
+    Header->NumInstances++;
 
-    PacketReadOffset = header->PacketWriteOffset;
-    ReplyReadOffset = header->ReplyWriteOffset;
+    PacketReadPos = Header->PacketWritePos;
+    ReplyReadPos = Header->ReplyWritePos;
 
     MPQueue->unlock();
 
-    // prepare semaphores
-    // semaphores 0-15: regular frames; semaphore I is posted when instance I needs to process a new frame
-    // semaphores 16-31: MP replies; semaphore I is posted when instance I needs to process a new MP reply
-
-    SemPoolInit();
-    SemInit(InstanceID);
-    SemInit(16+InstanceID);
+    WakeInit();
 
     LastHostID = -1;
 
@@ -289,22 +400,28 @@ bool Init()
 
     RecvTimeout = 25;
 
+    Lockstep = Config::MPLockstep;
+    CurTime = 0;
+    StalledMask = 0;
+
     return true;
 }
 
 void DeInit()
 {
     MPQueue->lock();
-    MPQueueHeader* header = (MPQueueHeader*)MPQueue->data();
-    header->ConnectedBitmask &= ~(1 << InstanceID);
-    header->InstanceBitmask &= ~(1 << InstanceID);
-    header->NumInstances--;
+    Header->ConnectedBitmask &= ~(1 << InstanceID);
+    Header->InstanceBitmask &= ~(1 << InstanceID);
+    Header->LockstepBitmask &= ~(1 << InstanceID);
+    Header->SyncedBitmask &= ~(1 << InstanceID);
+    Header->NumInstances--;
     MPQueue->unlock();
 
-    SemPoolDeinit();
+    WakeDeinit();
 
     MPQueue->detach();
     delete MPQueue;
+    Header = nullptr;
 }
 
 void SetRecvTimeout(int timeout)
@@ -312,108 +429,264 @@ void SetRecvTimeout(int timeout)
     RecvTimeout = timeout;
 }
 
+void SetLockstep(bool enable)
+{
+    Lockstep = enable;
+
+    MPQueue->lock();
+    if (enable && (Header->ConnectedBitmask & (1 << InstanceID)))
+        Header->LockstepBitmask |= (1 << InstanceID);
+    else
+        Header->LockstepBitmask &= ~(1 << InstanceID);
+    MPQueue->unlock();
+}
+
 void Begin()
 {
     MPQueue->lock();
-    MPQueueHeader* header = (MPQueueHeader*)MPQueue->data();
-    PacketReadOffset = header->PacketWriteOffset;
-    ReplyReadOffset = header->ReplyWriteOffset;
-    SemReset(InstanceID);
-    SemReset(16+InstanceID);
-    header->ConnectedBitmask |= (1 << InstanceID);
+    PacketReadPos = Header->PacketWritePos;
+    ReplyReadPos = Header->ReplyWritePos;
+    WakeReset(InstanceID);
+    WakeReset(16+InstanceID);
+    Header->ConnectedBitmask |= (1 << InstanceID);
+    if (Lockstep)
+        Header->LockstepBitmask |= (1 << InstanceID);
     MPQueue->unlock();
+
+    CurTime = 0;
+    StalledMask = 0;
 }
 
 void End()
 {
     MPQueue->lock();
-    MPQueueHeader* header = (MPQueueHeader*)MPQueue->data();
-    //SemReset(InstanceID);
-    //SemReset(16+InstanceID);
-    header->ConnectedBitmask &= ~(1 << InstanceID);
+    //WakeReset(InstanceID);
+    //WakeReset(16+InstanceID);
+    Header->ConnectedBitmask &= ~(1 << InstanceID);
+    Header->LockstepBitmask &= ~(1 << InstanceID);
+    Header->SyncedBitmask &= ~(1 << InstanceID);
     MPQueue->unlock();
 }
 
-void FIFORead(int fifo, void* buf, int len)
+
+// lockstep mode
+//
+// instead of waiting for each other with wall-clock timeouts, instances agree on
+// emulated time: everyone publishes the timestamp they got to, and
+// * nobody runs more than kLockstepWindow ahead of the slowest instance
+// * a client waiting for a host frame waits until the host got to the client's time
+//   (if nothing came by then, nothing is coming)
+// * the host waiting for replies waits until every client either replied or got to
+//   the host's time
+// every wait is on an instance that is behind the waiter, so the one furthest
+// behind never waits and there are no deadlocks.
+// timestamps are only comparable once an instance is in the MP host's timebase,
+// which is the case for the host itself and for clients that got in sync with it.
+
+void PublishTime(u64 timestamp)
 {
-    u8* data = (u8*)MPQueue->data();
+    CurTime = timestamp;
+    Header->InstanceTime[InstanceID].store(timestamp);
 
-    u32 offset, start, end;
-    if (fifo == 0)
-    {
-        offset = PacketReadOffset;
-        start = kPacketStart;
-        end = kPacketEnd;
-    }
-    else
-    {
-        offset = ReplyReadOffset;
-        start = kReplyStart;
-        end = kReplyEnd;
-    }
+    u16 waiters = Header->BarrierWaiters & ~(1 << InstanceID);
+    if (!waiters) return;
 
-    if ((offset + len) >= end)
+    for (int i = 0; i < 16; i++)
     {
-        u32 part1 = end - offset;
-        memcpy(buf, &data[offset], part1);
-        memcpy(&((u8*)buf)[part1], &data[start], len - part1);
-        offset = start + len - part1;
+        if (waiters & (1<<i))
+            WakePost(i);
     }
-    else
+}
+
+// waits until the given instances that are behind the given time (pred returns true
+// for those) either catch up or stop moving for too long
+template <typename Pred>
+void WaitForInstances(u16 mask, Pred behind)
+{
+    u16 myinstmask = (1 << InstanceID);
+    if (!(Header->SyncedBitmask & myinstmask))
+        return;
+
+    auto lastprogress = std::chrono::steady_clock::now();
+    u64 lasttimes[16];
+    for (int i = 0; i < 16; i++)
+        lasttimes[i] = Header->InstanceTime[i];
+
+    for (;;)
     {
-        memcpy(buf, &data[offset], len);
-        offset += len;
+        u32 seen = Header->Wake[InstanceID].load(std::memory_order_acquire);
+        Header->BarrierWaiters |= myinstmask;
+
+        u16 active = mask & Header->LockstepBitmask & Header->SyncedBitmask &
+                     Header->ConnectedBitmask & ~myinstmask;
+
+        u16 waiting = 0;
+        for (int i = 0; i < 16; i++)
+        {
+            if (!(active & (1<<i))) continue;
+
+            u64 time = Header->InstanceTime[i];
+
+            // don't hold up on an instance we gave up on, until it moves again
+            if (StalledMask & (1<<i))
+            {
+                if (time == StalledTime[i]) continue;
+                StalledMask &= ~(1<<i);
+            }
+
+            if (time != lasttimes[i])
+            {
+                lasttimes[i] = time;
+                lastprogress = std::chrono::steady_clock::now();
+            }
+
+            if (behind(i, time))
+                waiting |= (1<<i);
+        }
+
+        if (!waiting)
+            break;
+
+        int timeleft = kLockstepStallTimeout - (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - lastprogress).count();
+        if (timeleft <= 0)
+        {
+            printf("MP lockstep: instances %04X seem stuck, going on without them\n", waiting);
+            for (int i = 0; i < 16; i++)
+            {
+                if (waiting & (1<<i))
+                    StalledTime[i] = lasttimes[i];
+            }
+            StalledMask |= waiting;
+            break;
+        }
+
+        WakeWait(InstanceID, seen, timeleft);
     }
 
-    if (fifo == 0) PacketReadOffset = offset;
-    else           ReplyReadOffset = offset;
+    Header->BarrierWaiters &= ~myinstmask;
 }
 
-void FIFOWrite(int fifo, void* buf, int len)
+void AdvanceTime(u64 timestamp)
 {
-    u8* data = (u8*)MPQueue->data();
-    MPQueueHeader* header = (MPQueueHeader*)&data[0];
+    PublishTime(timestamp);
 
-    u32 offset, start, end;
-    if (fifo == 0)
+    if (!Lockstep || timestamp < kLockstepWindow)
+        return;
+
+    u64 target = timestamp - kLockstepWindow;
+    WaitForInstances(0xFFFF, [=](int i, u64 time) { return time < target; });
+}
+
+u8* RingData(int ring)
+{
+    return (u8*)MPQueue->data() + ((ring == 0) ? kPacketStart : kReplyStart);
+}
+
+std::atomic<u32>& RingWritePos(int ring)
+{
+    return (ring == 0) ? Header->PacketWritePos : Header->ReplyWritePos;
+}
+
+void RingCopyOut(int ring, u32 pos, void* buf, u32 len)
+{
+    u8* data = RingData(ring);
+    u32 offset = pos & (kRingSize - 1);
+
+    if ((offset + len) > kRingSize)
     {
-        offset = header->PacketWriteOffset;
-        start = kPacketStart;
-        end = kPacketEnd;
+        u32 part1 = kRingSize - offset;
+        memcpy(buf, &data[offset], part1);
+        memcpy(&((u8*)buf)[part1], &data[0], len - part1);
     }
     else
-    {
-        offset = header->ReplyWriteOffset;
-        start = kReplyStart;
-        end = kReplyEnd;
-    }
+        memcpy(buf, &data[offset], len);
+}
+
+void RingCopyIn(int ring, u32 pos, const void* buf, u32 len)
+{
+    u8* data = RingData(ring);
+    u32 offset = pos & (kRingSize - 1);
 
-    if ((offset + len) >= end)
+    if ((offset + len) > kRingSize)
     {
-        u32 part1 = end - offset;
+        u32 part1 = kRingSize - offset;
         memcpy(&data[offset], buf, part1);
-        memcpy(&data[start], &((u8*)buf)[part1], len - part1);
-        offset = start + len - part1;
+        memcpy(&data[0], &((const u8*)buf)[part1], len - part1);
     }
     else
-    {
         memcpy(&data[offset], buf, len);
-        offset += len;
-    }
+}
 
-    if (fifo == 0) header->PacketWriteOffset = offset;
-    else           header->ReplyWriteOffset = offset;
+std::atomic<u32>& RingCommitWord(int ring, u32 pos)
+{
+    return *(std::atomic<u32>*)&RingData(ring)[pos & (kRingSize - 1)];
 }
 
-int SendPacketGeneric(u32 type, u8* packet, int len, u64 timestamp)
+u32 RingCommitValue(u32 pos)
 {
-    MPQueue->lock();
-    u8* data = (u8*)MPQueue->data();
-    MPQueueHeader* header = (MPQueueHeader*)&data[0];
+    return ~pos;
+}
+
+void RingWrite(int ring, MPPacketHeader* pktheader, u8* packet)
+{
+    u32 reclen = (kRecordHeaderSize + pktheader->Length + 7) & ~7;
+    u32 pos = RingWritePos(ring).fetch_add(reclen, std::memory_order_acq_rel);
+
+    RingCopyIn(ring, pos + 8, pktheader, sizeof(MPPacketHeader));
+    if (pktheader->Length)
+        RingCopyIn(ring, pos + kRecordHeaderSize, packet, pktheader->Length);
+
+    RingCommitWord(ring, pos).store(RingCommitValue(pos), std::memory_order_release);
+}
+
+enum
+{
+    Ring_Empty = 0,
+    Ring_Record,
+    Ring_Overflow,
+};
 
-    u16 mask = header->ConnectedBitmask;
+// looks at the record at the read cursor, without moving past it
+int RingPeek(int ring, u32 readpos, MPPacketHeader* pktheader)
+{
+    u32 writepos = RingWritePos(ring).load(std::memory_order_acquire);
+    if (writepos == readpos)
+        return Ring_Empty;
+    if ((writepos - readpos) > kRingSize)
+        return Ring_Overflow;
+
+    // reserved, but not written yet
+    if (RingCommitWord(ring, readpos).load(std::memory_order_acquire) != RingCommitValue(readpos))
+        return Ring_Empty;
+
+    RingCopyOut(ring, readpos + 8, pktheader, sizeof(MPPacketHeader));
+    if (pktheader->Magic != 0x4946494E || pktheader->Length > kMaxFrameSize)
+        return Ring_Overflow;
+
+    return Ring_Record;
+}
+
+// copies out the packet data and moves past the record
+// returns false if it got overwritten in the meantime
+bool RingConsume(int ring, u32& readpos, MPPacketHeader* pktheader, u8* packet)
+{
+    if (packet && pktheader->Length)
+        RingCopyOut(ring, readpos + kRecordHeaderSize, packet, pktheader->Length);
+
+    if ((RingWritePos(ring).load(std::memory_order_acquire) - readpos) > kRingSize)
+        return false;
+
+    readpos += (kRecordHeaderSize + pktheader->Length + 7) & ~7;
+    return true;
+}
+
+int SendPacketGeneric(u32 type, u8* packet, int len, u64 timestamp)
+{
+    if ((u32)len > kMaxFrameSize)
+        return 0;
 
-    // TODO: check if the FIFO is full!
+    u16 mask = Header->ConnectedBitmask;
 
     MPPacketHeader pktheader;
     pktheader.Magic = 0x4946494E;
@@ -423,37 +696,41 @@ int SendPacketGeneric(u32 type, u8* packet, int len, u64 timestamp)
     pktheader.Timestamp = timestamp;
 
     type &= 0xFFFF;
-    int nfifo = (type == 2) ? 1 : 0;
-    FIFOWrite(nfifo, &pktheader, sizeof(pktheader));
-    if (len)
-        FIFOWrite(nfifo, packet, len);
 
     if (type == 1)
     {
+        // the host's timebase is the reference
+        Header->SyncedBitmask |= (1 << InstanceID);
+
         // NOTE: this is not guarded against, say, multiple multiplay games happening on the same machine
         // we would need to pass the packet's SenderID through the wifi module for that
-        header->MPHostInstanceID = InstanceID;
-        header->MPReplyBitmask = 0;
-        ReplyReadOffset = header->ReplyWriteOffset;
-        SemReset(16 + InstanceID);
+        Header->MPHostInstanceID = InstanceID;
+        Header->MPReplyBitmask = 0;
+        ReplyReadPos = Header->ReplyWritePos;
+        WakeReset(16 + InstanceID);
     }
     else if (type == 2)
     {
-        header->MPReplyBitmask |= (1 << InstanceID);
+        Header->MPReplyBitmask |= (1 << InstanceID);
     }
 
-    MPQueue->unlock();
+    int nring = (type == 2) ? 1 : 0;
+    RingWrite(nring, &pktheader, packet);
+
+    // only once the frame is out: in lockstep mode, others go by our time
+    // to decide whether anything is coming
+    PublishTime(timestamp);
 
     if (type == 2)
     {
-        SemPost(16 + header->MPHostInstanceID);
+        WakePost(16 + Header->MPHostInstanceID);
     }
     else
     {
         for (int i = 0; i < 16; i++)
         {
-            if (mask & (1<<i))
-                SemPost(i);
+            if ((mask & (1<<i)) && (i != InstanceID))
+                WakePost(i);
         }
     }
 
@@ -462,51 +739,69 @@ int SendPacketGeneric(u32 type, u8* packet, int len, u64 timestamp)
 
 int RecvPacketGeneric(u8* packet, bool block, u64* timestamp)
 {
+    bool lockstep = block && Lockstep;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RecvTimeout);
+
     for (;;)
     {
-        if (!SemWait(InstanceID, block ? RecvTimeout : 0))
-        {
-            return 0;
-        }
-
-        MPQueue->lock();
-        u8* data = (u8*)MPQueue->data();
-        MPQueueHeader* header = (MPQueueHeader*)&data[0];
+        u32 seen = Header->Wake[InstanceID].load(std::memory_order_acquire);
 
         MPPacketHeader pktheader;
-        FIFORead(0, &pktheader, sizeof(pktheader));
+        int res = RingPeek(0, PacketReadPos, &pktheader);
 
-        if (pktheader.Magic != 0x4946494E)
+        if (res == Ring_Overflow)
         {
             printf("PACKET FIFO OVERFLOW\n");
-            PacketReadOffset = header->PacketWriteOffset;
-            SemReset(InstanceID);
-            MPQueue->unlock();
+            PacketReadPos = Header->PacketWritePos;
             return 0;
         }
 
-        if (pktheader.SenderID == InstanceID)
+        if (res == Ring_Record)
         {
-            // skip this packet
-            PacketReadOffset += pktheader.Length;
-            if (PacketReadOffset >= kPacketEnd)
-                PacketReadOffset += kPacketStart - kPacketEnd;
+            if (pktheader.SenderID == InstanceID)
+            {
+                // skip this packet
+                if (!RingConsume(0, PacketReadPos, &pktheader, nullptr))
+                    PacketReadPos = Header->PacketWritePos;
+                continue;
+            }
+
+            if (!RingConsume(0, PacketReadPos, &pktheader, packet))
+            {
+                printf("PACKET FIFO OVERFLOW\n");
+                PacketReadPos = Header->PacketWritePos;
+                return 0;
+            }
+
+            if (pktheader.Length && pktheader.Type == 1)
+                LastHostID = pktheader.SenderID;
 
-            MPQueue->unlock();
-            continue;
+            if (timestamp) *timestamp = pktheader.Timestamp;
+            return pktheader.Length;
         }
 
-        if (pktheader.Length)
-        {
-            FIFORead(0, packet, pktheader.Length);
+        if (!block)
+            return 0;
 
-            if (pktheader.Type == 1)
-                LastHostID = pktheader.SenderID;
+        if (lockstep)
+        {
+            // nothing yet: wait for the host to get to our time, then look again
+            // (the host's frames are written before it moves on)
+            int host = Header->MPHostInstanceID;
+            u64 target = CurTime;
+            if (Header->InstanceTime[host] >= target)
+                return 0;
+
+            WaitForInstances(1 << host, [=](int i, u64 time) { return time < target; });
+            if (RingPeek(0, PacketReadPos, &pktheader) == Ring_Empty)
+                return 0;
+            continue;
         }
 
-        if (timestamp) *timestamp = pktheader.Timestamp;
-        MPQueue->unlock();
-        return pktheader.Length;
+        int timeleft = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+        if (timeleft <= 0 || !WakeWait(InstanceID, seen, timeleft))
+            return 0;
     }
 }
 
@@ -542,16 +837,15 @@ int RecvHostPacket(u8* packet, u64* timestamp)
     {
         // check if the host is still connected
 
-        MPQueue->lock();
-        u8* data = (u8*)MPQueue->data();
-        MPQueueHeader* header = (MPQueueHeader*)&data[0];
-        u16 curinstmask = header->ConnectedBitmask;
-        MPQueue->unlock();
+        u16 curinstmask = Header->ConnectedBitmask;
 
         if (!(curinstmask & (1 << LastHostID)))
             return -1;
     }
 
+    // we're only asked for host frames once we're in sync with the host
+    Header->SyncedBitmask |= (1 << InstanceID);
+
     return RecvPacketGeneric(packet, true, timestamp);
 }
 
@@ -559,76 +853,86 @@ u16 RecvReplies(u8* packets, u64 timestamp, u16 aidmask)
 {
     u16 ret = 0;
     u16 myinstmask = (1 << InstanceID);
-    u16 curinstmask;
-
-    {
-        MPQueue->lock();
-        u8* data = (u8*)MPQueue->data();
-        MPQueueHeader* header = (MPQueueHeader*)&data[0];
-        curinstmask = header->ConnectedBitmask;
-        MPQueue->unlock();
-    }
+    u16 curinstmask = Header->ConnectedBitmask;
 
     // if all clients have left: return early
     if ((myinstmask & curinstmask) == curinstmask)
         return 0;
 
+    PublishTime(timestamp);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RecvTimeout);
+
     for (;;)
     {
-        if (!SemWait(16+InstanceID, RecvTimeout))
-        {
-            // no more replies available
-            return ret;
-        }
-
-        MPQueue->lock();
-        u8* data = (u8*)MPQueue->data();
-        MPQueueHeader* header = (MPQueueHeader*)&data[0];
+        u32 seen = Header->Wake[16+InstanceID].load(std::memory_order_acquire);
 
         MPPacketHeader pktheader;
-        FIFORead(1, &pktheader, sizeof(pktheader));
+        int res = RingPeek(1, ReplyReadPos, &pktheader);
 
-        if (pktheader.Magic != 0x4946494E)
+        if (res == Ring_Overflow)
         {
             printf("REPLY FIFO OVERFLOW\n");
-            ReplyReadOffset = header->ReplyWriteOffset;
-            SemReset(16+InstanceID);
-            MPQueue->unlock();
+            ReplyReadPos = Header->ReplyWritePos;
             return 0;
         }
 
+        if (res == Ring_Empty)
+        {
+            if (Lockstep)
+            {
+                // wait for the clients that haven't replied yet to get to our time:
+                // if they were going to reply, they did by then
+                WaitForInstances(curinstmask & ~myinstmask,
+                                 [=](int i, u64 time) { return time < timestamp; });
+
+                if (RingPeek(1, ReplyReadPos, &pktheader) == Ring_Empty)
+                    return ret;
+                continue;
+            }
+
+            int timeleft = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+            if (timeleft <= 0 || !WakeWait(16+InstanceID, seen, timeleft))
+            {
+                // no more replies available
+                return ret;
+            }
+            continue;
+        }
+
         if ((pktheader.SenderID == InstanceID) || // packet we sent out (shouldn't happen, but hey)
             (pktheader.Timestamp < (timestamp - 32))) // stale packet
         {
             // skip this packet
-            ReplyReadOffset += pktheader.Length;
-            if (ReplyReadOffset >= kReplyEnd)
-                ReplyReadOffset += kReplyStart - kReplyEnd;
-
-            MPQueue->unlock();
+            if (!RingConsume(1, ReplyReadPos, &pktheader, nullptr))
+                ReplyReadPos = Header->ReplyWritePos;
             continue;
         }
 
+        u8* dst = nullptr;
+        u32 aid = (pktheader.Type >> 16);
         if (pktheader.Length)
+            dst = &packets[(aid-1)*1024];
+
+        if (!RingConsume(1, ReplyReadPos, &pktheader, dst))
         {
-            u32 aid = (pktheader.Type >> 16);
-            FIFORead(1, &packets[(aid-1)*1024], pktheader.Length);
-            ret |= (1 << aid);
+            printf("REPLY FIFO OVERFLOW\n");
+            ReplyReadPos = Header->ReplyWritePos;
+            return 0;
         }
 
+        if (pktheader.Length)
+            ret |= (1 << aid);
+
         myinstmask |= (1 << pktheader.SenderID);
         if (((myinstmask & curinstmask) == curinstmask) ||
             ((ret & aidmask) == aidmask))
         {
             // all the clients have sent their reply
-
-            MPQueue->unlock();
             return ret;
         }
-
-        MPQueue->unlock();
     }
 }
 
 }
-
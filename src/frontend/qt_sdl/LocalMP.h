@@ -28,6 +28,7 @@ bool Init();
 void DeInit();
 
 void SetRecvTimeout(int timeout);
+void SetLockstep(bool enable);
 
 void Begin();
 void End();
@@ -39,6 +40,7 @@ int SendReply(u8* data, int len, u64 timestamp, u16 aid);
 int SendAck(u8* data, int len, u64 timestamp);
 int RecvHostPacket(u8* data, u64* timestamp);
 u16 RecvReplies(u8* data, u64 timestamp, u16 aidmask);
+void AdvanceTime(u64 timestamp);
 
 }
 
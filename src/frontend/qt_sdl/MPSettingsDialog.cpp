@@ -48,6 +48,7 @@ MPSettingsDialog::MPSettingsDialog(QWidget* parent) : QDialog(parent), ui(new Ui
     grpAudioMode->button(Config::MPAudioMode)->setChecked(true);
 
     ui->sbReceiveTimeout->setValue(Config::MPRecvTimeout);
+    ui->cbLockstep->setChecked(Config::MPLockstep);
 }
 
 MPSettingsDialog::~MPSettingsDialog()
@@ -61,6 +62,7 @@ void MPSettingsDialog::done(int r)
     {
         Config::MPAudioMode = grpAudioMode->checkedId();
         Config::MPRecvTimeout = ui->sbReceiveTimeout->value();
+        Config::MPLockstep = ui->cbLockstep->isChecked();
 
         Config::Save();
     }
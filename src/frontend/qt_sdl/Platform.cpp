@@ -186,6 +186,8 @@ int GetConfigInt(ConfigEntry entry)
 
     case DSiSD_ImageSize: return imgsizes[Config::DSiSDSize];
 
+    case DSi_NANDCacheSize: return Config::DSiNANDCacheSize;
+
     case Firm_Language: return Config::FirmwareLanguage;
     case Firm_BirthdayMonth: return Config::FirmwareBirthdayMonth;
     case Firm_BirthdayDay: return Config::FirmwareBirthdayDay;
@@ -218,6 +220,10 @@ bool GetConfigBool(ConfigEntry entry)
     case DSiSD_ReadOnly: return Config::DSiSDReadOnly != 0;
     case DSiSD_FolderSync: return Config::DSiSDFolderSync != 0;
 
+    case DSi_DSPThreaded: return Config::DSiDSPThreaded != 0;
+
+    case MapROMFiles: return Config::MapROMFiles != 0;
+
     case Firm_OverrideSettings: return Config::FirmwareOverrideSettings != 0;
     }
 
@@ -495,6 +501,11 @@ u16 MP_RecvReplies(u8* data, u64 timestamp, u16 aidmask)
     return LocalMP::RecvReplies(data, timestamp, aidmask);
 }
 
+void MP_AdvanceTime(u64 timestamp)
+{
+    return LocalMP::AdvanceTime(timestamp);
+}
+
 bool LAN_Init()
 {
     if (Config::DirectLAN)
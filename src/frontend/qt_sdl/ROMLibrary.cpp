@@ -0,0 +1,249 @@
+/*
+    Copyright 2016-2022 melonDS team
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <filesystem>
+
+#include "ROMLibrary.h"
+#include "Platform.h"
+#include "NDS_Header.h"
+
+namespace fs = std::filesystem;
+
+
+namespace ROMLibrary
+{
+
+const char kCacheFile[] = "romlibrary.bin";
+const u32 kCacheMagic = 0x42494C4D; // 'MLIB'
+const u32 kCacheVersion = 2;
+
+// the banner data we care about: icon, palette and the original 6 titles
+const u32 kBannerReadLen = offsetof(NDSBanner, ChineseTitle);
+
+
+bool GetFileStats(const std::string& path, u64& size, s64& lastmodified)
+{
+    std::error_code err;
+    fs::path fpath = fs::u8path(path);
+
+    size = fs::file_size(fpath, err);
+    if (err) return false;
+
+    fs::file_time_type modtime = fs::last_write_time(fpath, err);
+    if (err) return false;
+
+    lastmodified = modtime.time_since_epoch().count();
+    return true;
+}
+
+bool IsROMFile(const std::string& path)
+{
+    // the recent files list also has archives and GBA ROMs
+    std::string ext = fs::u8path(path).extension().u8string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".nds" || ext == ".srl" || ext == ".dsi" || ext == ".ids";
+}
+
+u16 HeaderCRC16(const u8* data, u32 len)
+{
+    u32 crc = 0xFFFF;
+    for (u32 i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+    }
+    return crc;
+}
+
+bool ReadROMInfo(const std::string& path, u64 filesize, ROMInfo& info)
+{
+    memset(&info, 0, sizeof(info));
+
+    if (!IsROMFile(path))
+        return false;
+
+    FILE* f = Platform::OpenFile(path, "rb", true);
+    if (!f) return false;
+
+    // small homebrew can be shorter than a full header, the first 0x200 bytes are enough
+    NDSHeader header;
+    memset(&header, 0, sizeof(header));
+    size_t len = fread(&header, 1, sizeof(header), f);
+    if (len < 0x200 || HeaderCRC16((const u8*)&header, 0x15E) != header.HeaderCRC16)
+    {
+        fclose(f);
+        return false;
+    }
+
+    memcpy(info.GameTitle, header.GameTitle, 12);
+    memcpy(info.GameCode, header.GameCode, 4);
+    info.UnitCode = header.UnitCode;
+    info.ROMVersion = header.ROMVersion;
+
+    if (header.BannerOffset != 0 && ((u64)header.BannerOffset + kBannerReadLen) <= filesize)
+    {
+        NDSBanner banner;
+        fseek(f, header.BannerOffset, SEEK_SET);
+        if (fread(&banner, kBannerReadLen, 1, f) == 1)
+        {
+            memcpy(info.Icon, banner.Icon, sizeof(info.Icon));
+            memcpy(info.Palette, banner.Palette, sizeof(info.Palette));
+            memcpy(info.Title, banner.EnglishTitle, sizeof(info.Title));
+            info.HasBanner = 1;
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+
+// cache file:
+// header: magic, version, number of entries
+// entry: path length, path, file size, last-modified time, valid flag, ROMInfo if valid
+
+void LoadCache(std::unordered_map<std::string, Entry>& cache)
+{
+    cache.clear();
+
+    FILE* f = Platform::OpenLocalFile(kCacheFile, "rb");
+    if (!f) return;
+
+    u32 hdr[3];
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 || hdr[0] != kCacheMagic || hdr[1] != kCacheVersion)
+    {
+        fclose(f);
+        return;
+    }
+
+    cache.reserve(hdr[2]);
+    for (u32 i = 0; i < hdr[2]; i++)
+    {
+        Entry entry;
+        u32 pathlen;
+        u8 valid;
+
+        if (fread(&pathlen, 4, 1, f) != 1) break;
+        if (pathlen > 0x10000) break;
+
+        entry.Path.resize(pathlen);
+        if (pathlen && fread(&entry.Path[0], pathlen, 1, f) != 1) break;
+        if (fread(&entry.FileSize, 8, 1, f) != 1) break;
+        if (fread(&entry.LastModified, 8, 1, f) != 1) break;
+        if (fread(&valid, 1, 1, f) != 1) break;
+
+        entry.Valid = valid != 0;
+        if (entry.Valid)
+        {
+            if (fread(&entry.Info, sizeof(ROMInfo), 1, f) != 1) break;
+        }
+        else
+            memset(&entry.Info, 0, sizeof(ROMInfo));
+
+        cache[entry.Path] = entry;
+    }
+
+    fclose(f);
+}
+
+void SaveCache(const std::unordered_map<std::string, Entry>& cache)
+{
+    FILE* f = Platform::OpenLocalFile(kCacheFile, "wb");
+    if (!f) return;
+
+    u32 hdr[3] = {kCacheMagic, kCacheVersion, (u32)cache.size()};
+    fwrite(hdr, sizeof(hdr), 1, f);
+
+    for (const auto& [key, entry] : cache)
+    {
+        u32 pathlen = entry.Path.length();
+        u8 valid = entry.Valid ? 1 : 0;
+
+        fwrite(&pathlen, 4, 1, f);
+        fwrite(entry.Path.data(), pathlen, 1, f);
+        fwrite(&entry.FileSize, 8, 1, f);
+        fwrite(&entry.LastModified, 8, 1, f);
+        fwrite(&valid, 1, 1, f);
+        if (entry.Valid)
+            fwrite(&entry.Info, sizeof(ROMInfo), 1, f);
+    }
+
+    fclose(f);
+}
+
+
+std::vector<Entry> Scan(const std::vector<std::string>& files)
+{
+    std::unordered_map<std::string, Entry> cache;
+    LoadCache(cache);
+
+    std::vector<Entry> ret(files.size());
+    bool dirty = false;
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        Entry& entry = ret[i];
+        entry.Path = files[i];
+        entry.FileSize = 0;
+        entry.LastModified = 0;
+        entry.Valid = false;
+        memset(&entry.Info, 0, sizeof(ROMInfo));
+
+        auto it = cache.find(entry.Path);
+
+        if (!GetFileStats(entry.Path, entry.FileSize, entry.LastModified))
+        {
+            // the file is gone
+            if (it != cache.end())
+            {
+                cache.erase(it);
+                dirty = true;
+            }
+            continue;
+        }
+
+        if (it != cache.end() &&
+            it->second.FileSize == entry.FileSize &&
+            it->second.LastModified == entry.LastModified)
+        {
+            entry = it->second;
+            continue;
+        }
+
+        entry.Valid = ReadROMInfo(entry.Path, entry.FileSize, entry.Info);
+        cache[entry.Path] = entry;
+        dirty = true;
+    }
+
+    if (dirty)
+        SaveCache(cache);
+
+    return ret;
+}
+
+}
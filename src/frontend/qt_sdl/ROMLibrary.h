@@ -0,0 +1,70 @@
+/*
+    Copyright 2016-2022 melonDS team
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef ROMLIBRARY_H
+#define ROMLIBRARY_H
+
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+// indexer for ROM files, used for the icons and titles in the recent files menu
+//
+// only the header and the banner of each ROM are read. results are kept in an on-disk
+// cache, keyed by path, file size and last-modified time, so unchanged files aren't read
+// again on later scans
+//
+// only NDS/DSi ROMs with a valid header CRC are indexed: archives (and ROMs inside them)
+// and GBA ROMs come out as not valid
+
+namespace ROMLibrary
+{
+
+struct ROMInfo
+{
+    char GameTitle[12];
+    char GameCode[4];
+    u8 UnitCode;
+    u8 ROMVersion;
+    u8 HasBanner;
+    u8 Pad;
+
+    // banner icon (same format as in NDSBanner) and English title
+    u8 Icon[512];
+    u16 Palette[16];
+    char16_t Title[128];
+};
+
+struct Entry
+{
+    std::string Path;
+    u64 FileSize;
+    s64 LastModified;
+
+    bool Valid; // false if the file isn't a readable ROM
+    ROMInfo Info;
+};
+
+// indexes the given files
+// the result is in the same order as the input
+std::vector<Entry> Scan(const std::vector<std::string>& files);
+
+}
+
+#endif // ROMLIBRARY_H
@@ -21,6 +21,8 @@
 
 #include <string>
 #include <utility>
+#include <algorithm>
+#include <atomic>
 
 #ifdef ARCHIVE_SUPPORT_ENABLED
 #include "ArchiveUtil.h"
@@ -30,6 +32,7 @@
 #include "Platform.h"
 
 #include "NDS.h"
+#include "NDS_Header.h"
 #include "DSi.h"
 #include "SPI.h"
 #include "DSi_I2C.h"
@@ -57,6 +60,16 @@ std::string PreviousSaveFile = "";
 ARCodeFile* CheatFile = nullptr;
 bool CheatsOn = false;
 
+#ifdef ARCHIVE_SUPPORT_ENABLED
+// ROMs inside archives are extracted to a temporary file in chunks
+// the cart is inserted as soon as the parts needed to boot are out, the rest is
+// extracted on a separate thread while the game runs
+const u32 kROMStreamChunk = 0x100000;
+
+Platform::Thread* ROMStreamThread = nullptr;
+std::atomic_bool ROMStreamAbort;
+#endif
+
 
 int LastSep(std::string path)
 {
@@ -478,13 +491,99 @@ bool LoadBIOS()
     return true;
 }
 
+#ifdef ARCHIVE_SUPPORT_ENABLED
+bool ExtractROMChunks(Archive::ArchiveStream* stream, FILE* out, u8* buf, u32& pos, u32 end)
+{
+    while (pos < end)
+    {
+        s32 len = Archive::ReadFileInArchive(stream, buf, std::min(end - pos, kROMStreamChunk));
+        if (len <= 0) return false;
+        if (fwrite(buf, len, 1, out) != 1) return false;
+
+        pos += len;
+    }
+
+    fflush(out);
+    return true;
+}
+
+u32 ROMBootDataEnd(const NDSHeader& header, u32 filelen)
+{
+    // what gets read while inserting the cart and booting it:
+    // header, secure area, banner, and the ARM9/ARM7 binaries (plus their DSi counterparts)
+    u64 end = 0x8000;
+    auto region = [&](u32 offset, u32 size)
+    {
+        if ((u64)offset + size <= filelen)
+            end = std::max(end, (u64)offset + size);
+    };
+
+    bool dsi = (header.UnitCode & 0x02) != 0;
+
+    region(header.BannerOffset, dsi ? 0x23C0 : 0xA40);
+    region(header.ARM9ROMOffset, header.ARM9Size);
+    region(header.ARM7ROMOffset, header.ARM7Size);
+    if (dsi)
+    {
+        region(header.DSiARM9iROMOffset, header.DSiARM9iSize);
+        region(header.DSiARM7iROMOffset, header.DSiARM7iSize);
+    }
+
+    return (u32)std::min(end, (u64)filelen);
+}
+
+void ROMStreamFunc(Archive::ArchiveStream* stream, FILE* romfile, u8* buf, u32 pos, u32 filelen)
+{
+    bool failed = false;
+    while (pos < filelen && !ROMStreamAbort)
+    {
+        if (!ExtractROMChunks(stream, romfile, buf, pos, std::min(pos + kROMStreamChunk, filelen)))
+        {
+            printf("ROM extraction failed at %08X\n", pos);
+            failed = true;
+            break;
+        }
+
+        NDS::UpdateCartStream(pos);
+    }
+
+    // readers must not wait forever
+    // if the data is missing, they need to know so emulation gets stopped
+    // (when aborted, the cart is about to go away anyway)
+    if (failed)
+        NDS::AbortCartStream();
+    else
+        NDS::UpdateCartStream(filelen);
+
+    Archive::CloseFileInArchive(stream);
+    fclose(romfile);
+    delete[] buf;
+}
+#endif
+
+void StopROMStream()
+{
+#ifdef ARCHIVE_SUPPORT_ENABLED
+    if (!ROMStreamThread) return;
+
+    ROMStreamAbort = true;
+    Platform::Thread_Wait(ROMStreamThread);
+    Platform::Thread_Free(ROMStreamThread);
+    ROMStreamThread = nullptr;
+#endif
+}
 
 bool LoadROM(QStringList filepath, bool reset)
 {
     if (filepath.empty()) return false;
 
-    u8* filedata;
     u32 filelen;
+    FILE* romfile = nullptr;
+#ifdef ARCHIVE_SUPPORT_ENABLED
+    Archive::ArchiveStream* romstream = nullptr;
+    u8* romstreambuf = nullptr;
+    u32 romreadylen = 0;
+#endif
 
     std::string basepath;
     std::string romname;
@@ -494,30 +593,20 @@ bool LoadROM(QStringList filepath, bool reset)
     {
         // regular file
 
-        std::string filename = filepath.at(0).toStdString();
-        FILE* f = Platform::OpenFile(filename, "rb", true);
-        if (!f) return false;
+        // the file is kept open and handed to the core, which maps it instead of copying it
 
-        fseek(f, 0, SEEK_END);
-        long len = ftell(f);
-        if (len > 0x40000000)
-        {
-            fclose(f);
-            delete[] filedata;
-            return false;
-        }
+        std::string filename = filepath.at(0).toStdString();
+        romfile = Platform::OpenFile(filename, "rb", true);
+        if (!romfile) return false;
 
-        fseek(f, 0, SEEK_SET);
-        filedata = new u8[len];
-        size_t nread = fread(filedata, (size_t)len, 1, f);
-        if (nread != 1)
+        fseek(romfile, 0, SEEK_END);
+        long len = ftell(romfile);
+        if (len <= 0 || len > 0x40000000)
         {
-            fclose(f);
-            delete[] filedata;
+            fclose(romfile);
             return false;
         }
 
-        fclose(f);
         filelen = (u32)len;
 
         int pos = LastSep(filename);
@@ -528,15 +617,45 @@ bool LoadROM(QStringList filepath, bool reset)
     else if (num == 2)
     {
         // file inside archive
+        // only the part needed to boot is extracted here, see ROMStreamFunc() for the rest
 
-            s32 lenread = Archive::ExtractFileFromArchive(filepath.at(0), filepath.at(1), &filedata, &filelen);
-            if (lenread < 0) return false;
-            if (!filedata) return false;
-            if (lenread != filelen)
-            {
-                delete[] filedata;
-                return false;
-            }
+        romstream = Archive::OpenFileInArchive(filepath.at(0), filepath.at(1), &filelen);
+        if (!romstream) return false;
+
+        romfile = filelen ? tmpfile() : nullptr;
+        if (!romfile)
+        {
+            Archive::CloseFileInArchive(romstream);
+            return false;
+        }
+
+        // give the file its final size upfront so it can be mapped entirely
+        fseek(romfile, filelen-1, SEEK_SET);
+        fputc(0, romfile);
+        fseek(romfile, 0, SEEK_SET);
+
+        romstreambuf = new u8[kROMStreamChunk];
+
+        NDSHeader header;
+        memset(&header, 0, sizeof(header));
+
+        bool ok = ExtractROMChunks(romstream, romfile, romstreambuf, romreadylen, std::min(filelen, (u32)sizeof(header)));
+        if (ok)
+        {
+            fseek(romfile, 0, SEEK_SET);
+            fread(&header, romreadylen, 1, romfile);
+            fseek(romfile, romreadylen, SEEK_SET);
+
+            ok = ExtractROMChunks(romstream, romfile, romstreambuf, romreadylen, ROMBootDataEnd(header, filelen));
+        }
+
+        if (!ok)
+        {
+            Archive::CloseFileInArchive(romstream);
+            fclose(romfile);
+            delete[] romstreambuf;
+            return false;
+        }
 
         std::string std_archivepath = filepath.at(0).toStdString();
         basepath = std_archivepath.substr(0, LastSep(std_archivepath));
@@ -548,6 +667,8 @@ bool LoadROM(QStringList filepath, bool reset)
     else
         return false;
 
+    StopROMStream();
+
     if (NDSSave) delete NDSSave;
     NDSSave = nullptr;
 
@@ -570,6 +691,7 @@ bool LoadROM(QStringList filepath, bool reset)
     std::string origsav = savname;
     savname += Platform::InstanceFileSuffix();
 
+    SaveManager::RecoverJournal(savname);
     FILE* sav = Platform::OpenFile(savname, "rb", true);
     if (!sav) sav = Platform::OpenFile(origsav, "rb", true);
     if (sav)
@@ -583,7 +705,41 @@ bool LoadROM(QStringList filepath, bool reset)
         fclose(sav);
     }
 
-    bool res = NDS::LoadCart(filedata, filelen, savedata, savelen);
+    bool res;
+#ifdef ARCHIVE_SUPPORT_ENABLED
+    if (romstream)
+    {
+        res = NDS::LoadCartStream(romfile, filelen, romreadylen, savedata, savelen);
+        if (!res && romreadylen < filelen)
+        {
+            // the core can't stream this (no file mapping), extract everything and retry
+            if (ExtractROMChunks(romstream, romfile, romstreambuf, romreadylen, filelen))
+                res = NDS::LoadCartStream(romfile, filelen, romreadylen, savedata, savelen);
+        }
+
+        if (res && romreadylen < filelen)
+        {
+            // the extraction thread takes over the archive and the file
+            ROMStreamAbort = false;
+            ROMStreamThread = Platform::Thread_Create([=]()
+            {
+                ROMStreamFunc(romstream, romfile, romstreambuf, romreadylen, filelen);
+            });
+        }
+        else
+        {
+            Archive::CloseFileInArchive(romstream);
+            fclose(romfile);
+            delete[] romstreambuf;
+        }
+    }
+    else
+#endif
+    {
+        res = NDS::LoadCart(romfile, filelen, savedata, savelen);
+        fclose(romfile);
+    }
+
     if (res && reset)
     {
         if (Config::DirectBoot || NDS::NeedsDirectBoot())
@@ -601,7 +757,6 @@ bool LoadROM(QStringList filepath, bool reset)
     }
 
     if (savedata) delete[] savedata;
-    delete[] filedata;
     return res;
 }
 
@@ -612,6 +767,7 @@ void EjectCart()
 
     UnloadCheats();
 
+    StopROMStream();
     NDS::EjectCart();
 
     CartType = -1;
@@ -723,6 +879,7 @@ bool LoadGBAROM(QStringList filepath)
     std::string origsav = savname;
     savname += Platform::InstanceFileSuffix();
 
+    SaveManager::RecoverJournal(savname);
     FILE* sav = Platform::OpenFile(savname, "rb", true);
     if (!sav) sav = Platform::OpenFile(origsav, "rb", true);
     if (sav)
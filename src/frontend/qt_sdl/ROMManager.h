@@ -38,6 +38,8 @@ bool LoadBIOS();
 
 bool LoadROM(QStringList filepath, bool reset);
 void EjectCart();
+// stops extracting the current ROM, if it's being streamed out of an archive
+void StopROMStream();
 bool CartInserted();
 QString CartLabel();
 
@@ -16,11 +16,47 @@
     with melonDS. If not, see http://www.gnu.org/licenses/.
 */
 
+
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#include <QFile>
+#include <QSaveFile>
 
 #include "SaveManager.h"
 #include "Platform.h"
+#include "CRC32.h"
+
+
+// writes closer than this get merged into a single range
+const u32 kDirtyRangeGap = 0x200;
+// past this many separate ranges, the whole save is rewritten
+const size_t kMaxDirtyRanges = 64;
+
+// partial writes go through a journal next to the save:
+// header: magic, save length, number of ranges
+// range: start, length, data
+// then a CRC32 of all of the above
+// it's committed (synced and renamed into place) before the save is touched, and
+// removed once the save is synced. if we crash in between, the journal is replayed
+// the next time the save is loaded, so the save never ends up half-updated
+const u32 kJournalMagic = 0x4C4A534D; // 'MSJL'
+const char kJournalSuffix[] = ".journal";
+
+
+static bool SyncFile(FILE* f)
+{
+    if (fflush(f) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
 
 
 SaveManager::SaveManager(std::string path) : QThread()
@@ -28,6 +64,8 @@ SaveManager::SaveManager(std::string path) : QThread()
     SecondaryBuffer = nullptr;
     SecondaryBufferLength = 0;
     SecondaryBufferLock = new QMutex();
+    FlushCond = new QWaitCondition();
+    SecondaryDirtyAll = false;
 
     Running = false;
 
@@ -36,6 +74,7 @@ SaveManager::SaveManager(std::string path) : QThread()
     Buffer = nullptr;
     Length = 0;
     FlushRequested = false;
+    DirtyAll = false;
 
     FlushVersion = 0;
     PreviousFlushVersion = 0;
@@ -52,13 +91,18 @@ SaveManager::~SaveManager()
 {
     if (Running)
     {
+        SecondaryBufferLock->lock();
         Running = false;
+        FlushCond->wakeOne();
+        SecondaryBufferLock->unlock();
+
         wait();
         FlushSecondaryBuffer();
     }
 
     if (SecondaryBuffer) delete[] SecondaryBuffer;
 
+    delete FlushCond;
     delete SecondaryBufferLock;
 
     if (Buffer) delete[] Buffer;
@@ -75,6 +119,8 @@ void SaveManager::SetPath(std::string path, bool reload)
 
     if (reload)
     {
+        RecoverJournal(Path);
+
         FILE* f = Platform::OpenFile(Path, "rb", true);
         if (f)
         {
@@ -83,7 +129,35 @@ void SaveManager::SetPath(std::string path, bool reload)
         }
     }
     else
+    {
+        // the new file needs all of it
+        DirtyAll = true;
         FlushRequested = true;
+    }
+}
+
+void SaveManager::AddDirtyRange(std::vector<DirtyRange>& ranges, bool& all, u32 start, u32 end)
+{
+    if (all || start >= end) return;
+
+    // the list is kept sorted and without overlaps
+    auto it = std::lower_bound(ranges.begin(), ranges.end(), start,
+                               [](const DirtyRange& r, u32 val) { return (r.End + kDirtyRangeGap) < val; });
+
+    while (it != ranges.end() && it->Start <= (end + kDirtyRangeGap))
+    {
+        start = std::min(start, it->Start);
+        end = std::max(end, it->End);
+        it = ranges.erase(it);
+    }
+
+    ranges.insert(it, {start, end});
+
+    if (ranges.size() > kMaxDirtyRanges)
+    {
+        ranges.clear();
+        all = true;
+    }
 }
 
 void SaveManager::RequestFlush(const u8* savedata, u32 savelen, u32 writeoffset, u32 writelen)
@@ -96,6 +170,7 @@ void SaveManager::RequestFlush(const u8* savedata, u32 savelen, u32 writeoffset,
         Buffer = new u8[Length];
 
         memcpy(Buffer, savedata, Length);
+        DirtyAll = true;
     }
     else
     {
@@ -103,13 +178,16 @@ void SaveManager::RequestFlush(const u8* savedata, u32 savelen, u32 writeoffset,
         {
             u32 len = savelen - writeoffset;
             memcpy(&Buffer[writeoffset], &savedata[writeoffset], len);
+            AddDirtyRange(Dirty, DirtyAll, writeoffset, savelen);
             len = writelen - len;
             if (len > savelen) len = savelen;
             memcpy(&Buffer[0], &savedata[0], len);
+            AddDirtyRange(Dirty, DirtyAll, 0, len);
         }
         else
         {
             memcpy(&Buffer[writeoffset], &savedata[writeoffset], writelen);
+            AddDirtyRange(Dirty, DirtyAll, writeoffset, writeoffset+writelen);
         }
     }
 
@@ -130,33 +208,124 @@ void SaveManager::CheckFlush()
 
         SecondaryBufferLength = Length;
         SecondaryBuffer = new u8[SecondaryBufferLength];
+        DirtyAll = true;
     }
 
-    memcpy(SecondaryBuffer, Buffer, Length);
+    // only the ranges written since the last check are copied over
+    if (DirtyAll)
+    {
+        memcpy(SecondaryBuffer, Buffer, Length);
+        SecondaryDirty.clear();
+        SecondaryDirtyAll = true;
+    }
+    else
+    {
+        for (const DirtyRange& r : Dirty)
+        {
+            memcpy(&SecondaryBuffer[r.Start], &Buffer[r.Start], r.End - r.Start);
+            AddDirtyRange(SecondaryDirty, SecondaryDirtyAll, r.Start, r.End);
+        }
+    }
+
+    Dirty.clear();
+    DirtyAll = false;
 
     FlushRequested = false;
     FlushVersion++;
     TimeAtLastFlushRequest = time(nullptr);
 
+    FlushCond->wakeOne();
     SecondaryBufferLock->unlock();
 }
 
 void SaveManager::run()
 {
-    for (;;)
-    {
-        QThread::msleep(100);
+    SecondaryBufferLock->lock();
 
-        if (!Running) return;
+    while (Running)
+    {
+        if (!NeedsFlush() || TimeAtLastFlushRequest == 0)
+        {
+            // sleep until CheckFlush() hands us something
+            FlushCond->wait(SecondaryBufferLock);
+            continue;
+        }
 
         // We debounce for two seconds after last flush request to ensure that writing has finished.
-        if (TimeAtLastFlushRequest == 0 || difftime(time(nullptr), TimeAtLastFlushRequest) < 2)
+        double elapsed = difftime(time(nullptr), TimeAtLastFlushRequest);
+        if (elapsed < 2)
         {
+            FlushCond->wait(SecondaryBufferLock, (unsigned long)((2 - elapsed) * 1000));
             continue;
         }
 
-        FlushSecondaryBuffer();
+        WriteSecondaryBuffer();
+    }
+
+    SecondaryBufferLock->unlock();
+}
+
+void SaveManager::WriteSecondaryBuffer()
+{
+    // must be called with SecondaryBufferLock held
+
+    bool written = false;
+
+    if (!SecondaryDirtyAll)
+    {
+        // only write back what changed, if the file is there and has the right size
+        // the ranges are journaled first, see above
+        FILE* f = Platform::OpenFile(Path, "r+b", true);
+        if (f)
+        {
+            fseek(f, 0, SEEK_END);
+            if ((u32)ftell(f) == SecondaryBufferLength && WriteJournal())
+            {
+                written = true;
+                for (const DirtyRange& r : SecondaryDirty)
+                {
+                    fseek(f, r.Start, SEEK_SET);
+                    if (fwrite(&SecondaryBuffer[r.Start], r.End - r.Start, 1, f) != 1)
+                    {
+                        written = false;
+                        break;
+                    }
+                }
+
+                if (!SyncFile(f))
+                    written = false;
+
+                if (written)
+                    printf("SaveManager: Written (%d ranges)\n", (int)SecondaryDirty.size());
+            }
+
+            fclose(f);
+
+            // if the in-place write failed, the full rewrite below supersedes the journal
+            QFile::remove(QString::fromStdString(Path + kJournalSuffix));
+        }
+    }
+
+    if (!written)
+    {
+        // the whole file goes to a temporary file which then replaces the old one,
+        // so a crash midway can't leave a truncated save behind
+        QSaveFile f(QString::fromStdString(Path));
+        if (f.open(QIODevice::WriteOnly))
+        {
+            f.write((const char*)SecondaryBuffer, SecondaryBufferLength);
+            if (f.commit())
+                printf("SaveManager: Written\n");
+            else
+                printf("SaveManager: failed to write %s\n", Path.c_str());
+        }
     }
+
+    SecondaryDirty.clear();
+    SecondaryDirtyAll = false;
+
+    PreviousFlushVersion = FlushVersion;
+    TimeAtLastFlushRequest = 0;
 }
 
 void SaveManager::FlushSecondaryBuffer(u8* dst, u32 dstLength)
@@ -172,20 +341,102 @@ void SaveManager::FlushSecondaryBuffer(u8* dst, u32 dstLength)
     if (dst)
     {
         memcpy(dst, SecondaryBuffer, SecondaryBufferLength);
+        PreviousFlushVersion = FlushVersion;
+        TimeAtLastFlushRequest = 0;
     }
     else
     {
-        FILE* f = Platform::OpenFile(Path, "wb");
+        WriteSecondaryBuffer();
+    }
+    SecondaryBufferLock->unlock();
+}
+
+bool SaveManager::WriteJournal()
+{
+    std::vector<u8> journal;
+    auto put32 = [&](u32 val) { journal.insert(journal.end(), (u8*)&val, (u8*)&val + 4); };
+
+    put32(kJournalMagic);
+    put32(SecondaryBufferLength);
+    put32((u32)SecondaryDirty.size());
+    for (const DirtyRange& r : SecondaryDirty)
+    {
+        put32(r.Start);
+        put32(r.End - r.Start);
+        journal.insert(journal.end(), &SecondaryBuffer[r.Start], &SecondaryBuffer[r.End]);
+    }
+    put32(CRC32(journal.data(), (int)journal.size()));
+
+    QSaveFile f(QString::fromStdString(Path + kJournalSuffix));
+    if (!f.open(QIODevice::WriteOnly))
+        return false;
+
+    f.write((const char*)journal.data(), journal.size());
+    return f.commit();
+}
+
+void SaveManager::RecoverJournal(const std::string& path)
+{
+    std::string jpath = path + kJournalSuffix;
+    FILE* jf = Platform::OpenFile(jpath, "rb", true);
+    if (!jf) return;
+
+    std::vector<u8> journal;
+    fseek(jf, 0, SEEK_END);
+    long jlen = ftell(jf);
+    fseek(jf, 0, SEEK_SET);
+    if (jlen >= 16)
+    {
+        journal.resize(jlen);
+        if (fread(journal.data(), jlen, 1, jf) != 1)
+            journal.clear();
+    }
+    fclose(jf);
+
+    bool valid = false;
+    if (!journal.empty())
+    {
+        u32 crc;
+        memcpy(&crc, &journal[journal.size() - 4], 4);
+        valid = *(u32*)&journal[0] == kJournalMagic &&
+                CRC32(journal.data(), (int)journal.size() - 4) == crc;
+    }
+
+    // a journal that didn't make it to disk in full was never applied, the save is intact
+    if (valid)
+    {
+        FILE* f = Platform::OpenFile(path, "r+b", true);
         if (f)
         {
-            printf("SaveManager: Written\n");
-            fwrite(SecondaryBuffer, SecondaryBufferLength, 1, f);
+            u32 savelen = *(u32*)&journal[4];
+            u32 numranges = *(u32*)&journal[8];
+
+            fseek(f, 0, SEEK_END);
+            if ((u32)ftell(f) == savelen)
+            {
+                size_t pos = 12;
+                for (u32 i = 0; i < numranges; i++)
+                {
+                    if (pos + 8 > journal.size() - 4) break;
+                    u32 start = *(u32*)&journal[pos];
+                    u32 len = *(u32*)&journal[pos + 4];
+                    pos += 8;
+                    if (pos + len > journal.size() - 4 || (u64)start + len > savelen) break;
+
+                    fseek(f, start, SEEK_SET);
+                    fwrite(&journal[pos], len, 1, f);
+                    pos += len;
+                }
+
+                SyncFile(f);
+                printf("SaveManager: replayed interrupted write to %s\n", path.c_str());
+            }
+
             fclose(f);
         }
     }
-    PreviousFlushVersion = FlushVersion;
-    TimeAtLastFlushRequest = 0;
-    SecondaryBufferLock->unlock();
+
+    QFile::remove(QString::fromStdString(jpath));
 }
 
 bool SaveManager::NeedsFlush()
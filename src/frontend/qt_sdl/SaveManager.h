@@ -20,11 +20,13 @@
 #define SAVEMANAGER_H
 
 #include <string>
+#include <vector>
 #include <unistd.h>
 #include <time.h>
 #include <atomic>
 #include <QThread>
 #include <QMutex>
+#include <QWaitCondition>
 
 #include "types.h"
 
@@ -46,7 +48,20 @@ public:
     bool NeedsFlush();
     void FlushSecondaryBuffer(u8* dst = nullptr, u32 dstLength = 0);
 
+    // finishes a partial write that was interrupted, must be called before the save is read
+    static void RecoverJournal(const std::string& path);
+
 private:
+    // byte range [Start, End) of the save that was written to
+    struct DirtyRange
+    {
+        u32 Start, End;
+    };
+
+    static void AddDirtyRange(std::vector<DirtyRange>& ranges, bool& all, u32 start, u32 end);
+    bool WriteJournal();
+    void WriteSecondaryBuffer();
+
     std::string Path;
 
     std::atomic_bool Running;
@@ -54,10 +69,15 @@ private:
     u8* Buffer;
     u32 Length;
     bool FlushRequested;
+    std::vector<DirtyRange> Dirty;
+    bool DirtyAll;
 
     QMutex* SecondaryBufferLock;
+    QWaitCondition* FlushCond;
     u8* SecondaryBuffer;
     u32 SecondaryBufferLength;
+    std::vector<DirtyRange> SecondaryDirty;
+    bool SecondaryDirtyAll;
 
     time_t TimeAtLastFlushRequest;
 
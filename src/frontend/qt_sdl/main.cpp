@@ -67,6 +67,7 @@
 #include "WifiSettingsDialog.h"
 #include "InterfaceSettingsDialog.h"
 #include "ROMInfoDialog.h"
+#include "ROMLibrary.h"
 #include "RAMInfoDialog.h"
 #include "TitleManagerDialog.h"
 #include "PowerManagement/PowerManagementDialog.h"
@@ -145,12 +146,17 @@ void audioCallback(void* data, Uint8* stream, int len)
 
     // resample incoming audio to match the output sample rate
 
+    Frontend::AudioOut_SetFillLevel(SPU::GetOutputSize(), Config::AudioRateControl ? 1024 : 0);
+
     int len_in = Frontend::AudioOut_GetNumSamples(len);
     s16 buf_in[1024*2];
     int num_in;
 
-    SDL_LockMutex(audioSyncLock);
+    if (len_in > 1024) len_in = 1024;
+
+    // the SPU output buffer is lock-free, the lock is only needed to not miss the wakeup
     num_in = SPU::ReadOutput(buf_in, len_in);
+    SDL_LockMutex(audioSyncLock);
     SDL_CondSignal(audioSync);
     SDL_UnlockMutex(audioSyncLock);
 
@@ -160,16 +166,7 @@ void audioCallback(void* data, Uint8* stream, int len)
         return;
     }
 
-    int margin = 6;
-    if (num_in < len_in-margin)
-    {
-        int last = num_in-1;
-
-        for (int i = num_in; i < len_in-margin; i++)
-            ((u32*)buf_in)[i] = ((u32*)buf_in)[last];
-
-        num_in = len_in-margin;
-    }
+    // if we got less than we asked for, the resampler repeats the last sample
 
     Frontend::AudioOut_Resample(buf_in, num_in, (s16*)stream, len, Config::AudioVolume);
 }
@@ -528,6 +525,7 @@ void EmuThread::run()
     double lastMeasureTime = lastTime;
 
     u32 winUpdateCount = 0, winUpdateFreq = 1;
+    u32 lastAudioUnderruns = 0;
 
     char melontitle[100];
 
@@ -685,7 +683,13 @@ void EmuThread::run()
                 oglContext->SetSwapInterval(0);
             }
 
-            if (Config::AudioSync && !fastforward && audioDevice)
+            // if the audio output ran dry since last frame, the host isn't keeping up
+            // and waiting for the buffer to drain would only add to the latency
+            u32 audioUnderruns = SPU::GetOutputUnderruns();
+            bool audioStarved = audioUnderruns != lastAudioUnderruns;
+            lastAudioUnderruns = audioUnderruns;
+
+            if (Config::AudioSync && !fastforward && audioDevice && !audioStarved)
             {
                 SDL_LockMutex(audioSyncLock);
                 while (SPU::GetOutputSize() > 1024)
@@ -785,6 +789,9 @@ void EmuThread::run()
 
     EmuStatus = 0;
 
+    // the extraction thread feeds the cart, it must be done before the cart goes away
+    ROMManager::StopROMStream();
+
     GPU::DeInitRenderer();
     NDS::DeInit();
     //Platform::LAN_DeInit();
@@ -1472,6 +1479,8 @@ MainWindow::MainWindow(QWidget* parent) : QMainWindow(parent)
         actOpenROMArchive->setShortcut(QKeySequence(Qt::Key_O | Qt::CTRL | Qt::SHIFT));*/
 
         recentMenu = menu->addMenu("最近打开");
+        // the ROM titles are shown as tooltips
+        recentMenu->setToolTipsVisible(true);
         for (int i = 0; i < 10; ++i)
         {
             std::string item = Config::RecentROMList[i];
@@ -2353,6 +2362,12 @@ void MainWindow::updateRecentFilesMenu()
 {
     recentMenu->clear();
 
+    // icons for the NDS ROMs in the list (archives and GBA ROMs aren't indexed)
+    std::vector<std::string> recentpaths;
+    for (int i = 0; i < recentFileList.size() && i < 10; ++i)
+        recentpaths.push_back(recentFileList.at(i).toStdString());
+    std::vector<ROMLibrary::Entry> recentinfo = ROMLibrary::Scan(recentpaths);
+
     for (int i = 0; i < recentFileList.size(); ++i)
     {
         if (i >= 10) break;
@@ -2381,6 +2396,21 @@ void MainWindow::updateRecentFilesMenu()
 
         QAction *actRecentFile_i = recentMenu->addAction(QString("%1.  %2").arg(i+1).arg(item_display));
         actRecentFile_i->setData(item_full);
+
+        ROMLibrary::Entry& info = recentinfo[i];
+        if (info.Valid && info.Info.HasBanner)
+        {
+            u32 icondata[32*32];
+            ROMManager::ROMIcon(info.Info.Icon, info.Info.Palette, icondata);
+            QImage iconimg((const uchar*)icondata, 32, 32, QImage::Format_ARGB32);
+            actRecentFile_i->setIcon(QIcon(QPixmap::fromImage(iconimg.copy())));
+
+            int titlelen = 0;
+            while (titlelen < 128 && info.Info.Title[titlelen]) titlelen++;
+            QString title = QString::fromUtf16(info.Info.Title, titlelen);
+            title.replace("\n", " · ");
+            actRecentFile_i->setToolTip(title);
+        }
         connect(actRecentFile_i, &QAction::triggered, this, &MainWindow::onClickRecentFile);
 
         Config::RecentROMList[i] = recentFileList.at(i).toStdString();
@@ -2971,6 +3001,7 @@ void MainWindow::onMPSettingsFinished(int res)
 {
     audioMute();
     LocalMP::SetRecvTimeout(Config::MPRecvTimeout);
+    LocalMP::SetLockstep(Config::MPLockstep);
 
     emuThread->emuUnpause();
 }
@@ -0,0 +1,162 @@
+/*
+    Copyright 2016-2022 melonDS team
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// differential test for the geometry math kernels
+//
+// every implementation the host CPU supports is run against the scalar one
+// on random matrices and vectors, the results must be bit-identical
+//
+// usage: geometry_test [iterations] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+
+#include "GPU3D_Geometry.h"
+
+using namespace GPU3D;
+
+const char* ImplNames[] = {"scalar", "SSE4.1", "AVX2", "NEON"};
+const int NumImpls = sizeof(ImplNames) / sizeof(ImplNames[0]);
+
+std::mt19937 RNG;
+
+s32 RandomValue()
+{
+    // mostly values in the range the games use (20.12 around +-8.0),
+    // sometimes full-range values to exercise the overflow behavior
+    if ((RNG() & 7) == 0)
+        return (s32)RNG();
+
+    return (s32)(RNG() & 0xFFFF) - 0x8000;
+}
+
+void RandomFill(s32* data, int len)
+{
+    for (int i = 0; i < len; i++)
+        data[i] = RandomValue();
+}
+
+struct Results
+{
+    s32 Matrix[4][16];
+    s32 Vec4[4];
+    s32 Vec3[3];
+    s32 Diff[4];
+    s32 Shine[4];
+};
+
+void RunKernels(Results& res, const s32* m, const s32* s, const s32* v, const s16 (*lightdir)[3])
+{
+    memset(&res, 0, sizeof(res));
+
+    // the matrix commands multiply 3 or 4 rows, but any count has to work
+    for (int rows = 1; rows <= 4; rows++)
+    {
+        memcpy(res.Matrix[rows-1], m, 16*4);
+        Geometry::MatrixMult(res.Matrix[rows-1], s, rows);
+    }
+
+    Geometry::VecMult4x4(res.Vec4, v, m);
+    Geometry::VecMult3x3(res.Vec3, v, m);
+    Geometry::LightDots(res.Diff, res.Shine, lightdir, v);
+}
+
+void PrintArray(const char* name, const s32* data, int len)
+{
+    printf("  %s:", name);
+    for (int i = 0; i < len; i++)
+        printf(" %08X", data[i]);
+    printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = 100000;
+    u32 seed = 12345;
+    if (argc > 1) iterations = atoi(argv[1]);
+    if (argc > 2) seed = strtoul(argv[2], nullptr, 0);
+
+    RNG.seed(seed);
+
+    int failures = 0;
+    int tested = 0;
+
+    for (int impl = 1; impl < NumImpls; impl++)
+    {
+        if (!Geometry::SetImpl(impl))
+            continue;
+
+        printf("testing %s (%d iterations, seed %u)\n", ImplNames[Geometry::GetImpl()], iterations, seed);
+        tested++;
+
+        RNG.seed(seed);
+        int implfailures = 0;
+        for (int i = 0; i < iterations; i++)
+        {
+            s32 m[16], s[16], v[4];
+            s16 lightdir[4][3];
+
+            RandomFill(m, 16);
+            RandomFill(s, 16);
+            RandomFill(v, 4);
+            for (int l = 0; l < 4; l++)
+                for (int c = 0; c < 3; c++)
+                    lightdir[l][c] = (s16)RNG();
+
+            Results ref, res;
+            Geometry::SetImpl(Geometry::Impl_Scalar);
+            RunKernels(ref, m, s, v, lightdir);
+            Geometry::SetImpl(impl);
+            RunKernels(res, m, s, v, lightdir);
+
+            if (memcmp(&ref, &res, sizeof(Results)) == 0)
+                continue;
+
+            if (implfailures++ < 8)
+            {
+                printf("mismatch at iteration %d\n", i);
+                PrintArray("m", m, 16);
+                PrintArray("s", s, 16);
+                PrintArray("v", v, 4);
+                printf(" expected:\n");
+                PrintArray("matrix", ref.Matrix[3], 16);
+                PrintArray("vec4", ref.Vec4, 4);
+                PrintArray("vec3", ref.Vec3, 3);
+                PrintArray("diff", ref.Diff, 4);
+                PrintArray("shine", ref.Shine, 4);
+                printf(" got:\n");
+                PrintArray("matrix", res.Matrix[3], 16);
+                PrintArray("vec4", res.Vec4, 4);
+                PrintArray("vec3", res.Vec3, 3);
+                PrintArray("diff", res.Diff, 4);
+                PrintArray("shine", res.Shine, 4);
+            }
+        }
+
+        if (implfailures)
+            printf("%s: %d mismatches\n", ImplNames[impl], implfailures);
+        failures += implfailures;
+    }
+
+    if (!tested)
+        printf("no SIMD implementation supported on this CPU, nothing to test\n");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,366 @@
+/*
+    Copyright 2016-2022 melonDS team
+
+    This file is part of melonDS.
+
+    melonDS is free software: you can redistribute it and/or modify it under
+    the terms of the GNU General Public License as published by the Free
+    Software Foundation, either version 3 of the License, or (at your option)
+    any later version.
+
+    melonDS is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+    FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with melonDS. If not, see http://www.gnu.org/licenses/.
+*/
+
+// differential test for the batched SPU mixer
+//
+// the SPU is run against a minimal scheduler and main RAM, on a script of
+// register writes and of CPU writes to the sound buffers while they're playing:
+// a double-buffered stream refilled on timer IRQs, random writes all over the
+// buffers, and a channel playing back what sound capture writes.
+// the output and the capture buffer must be bit-identical to mixing every sample
+// at the time it's due
+//
+// usage: spu_test [samples] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "NDS.h"
+#include "DSi.h"
+#include "SPU.h"
+
+// the parts of the system the SPU uses
+
+struct
+{
+    bool Scheduled;
+    u64 Timestamp;
+    void (*Func)(u32);
+    u32 Param;
+} SPUEvent;
+
+const u32 RAMMask = 0x3FFFFF;
+u8 RAM[RAMMask + 1];
+
+namespace NDS
+{
+
+int ConsoleType;
+u64 SysTimestamp;
+u64 ARM7Timestamp;
+
+void ScheduleEvent(u32 id, u64 timestamp, void (*func)(u32), u32 param)
+{
+    SPUEvent.Scheduled = true;
+    SPUEvent.Timestamp = timestamp;
+    SPUEvent.Func = func;
+    SPUEvent.Param = param;
+}
+
+void CancelEvent(u32 id)
+{
+    SPUEvent.Scheduled = false;
+}
+
+u32 ARM7Read32(u32 addr)
+{
+    if ((addr & 0xFF000000) != 0x02000000) return 0;
+    return *(u32*)&RAM[addr & RAMMask & ~3];
+}
+
+void ARM7Write32(u32 addr, u32 val)
+{
+    if ((addr & 0xFF000000) != 0x02000000) return;
+    *(u32*)&RAM[addr & RAMMask & ~3] = val;
+}
+
+}
+
+namespace DSi
+{
+
+u32 ARM7Read32(u32 addr) { return NDS::ARM7Read32(addr); }
+void ARM7Write32(u32 addr, u32 val) { NDS::ARM7Write32(addr, val); }
+
+}
+
+void Savestate::Section(const char* magic) {}
+void Savestate::Var8(u8* var) {}
+void Savestate::Var16(u16* var) {}
+void Savestate::Var32(u32* var) {}
+void Savestate::Var64(u64* var) {}
+void Savestate::VarArray(void* data, u32 len) {}
+
+
+enum
+{
+    Action_RAMWrite = 0,
+    Action_SPUWrite16,
+    Action_SPUWrite32,
+    Action_Transfer,
+};
+
+struct Action
+{
+    u64 Time;
+    u32 Type;
+    u32 Addr;
+    u32 Val;
+
+    bool operator<(const Action& other) const { return Time < other.Time; }
+};
+
+const u32 StreamAddr = 0x02000000;  // PCM16, double-buffered
+const u32 StreamHalf = 256;         // samples per half
+const u32 StreamTimer = 380;        // 16MHz ticks per sample
+const u32 PCM8Addr = 0x02001000;
+const u32 ADPCMAddr = 0x02002000;
+const u32 CaptureAddr = 0x02003000;
+const u32 CaptureLen = 256;         // words
+
+std::mt19937 RNG;
+
+u32 Random(u32 min, u32 max)
+{
+    return min + (RNG() % (max - min + 1));
+}
+
+std::vector<Action> MakeScript(u32 samples)
+{
+    std::vector<Action> script;
+    const u64 end = (u64)samples * 1024;
+
+    auto add = [&](u64 time, u32 type, u32 addr, u32 val)
+    {
+        script.push_back({time, type, addr, val});
+    };
+
+    add(100, Action_SPUWrite16, 0x04000500, 0x807F);
+    add(100, Action_SPUWrite16, 0x04000504, 0x200);
+
+    // channel 0: looping PCM16 stream, half the buffer is refilled on every timer IRQ
+    add(200, Action_SPUWrite32, 0x04000404, StreamAddr);
+    add(200, Action_SPUWrite32, 0x04000408, 0x10000 - StreamTimer);
+    add(200, Action_SPUWrite32, 0x0400040C, StreamHalf);
+    u64 streamstart = 300;
+    add(streamstart, Action_SPUWrite32, 0x04000400, 0xA840007F);
+
+    const u64 halfcycles = (u64)StreamHalf * StreamTimer * 2;
+    for (u32 k = 1; streamstart + k*halfcycles < end; k++)
+    {
+        // the IRQ handler copies a word every few cycles
+        u64 time = streamstart + k*halfcycles + Random(0, 4000);
+        u32 half = (k - 1) & 1;
+        for (u32 i = 0; i < StreamHalf*2; i += 4)
+        {
+            add(time, Action_RAMWrite, StreamAddr + half*StreamHalf*2 + i, RNG());
+            time += Random(4, 24);
+        }
+    }
+
+    // channel 2: looping PCM8
+    add(400, Action_SPUWrite32, 0x04000424, PCM8Addr);
+    add(400, Action_SPUWrite32, 0x04000428, (16 << 16) | (0x10000 - 611));
+    add(400, Action_SPUWrite32, 0x0400042C, 200);
+    add(500, Action_SPUWrite32, 0x04000420, 0x8860407F);
+
+    // channel 4: looping ADPCM
+    add(600, Action_SPUWrite32, 0x04000444, ADPCMAddr);
+    add(600, Action_SPUWrite32, 0x04000448, (1 << 16) | (0x10000 - 1489));
+    add(600, Action_SPUWrite32, 0x0400044C, 300);
+    add(700, Action_SPUWrite32, 0x04000440, 0xC820007F);
+
+    // channel 8: PSG, doesn't touch memory
+    add(800, Action_SPUWrite32, 0x04000488, 0x10000 - 2000);
+    add(800, Action_SPUWrite32, 0x04000480, 0xE3500030);
+
+    // channel 3 plays back what capture 1 writes, capture is turned on and off
+    add(900, Action_SPUWrite32, 0x04000434, CaptureAddr);
+    add(900, Action_SPUWrite32, 0x04000438, 0x10000 - 512);
+    add(900, Action_SPUWrite32, 0x0400043C, CaptureLen);
+    add(900, Action_SPUWrite32, 0x04000518, CaptureAddr);
+    add(900, Action_SPUWrite16, 0x0400051C, CaptureLen);
+    add(1000, Action_SPUWrite32, 0x04000430, 0xA860007F);
+    for (u64 time = 50000; time < end; time += Random(200000, 2000000))
+    {
+        add(time, Action_SPUWrite16, 0x04000508, 0x8000);
+        time += Random(50000, 1000000);
+        add(time, Action_SPUWrite16, 0x04000508, 0x0000);
+    }
+
+    // random CPU writes to the sound buffers, some of them land right where the channels read
+    for (u64 time = 1000; time < end; time += Random(50, 1500))
+    {
+        u32 addr;
+        switch (Random(0, 3))
+        {
+        case 0: addr = StreamAddr + Random(0, StreamHalf*4 - 4); break;
+        case 1: addr = PCM8Addr + Random(0, 216*4 - 4); break;
+        case 2: addr = ADPCMAddr + Random(0, 301*4 - 4); break;
+        default: addr = CaptureAddr + Random(0, CaptureLen*4 - 4); break;
+        }
+        add(time, Action_RAMWrite, addr & ~3, RNG());
+    }
+
+    // register writes at random times: volume and pan changes, restarts, pitch changes
+    for (u64 time = 2000; time < end; time += Random(1000, 300000))
+    {
+        switch (Random(0, 3))
+        {
+        case 0:
+            add(time, Action_SPUWrite16, 0x04000400 + Random(0, 4)*0x10, Random(0, 0x37F));
+            break;
+        case 1:
+            add(time, Action_SPUWrite16, 0x04000422, 0x8800 | Random(0, 0x7F));
+            break;
+        case 2:
+            add(time, Action_SPUWrite32, 0x04000420, 0x0860407F);
+            add(time + Random(0, 3000), Action_SPUWrite32, 0x04000420, 0x8860407F);
+            break;
+        case 3:
+            add(time, Action_SPUWrite16, 0x04000448, 0x10000 - Random(600, 2500));
+            break;
+        }
+    }
+
+    // end of each frame
+    for (u64 time = 560190; time < end; time += 560190)
+        add(time, Action_Transfer, 0, 0);
+
+    std::stable_sort(script.begin(), script.end());
+    return script;
+}
+
+u32 Run(const std::vector<Action>& script, u32 batchsize, std::vector<s16>& output)
+{
+    std::mt19937 ramrng(1);
+    for (u32 i = 0; i <= RAMMask; i += 4)
+        *(u32*)&RAM[i] = ramrng();
+
+    NDS::ConsoleType = 0;
+    NDS::SysTimestamp = 0;
+    NDS::ARM7Timestamp = 0;
+    SPUEvent.Scheduled = false;
+
+    SPU::Reset();
+    SPU::SetMixBatchSize(batchsize);
+
+    // drops what the previous run left in the output buffer
+    s16 buf[4096 * 2];
+    SPU::ReadOutput(buf, 0);
+
+    output.clear();
+    u32 events = 0;
+    u64 now = 0;
+
+    // the event fires before the CPU does anything at the same time
+    for (size_t i = 0; i < script.size(); )
+    {
+        const Action& act = script[i];
+
+        if (SPUEvent.Scheduled && SPUEvent.Timestamp <= act.Time)
+        {
+            now = std::max(now, SPUEvent.Timestamp);
+            NDS::SysTimestamp = now;
+            NDS::ARM7Timestamp = now;
+
+            SPUEvent.Scheduled = false;
+            SPUEvent.Func(SPUEvent.Param);
+            events++;
+            continue;
+        }
+
+        now = act.Time;
+        NDS::SysTimestamp = now;
+        NDS::ARM7Timestamp = now;
+
+        switch (act.Type)
+        {
+        case Action_RAMWrite: NDS::ARM7Write32(act.Addr, act.Val); break;
+        case Action_SPUWrite16: SPU::Write16(act.Addr, act.Val); break;
+        case Action_SPUWrite32: SPU::Write32(act.Addr, act.Val); break;
+        case Action_Transfer:
+            {
+                SPU::TransferOutput();
+
+                int num = SPU::ReadOutput(buf, SPU::GetOutputSize());
+                output.insert(output.end(), buf, buf + num*2);
+            }
+            break;
+        }
+
+        i++;
+    }
+
+    SPU::Stop();
+
+    // the capture buffer is part of the result
+    const u32* capture = (const u32*)&RAM[CaptureAddr & RAMMask];
+    for (u32 i = 0; i < CaptureLen; i++)
+    {
+        output.push_back((s16)capture[i]);
+        output.push_back((s16)(capture[i] >> 16));
+    }
+
+    return events;
+}
+
+int main(int argc, char** argv)
+{
+    u32 samples = 200000;
+    u32 seed = 12345;
+    if (argc > 1) samples = strtoul(argv[1], nullptr, 0);
+    if (argc > 2) seed = strtoul(argv[2], nullptr, 0);
+
+    RNG.seed(seed);
+    std::vector<Action> script = MakeScript(samples);
+
+    SPU::Init();
+
+    int failures = 0;
+    const int interptypes[] = {0, 3};
+    for (int interp : interptypes)
+    {
+        SPU::SetInterpolation(interp);
+
+        std::vector<s16> ref, res;
+        u32 refevents = Run(script, 1, ref);
+        u32 resevents = Run(script, 16, res);
+
+        printf("interpolation %d: %zu samples, %u mix events one by one, %u batched (seed %u)\n",
+               interp, ref.size() / 2, refevents, resevents, seed);
+
+        if (ref.size() != res.size())
+        {
+            printf("output size mismatch: expected %zu, got %zu\n", ref.size(), res.size());
+            failures++;
+            continue;
+        }
+
+        int mismatches = 0;
+        for (size_t i = 0; i < ref.size(); i++)
+        {
+            if (ref[i] == res[i]) continue;
+
+            if (mismatches++ < 8)
+                printf("mismatch at sample %zu (%s): expected %04X, got %04X\n",
+                       i >> 1, (i & 1) ? "right" : "left", (u16)ref[i], (u16)res[i]);
+        }
+
+        if (mismatches)
+            printf("%d mismatches\n", mismatches);
+        failures += mismatches;
+    }
+
+    SPU::DeInit();
+    return failures ? 1 : 0;
+}
@@ -48,6 +48,9 @@ public:
     // for implementing DSP_PDATA/PADR DMA transfers
     std::uint16_t ProgramRead(std::uint32_t address) const;
     void ProgramWrite(std::uint32_t address, std::uint16_t value);
+    // to be called when program memory was changed behind the DSP's back
+    // (e.g. remapped), so that decoded code gets thrown away
+    void InvalidateProgramCache();
     std::uint16_t DataRead(std::uint16_t address, bool bypass_mmio = false);
     void DataWrite(std::uint16_t address, std::uint16_t value, bool bypass_mmio = false);
     std::uint16_t DataReadA32(std::uint32_t address) const;
@@ -71,6 +74,9 @@ public:
 
     // core
     void Run(unsigned cycle);
+    // cycles fast-forwarded through idle (branch to self) and polling loops
+    std::uint64_t GetIdleSkippedCycles() const;
+    std::uint64_t GetPollSkippedCycles() const;
 
     void SetSharedMemoryCallback(const SharedMemoryCallback& callback);
     void SetAHBMCallback(const AHBMCallback& callback);
@@ -1,11 +1,14 @@
 #pragma once
 #include <utility>
 #include <atomic>
+#include <cstring>
 #include <stdexcept>
 #include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
+#include <memory>
+#include <vector>
 #include "bit.h"
 #include "core_timing.h"
 #include "crash.h"
@@ -62,10 +65,19 @@ public:
 
     void Run(u64 cycles) {
         idle = false;
+        // anything could have been changed from outside since the last call
+        polling = false;
+        poll_head = NoPollHead;
+        poll_armed = false;
         for (u64 i = 0; i < cycles; ++i) {
-            if (idle) {
+            if (idle || polling) {
                 u64 skipped = core_timing.Skip(cycles - i - 1);
                 i += skipped;
+                if (idle)
+                    idle_skipped_cycles += skipped;
+                else
+                    poll_skipped_cycles += skipped;
+                polling = false;
 
                 // Skip additional tick so to let components fire interrupts
                 if (i < cycles - 1) {
@@ -74,29 +86,48 @@ public:
                 }
             }
 
-            for (std::size_t i = 0; i < 3; ++i) {
-                if (interrupt_pending[i].exchange(false)) {
-                    regs.ip[i] = 1;
+            if (any_interrupt_pending.load(std::memory_order_acquire)) {
+                any_interrupt_pending.exchange(false);
+
+                for (std::size_t i = 0; i < 3; ++i) {
+                    if (interrupt_pending[i].exchange(false)) {
+                        regs.ip[i] = 1;
+                    }
                 }
-            }
 
-            if (vinterrupt_pending.exchange(false)) {
-                regs.ipv = 1;
+                if (vinterrupt_pending.exchange(false)) {
+                    regs.ipv = 1;
+                }
             }
 
-            u16 opcode = mem.ProgramRead((regs.pc++) | (regs.prpage << 18));
-            auto& decoder = decoders[opcode];
+            u32 inst_pc = regs.pc;
+            const CachedInstruction* cached = FetchCached();
+            const Matcher<Interpreter>* decoder_ptr;
+            u16 opcode;
             u16 expand_value = 0;
-            if (decoder.NeedExpansion()) {
-                expand_value = mem.ProgramRead((regs.pc++) | (regs.prpage << 18));
+            if (cached) {
+                decoder_ptr = cached->decoder;
+                opcode = cached->opcode;
+                expand_value = cached->expand_value;
+                regs.pc += cached->size;
+            } else {
+                opcode = mem.ProgramRead((regs.pc++) | (regs.prpage << 18));
+                decoder_ptr = &decoders[opcode];
+                if (decoder_ptr->NeedExpansion()) {
+                    expand_value = mem.ProgramRead((regs.pc++) | (regs.prpage << 18));
+                }
             }
+            auto& decoder = *decoder_ptr;
 
+            // rep/bkrep iterations jump back too, they aren't polling loops
+            bool hw_loop = false;
             if (regs.rep) {
                 if (regs.repc == 0) {
                     regs.rep = false;
                 } else {
                     --regs.repc;
                     --regs.pc;
+                    hw_loop = true;
                 }
             }
 
@@ -107,6 +138,7 @@ public:
                 } else {
                     --regs.bkrep_stack[regs.bcn - 1].lc;
                     regs.pc = regs.bkrep_stack[regs.bcn - 1].start;
+                    hw_loop = true;
                 }
             }
 
@@ -142,17 +174,30 @@ public:
                 }
             }
 
+            if (!hw_loop && regs.pc <= inst_pc && inst_pc - regs.pc < MaxPollLoopSize) {
+                CheckPollLoop();
+            }
+
             core_timing.Tick();
         }
     }
 
+    u64 GetIdleSkippedCycles() const {
+        return idle_skipped_cycles;
+    }
+    u64 GetPollSkippedCycles() const {
+        return poll_skipped_cycles;
+    }
+
     void SignalInterrupt(u32 i) {
         interrupt_pending[i] = true;
+        any_interrupt_pending = true;
     }
     void SignalVectoredInterrupt(u32 address, bool context_switch) {
         vinterrupt_address = address;
         vinterrupt_pending = true;
         vinterrupt_context_switch = context_switch;
+        any_interrupt_pending = true;
     }
 
     using instruction_return_type = void;
@@ -2954,9 +2999,193 @@ private:
     std::atomic<bool> vinterrupt_pending{false};
     std::atomic<bool> vinterrupt_context_switch;
     std::atomic<u32> vinterrupt_address;
+    // set along with any of the above, so the common case is a single load
+    std::atomic<bool> any_interrupt_pending{false};
 
     bool idle = false;
 
+    // polling loop detection
+    //
+    // a short backward jump (not a rep/bkrep iteration) starts a new iteration of a
+    // potential polling loop. a loop only qualifies if it reads MMIO and writes nothing:
+    // once two consecutive such iterations start from the same state, the next ones will
+    // do the same until an interrupt comes in or a peripheral changes state, so time is
+    // fast-forwarded like for idle loops.
+    // writes from the outside only happen between Run() calls.
+    //
+    // only the registers a load/test/branch loop can change are compared. configuration
+    // (step/modulo, ar/arp, shift and saturation modes, shadows) is left out, it's only
+    // touched by setup code.
+    struct PollState {
+        std::array<u64, 2> a, b;
+        std::array<u32, 2> p;
+        std::array<u16, 8> r;
+        std::array<u16, 2> x, y;
+        std::array<u16, 2> pe;
+        u16 p0h_cbs;
+        u16 sp, mixp, page, sv;
+        u16 flags;
+        u16 vtr0, vtr1;
+        u16 repc, lp, bcn, lc;
+        u16 ie, ip;
+
+        bool operator==(const PollState& other) const {
+            return std::memcmp(this, &other, sizeof(PollState)) == 0;
+        }
+    };
+    static_assert(std::has_unique_object_representations_v<PollState>);
+    static constexpr u32 MaxPollLoopSize = 16;
+    static constexpr u32 NoPollHead = 0xFFFFFFFF;
+
+    bool polling = false;
+    u32 poll_head = NoPollHead;
+    u32 poll_write_count = 0;
+    u32 poll_read_count = 0;
+    bool poll_armed = false;
+    PollState poll_state;
+
+    u64 idle_skipped_cycles = 0;
+    u64 poll_skipped_cycles = 0;
+
+    void GetPollState(PollState& state) {
+        state.a = regs.a;
+        state.b = regs.b;
+        state.p = regs.p;
+        state.r = regs.r;
+        state.x = regs.x;
+        state.y = regs.y;
+        state.pe = regs.pe;
+        state.p0h_cbs = regs.p0h_cbs;
+        state.sp = regs.sp;
+        state.mixp = regs.mixp;
+        state.page = regs.page;
+        state.sv = regs.sv;
+        state.vtr0 = regs.vtr0;
+        state.vtr1 = regs.vtr1;
+        state.flags = regs.fz | (regs.fm << 1) | (regs.fn << 2) | (regs.fv << 3) |
+                      (regs.fe << 4) | (regs.fc0 << 5) | (regs.fc1 << 6) | (regs.flm << 7) |
+                      (regs.fvl << 8) | (regs.fr << 9);
+        state.repc = regs.repc;
+        state.lp = regs.lp;
+        state.bcn = regs.bcn;
+        state.lc = regs.Lc();
+        state.ie = regs.ie;
+        state.ip = regs.ip[0] | (regs.ip[1] << 1) | (regs.ip[2] << 2) | (regs.ipv << 3);
+    }
+
+    void CheckPollLoop() {
+        u32 write_count = mem.WriteCount();
+        u32 read_count = mem.MMIOReadCount();
+
+        if (poll_head != regs.pc) {
+            poll_head = regs.pc;
+            poll_write_count = write_count;
+            poll_read_count = read_count;
+            poll_armed = false;
+            return;
+        }
+
+        bool candidate = write_count == poll_write_count && read_count != poll_read_count;
+        poll_write_count = write_count;
+        poll_read_count = read_count;
+        if (!candidate) {
+            poll_armed = false;
+            return;
+        }
+
+        PollState state;
+        GetPollState(state);
+        if (poll_armed && state == poll_state) {
+            polling = true;
+            return;
+        }
+
+        poll_state = state;
+        poll_armed = true;
+    }
+
+    // decoded-block cache
+    //
+    // runs of consecutive instructions are fetched and decoded once, and kept until
+    // program memory changes (see SharedMemory::ProgramGeneration()).
+    // blocks don't need to end at branches: an instruction is only taken from the
+    // current block if pc is exactly where it was decoded from, so jumps, rep and
+    // bkrep loops and interrupts simply make us look up the block at the new pc.
+    // the rep/bkrep bookkeeping itself is done the same way as without the cache.
+    struct CachedInstruction {
+        u32 address;
+        const Matcher<Interpreter>* decoder;
+        u16 opcode;
+        u16 expand_value;
+        u32 size;
+    };
+
+    struct CachedBlock {
+        u32 generation;
+        std::vector<CachedInstruction> instructions;
+    };
+
+    static constexpr u32 MaxBlockSize = 32;
+    // only program memory proper is cached, code running from data memory is rare
+    static constexpr u32 BlockCacheSize = 0x20000;
+
+    std::vector<std::unique_ptr<CachedBlock>> block_cache;
+    CachedBlock* cur_block = nullptr;
+    u32 cur_index = 0;
+
+    CachedBlock* GetBlock(u32 address) {
+        if (block_cache.empty())
+            block_cache.resize(BlockCacheSize);
+
+        u32 generation = mem.ProgramGeneration();
+        auto& block = block_cache[address];
+        if (block && block->generation == generation)
+            return block.get();
+
+        if (!block)
+            block = std::make_unique<CachedBlock>();
+        block->generation = generation;
+        block->instructions.clear();
+
+        u32 pc = address;
+        while (block->instructions.size() < MaxBlockSize && pc < BlockCacheSize) {
+            CachedInstruction inst;
+            inst.address = pc;
+            inst.opcode = mem.ProgramRead(pc);
+            inst.decoder = &decoders[inst.opcode];
+            inst.expand_value = 0;
+            inst.size = 1;
+            if (inst.decoder->NeedExpansion()) {
+                if (pc + 1 >= BlockCacheSize)
+                    break;
+                inst.expand_value = mem.ProgramRead(pc + 1);
+                inst.size = 2;
+            }
+            block->instructions.push_back(inst);
+            pc += inst.size;
+        }
+
+        return block.get();
+    }
+
+    // returns the decoded instruction at pc, or nullptr if it has to be fetched the slow way
+    const CachedInstruction* FetchCached() {
+        u32 address = regs.pc | (regs.prpage << 18);
+        if (address >= BlockCacheSize)
+            return nullptr;
+
+        if (!(cur_block && cur_index < cur_block->instructions.size() &&
+              cur_block->instructions[cur_index].address == address &&
+              cur_block->generation == mem.ProgramGeneration())) {
+            cur_block = GetBlock(address);
+            cur_index = 0;
+            if (cur_block->instructions.empty())
+                return nullptr;
+        }
+
+        return &cur_block->instructions[cur_index++];
+    }
+
     u64 GetAcc(RegName name) const {
         switch (name) {
         case RegName::a0:
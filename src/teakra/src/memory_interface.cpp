@@ -15,11 +15,13 @@ u16 MemoryInterface::ProgramRead(u32 address) const {
     return shared_memory.ReadWord(address);
 }
 void MemoryInterface::ProgramWrite(u32 address, u16 value) {
+    ++write_count;
     shared_memory.WriteWord(address, value);
 }
 u16 MemoryInterface::DataRead(u16 address, bool bypass_mmio) {
     if (memory_interface_unit.InMMIO(address) && !bypass_mmio) {
         ASSERT(mmio != nullptr);
+        ++mmio_read_count;
         return mmio->Read(memory_interface_unit.ToMMIO(address));
     }
     u32 converted = memory_interface_unit.ConvertDataAddress(address);
@@ -27,6 +29,7 @@ u16 MemoryInterface::DataRead(u16 address, bool bypass_mmio) {
     return value;
 }
 void MemoryInterface::DataWrite(u16 address, u16 value, bool bypass_mmio) {
+    ++write_count;
     if (memory_interface_unit.InMMIO(address) && !bypass_mmio) {
         ASSERT(mmio != nullptr);
         return mmio->Write(memory_interface_unit.ToMMIO(address), value);
@@ -40,16 +43,19 @@ u16 MemoryInterface::DataReadA32(u32 address) const {
     return shared_memory.ReadWord(converted);
 }
 void MemoryInterface::DataWriteA32(u32 address, u16 value) {
+    ++write_count;
     u32 converted = (address & ((MemoryInterfaceUnit::DataMemoryBankSize*2)-1))
         + MemoryInterfaceUnit::DataMemoryOffset;
     shared_memory.WriteWord(converted, value);
 }
 u16 MemoryInterface::MMIORead(u16 address) {
     ASSERT(mmio != nullptr);
+    ++mmio_read_count;
     // according to GBATek ("DSi Teak I/O Ports (on ARM9 Side)"), these are mirrored
     return mmio->Read(address & (MemoryInterfaceUnit::MMIOSize - 1));
 }
 void MemoryInterface::MMIOWrite(u16 address, u16 value) {
+    ++write_count;
     ASSERT(mmio != nullptr);
     mmio->Write(address & (MemoryInterfaceUnit::MMIOSize - 1), value);
 }
@@ -3,6 +3,7 @@
 #include <array>
 #include "common_types.h"
 #include "crash.h"
+#include "shared_memory.h"
 
 namespace Teakra {
 
@@ -57,6 +58,9 @@ public:
     void SetMMIO(MMIORegion& mmio);
     u16 ProgramRead(u32 address) const;
     void ProgramWrite(u32 address, u16 value);
+    u32 ProgramGeneration() const {
+        return shared_memory.ProgramGeneration();
+    }
     u16 DataRead(u16 address, bool bypass_mmio = false); // not const because it can be a FIFO register
     void DataWrite(u16 address, u16 value, bool bypass_mmio = false);
     u16 DataReadA32(u32 address) const;
@@ -64,10 +68,21 @@ public:
     u16 MMIORead(u16 address);
     void MMIOWrite(u16 address, u16 value);
 
+    // bumped on every write and on every MMIO read, for the interpreter's polling loop
+    // detection
+    u32 WriteCount() const {
+        return write_count;
+    }
+    u32 MMIOReadCount() const {
+        return mmio_read_count;
+    }
+
 private:
     SharedMemory& shared_memory;
     MemoryInterfaceUnit& memory_interface_unit;
     MMIORegion* mmio;
+    u32 write_count = 0;
+    u32 mmio_read_count = 0;
 };
 
 } // namespace Teakra
@@ -31,4 +31,11 @@ void Processor::SignalVectoredInterrupt(u32 address, bool context_switch) {
     impl->interpreter.SignalVectoredInterrupt(address, context_switch);
 }
 
+u64 Processor::GetIdleSkippedCycles() const {
+    return impl->interpreter.GetIdleSkippedCycles();
+}
+u64 Processor::GetPollSkippedCycles() const {
+    return impl->interpreter.GetPollSkippedCycles();
+}
+
 } // namespace Teakra
@@ -17,6 +17,9 @@ public:
     void SignalInterrupt(u32 i);
     void SignalVectoredInterrupt(u32 address, bool context_switch);
 
+    u64 GetIdleSkippedCycles() const;
+    u64 GetPollSkippedCycles() const;
+
 private:
     struct Impl;
     std::unique_ptr<Impl> impl;
@@ -1,6 +1,7 @@
 #pragma once
 #include <array>
 #include <cstdio>
+#include <functional>
 #include "common_types.h"
 
 namespace Teakra {
@@ -9,9 +10,21 @@ struct SharedMemory {
         return read_external16(word_address << 1);
     }
     void WriteWord(u32 word_address, u16 value) {
+        if (!(word_address & ProgramAliasBit))
+            ++program_generation;
         write_external16(word_address << 1, value);
     }
 
+    // bumped whenever program memory may have changed, for the decoded-block cache
+    // (word addresses with this bit clear are in program memory)
+    static constexpr u32 ProgramAliasBit = 0x20000;
+    void InvalidateProgram() {
+        ++program_generation;
+    }
+    u32 ProgramGeneration() const {
+        return program_generation;
+    }
+
     void SetExternalMemoryCallback(
            std::function<u16(u32)> read16, std::function<void(u32, u16)> write16) {
 
@@ -21,5 +34,7 @@ struct SharedMemory {
 
     std::function<u16(u32)> read_external16;
     std::function<void(u32, u16)> write_external16;
+
+    u32 program_generation = 0;
 };
 } // namespace Teakra
@@ -74,6 +74,13 @@ void Teakra::Run(unsigned cycle) {
     impl->processor.Run(cycle);
 }
 
+std::uint64_t Teakra::GetIdleSkippedCycles() const {
+    return impl->processor.GetIdleSkippedCycles();
+}
+std::uint64_t Teakra::GetPollSkippedCycles() const {
+    return impl->processor.GetPollSkippedCycles();
+}
+
 bool Teakra::SendDataIsEmpty(std::uint8_t index) const {
     return !impl->apbp_from_cpu.IsDataReady(index);
 }
@@ -150,6 +157,9 @@ std::uint16_t Teakra::ProgramRead(std::uint32_t address) const {
 void Teakra::ProgramWrite(std::uint32_t address, std::uint16_t value) {
     impl->memory_interface.ProgramWrite(address, value);
 }
+void Teakra::InvalidateProgramCache() {
+    impl->shared_memory.InvalidateProgram();
+}
 std::uint16_t Teakra::DataRead(std::uint16_t address, bool bypass_mmio) {
     return impl->memory_interface.DataRead(address, bypass_mmio);
 }